@@ -10,4 +10,7 @@
 /* Is memory debugging enabled */
 #undef MEMORY_DEBUG
 
+/* Are offsets 64 bits wide */
+#undef LARGE_OFFSETS
+
 
@@ -0,0 +1,488 @@
+/*
+	System: Structured text retrieval tool sgrep.
+	Module: cache.c
+	Description: On-disk cache of evaluated subexpressions for index
+		     queries (-k). The same queries against the same index
+		     are often run again and again, so the region lists of
+		     evaluated operator subtrees are kept in files and read
+		     back instead of evaluating the subtree again.
+	Copyright: University of Helsinki, Dept. of Computer Science
+		   Distributed under GNU General Public Lisence
+		   See file COPYING for details
+*/
+
+/*
+ * Every entry is a file <hash>.sgc in the cache directory. The key of
+ * an entry is a canonical form of the optimized subtree, preceded by
+ * the identity of the index file (device, inode, size and
+ * modification time), so rebuilding the index invalidates old
+ * entries. The key is stored in the entry too, and checked when
+ * reading, so hash collisions only cost a miss.
+ *
+ * The modification time of an entry is the time it was last used.
+ * When the entries take more than SUBEXPR_CACHE_SIZE bytes, the least
+ * recently used ones are removed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define SGREP_LIBRARY
+#include "sgrep.h"
+
+#if HAVE_UNIX
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <unistd.h>
+# include <dirent.h>
+# include <utime.h>
+#endif
+
+#define CACHE_MAGIC "SGREPCACHE1\n"
+#define CACHE_MAGIC_LEN 12
+#define CACHE_BYTE_ORDER 0x01020304
+#define CACHE_SUFFIX ".sgc"
+
+struct SubexprCacheStruct {
+    SgrepData *sgrep;
+    char *dir;
+    SgrepString *identity;	/* Index identity and options, starts keys */
+    int stored;			/* Entries written by this run */
+};
+
+/* Header of an entry file, written after CACHE_MAGIC */
+struct EntryHeader {
+    int byte_order;
+    int offset_size;
+    int key_length;
+    int nested;
+    int regions;
+};
+
+/*
+ * Opens the cache in directory dir for queries against index_file.
+ * Returns NULL if the cache can't be used.
+ */
+SubexprCache *open_subexpr_cache(SgrepData *sgrep, const char *dir,
+				 const char *index_file) {
+#if HAVE_UNIX
+    SubexprCache *cache;
+    struct stat st;
+    char buf[256];
+
+    if (stat(dir,&st)!=0) {
+	sgrep_error(sgrep,"Cache directory '%s': %s\n",dir,strerror(errno));
+	return NULL;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+	sgrep_error(sgrep,"Cache directory '%s' is not a directory\n",dir);
+	return NULL;
+    }
+    if (stat(index_file,&st)!=0) {
+	sgrep_error(sgrep,"stat '%s': %s\n",index_file,strerror(errno));
+	return NULL;
+    }
+    cache=sgrep_new(SubexprCache);
+    cache->sgrep=sgrep;
+    cache->dir=sgrep_strdup(dir);
+    cache->stored=0;
+    sprintf(buf,"%lu:%lu:%lu:%lu:%d\n",
+	    (unsigned long)st.st_dev,(unsigned long)st.st_ino,
+	    (unsigned long)st.st_size,(unsigned long)st.st_mtime,
+	    sgrep->ignore_case);
+    cache->identity=init_string(sgrep,strlen(buf),buf);
+    return cache;
+#else
+    sgrep_error(sgrep,"Subexpression cache is not supported here\n");
+    return NULL;
+#endif
+}
+
+static void append_string(SgrepString *to, const SgrepString *from) {
+    size_t i;
+    for(i=0;i<from->length;i++) {
+	string_push(to,(unsigned char)from->s[i]);
+    }
+}
+
+static int compare_strings(const SgrepString *a, const SgrepString *b) {
+    size_t len=(a->length<b->length) ? a->length : b->length;
+    int c=memcmp(a->s,b->s,len);
+    if (c) return c;
+    return (a->length<b->length) ? -1 : (a->length>b->length);
+}
+
+/*
+ * Gives the canonical form of the subtree starting from node, or NULL
+ * if it contains constant lists, which are not cached. The
+ * parameters of commutative operators are put to a fixed order.
+ */
+static SgrepString *subtree_key(SgrepData *sgrep, const ParseTreeNode *node) {
+    SgrepString *key,*l,*r,*tmp;
+    char buf[64];
+
+    if (node->oper==PHRASE) {
+	if (node->leaf==NULL || node->leaf->phrase==NULL) return NULL;
+	key=new_string(sgrep,node->leaf->phrase->length+16);
+	sprintf(buf,"%d:",(int)node->leaf->phrase->length);
+	string_cat(key,buf);
+	append_string(key,node->leaf->phrase);
+	return key;
+    }
+    l=subtree_key(sgrep,node->left);
+    if (l==NULL) return NULL;
+    r=NULL;
+    if (node->right) {
+	r=subtree_key(sgrep,node->right);
+	if (r==NULL) {
+	    delete_string(l);
+	    return NULL;
+	}
+	if ((node->oper==OR || node->oper==EQUAL || node->oper==NEAR) &&
+	    compare_strings(l,r)>0) {
+	    tmp=l;
+	    l=r;
+	    r=tmp;
+	}
+    }
+    key=new_string(sgrep,l->length+((r) ? r->length : 0)+32);
+    sprintf(buf,"(%s %d ",give_oper_name(node->oper),node->number);
+    string_cat(key,buf);
+    append_string(key,l);
+    delete_string(l);
+    if (r) {
+	string_push(key,' ');
+	append_string(key,r);
+	delete_string(r);
+    }
+    string_push(key,')');
+    return key;
+}
+
+/*
+ * Gives the full key of the entry for the subtree, or NULL if the
+ * subtree can't be cached
+ */
+static SgrepString *entry_key(SubexprCache *cache, const ParseTreeNode *node) {
+    SgrepString *tree,*key;
+
+    if (node->oper==PHRASE) return NULL; /* These come from the index */
+    tree=subtree_key(cache->sgrep,node);
+    if (tree==NULL) return NULL;
+    key=new_string(cache->sgrep,cache->identity->length+tree->length+1);
+    append_string(key,cache->identity);
+    append_string(key,tree);
+    delete_string(tree);
+    return key;
+}
+
+/*
+ * Gives the file name of the entry for key
+ */
+static SgrepString *entry_path(SubexprCache *cache, const SgrepString *key) {
+    unsigned long long hash=14695981039346656037ULL; /* FNV-1a */
+    SgrepString *path;
+    char buf[40];
+    size_t i;
+
+    for(i=0;i<key->length;i++) {
+	hash^=(unsigned char)key->s[i];
+	hash*=1099511628211ULL;
+    }
+    path=init_string(cache->sgrep,strlen(cache->dir),cache->dir);
+    sprintf(buf,"/%016llx"CACHE_SUFFIX,hash);
+    string_cat(path,buf);
+    return path;
+}
+
+/*
+ * Opens the entry for the subtree starting from node and reads its
+ * header and key. Returns the file positioned at the regions, or NULL
+ * if there is no valid entry for it. The file name is given in path.
+ */
+static FILE *open_entry(SubexprCache *cache, const ParseTreeNode *node,
+			struct EntryHeader *h, SgrepString **path) {
+    SgrepData *sgrep=cache->sgrep;
+    SgrepString *key;
+    char magic[CACHE_MAGIC_LEN];
+    char *stored_key=NULL;
+    FILE *f;
+
+    *path=NULL;
+    key=entry_key(cache,node);
+    if (key==NULL) return NULL;
+    *path=entry_path(cache,key);
+    f=fopen(string_to_char(*path),"rb");
+    if (f==NULL) goto out;
+    if (fread(magic,CACHE_MAGIC_LEN,1,f)!=1 ||
+	memcmp(magic,CACHE_MAGIC,CACHE_MAGIC_LEN)!=0 ||
+	fread(h,sizeof(*h),1,f)!=1 ||
+	h->byte_order!=CACHE_BYTE_ORDER ||
+	h->offset_size!=(int)sizeof(Offset) ||
+	h->key_length!=(int)key->length ||
+	h->regions<0) {
+	goto fail;
+    }
+    stored_key=(char *)sgrep_malloc(h->key_length+1);
+    if (fread(stored_key,1,h->key_length,f)!=(size_t)h->key_length ||
+	memcmp(stored_key,key->s,key->length)!=0) {
+	goto fail;
+    }
+    goto out;
+
+ fail:
+    fclose(f);
+    f=NULL;
+ out:
+    if (stored_key) sgrep_free(stored_key);
+    delete_string(key);
+    return f;
+}
+
+/*
+ * Tells whether there is an entry for the subtree starting from node,
+ * without reading it.
+ */
+int cache_has_entry(SubexprCache *cache, const ParseTreeNode *node) {
+    SgrepString *path;
+    struct EntryHeader h;
+    FILE *f;
+
+    f=open_entry(cache,node,&h,&path);
+    if (f) fclose(f);
+    if (path) delete_string(path);
+    return f!=NULL;
+}
+
+/*
+ * Reads the entry for the subtree starting from node. Returns the
+ * region list, or NULL if there is no entry for it.
+ */
+RegionList *cache_lookup(SubexprCache *cache, const ParseTreeNode *node) {
+    SgrepData *sgrep=cache->sgrep;
+    SgrepString *path;
+    struct EntryHeader h;
+    RegionList *list=NULL;
+    FILE *f;
+
+    f=open_entry(cache,node,&h,&path);
+    if (f==NULL) goto out;
+    list=new_contiguous_region_list(sgrep);
+    reserve_region_array(list,h.regions);
+    if (fread(list->array.starts,sizeof(Offset),h.regions,f)!=
+	(size_t)h.regions ||
+	fread(list->array.ends,sizeof(Offset),h.regions,f)!=
+	(size_t)h.regions) {
+	delete_region_list(list);
+	list=NULL;
+	goto out;
+    }
+    list->length=h.regions;
+    list->nested=h.nested;
+#if HAVE_UNIX
+    /* Mark the entry recently used */
+    utime(string_to_char(path),NULL);
+#endif
+
+ out:
+    if (f) fclose(f);
+    if (path) delete_string(path);
+    sgrep_lock(sgrep);
+    if (list) stats.cache_hits++; else stats.cache_misses++;
+    sgrep_unlock(sgrep);
+    return list;
+}
+
+/*
+ * Writes the regions of list, first start points and then end points.
+ * Returns the number of regions written, which for lists with
+ * duplicate regions is less than LIST_SIZE(), or -1 on error.
+ */
+static int write_regions(RegionList *list, FILE *f) {
+    ListIterator p;
+    Region r;
+    Offset buf[1024];
+    int pass,n,total;
+
+    if (LIST_IS_CONTIGUOUS(list)) {
+	start_region_search(list,&p);
+	n=LIST_SIZE(list);
+	if (fwrite(p.array.starts,sizeof(Offset),n,f)!=(size_t)n ||
+	    fwrite(p.array.ends,sizeof(Offset),n,f)!=(size_t)n) {
+	    return -1;
+	}
+	return n;
+    }
+    total=0;
+    for(pass=0;pass<2;pass++) {
+	start_region_search(list,&p);
+	get_region(&p,&r);
+	n=0;
+	while(r.start!=-1) {
+	    buf[n++]=(pass==0) ? r.start : r.end;
+	    if (pass==0) total++;
+	    if (n==1024) {
+		if (fwrite(buf,sizeof(Offset),n,f)!=(size_t)n) return -1;
+		n=0;
+	    }
+	    get_region(&p,&r);
+	}
+	if (fwrite(buf,sizeof(Offset),n,f)!=(size_t)n) return -1;
+    }
+    return total;
+}
+
+/*
+ * Stores the evaluated list of the subtree starting from node. The
+ * entry is written to a temporary file first and then renamed, so
+ * that other sgrep processes never see half written entries.
+ */
+void cache_store(SubexprCache *cache, const ParseTreeNode *node,
+		 RegionList *list) {
+    SgrepData *sgrep=cache->sgrep;
+    SgrepString *key,*path,*tmp;
+    struct EntryHeader h;
+    char buf[64];
+    FILE *f;
+    int ok,n;
+
+    if (LIST_IS_CHARS(list)) return;
+    /* Lists which would push everything else out are not worth it */
+    if ((double)LIST_SIZE(list)*2*sizeof(Offset)>SUBEXPR_CACHE_SIZE/4) {
+	return;
+    }
+    key=entry_key(cache,node);
+    if (key==NULL) return;
+    path=entry_path(cache,key);
+    tmp=init_string(sgrep,path->length,path->s);
+#if HAVE_UNIX
+    sprintf(buf,".%d.%p",(int)getpid(),(void *)node);
+#else
+    sprintf(buf,".%p",(void *)node);
+#endif
+    string_cat(tmp,buf);
+
+    f=fopen(string_to_char(tmp),"wb");
+    if (f==NULL) {
+	sgrep_error(sgrep,"Can't write cache entry '%s': %s\n",
+		    string_to_char(tmp),strerror(errno));
+	goto out;
+    }
+    h.byte_order=CACHE_BYTE_ORDER;
+    h.offset_size=sizeof(Offset);
+    h.key_length=key->length;
+    h.nested=list->nested;
+    h.regions=LIST_SIZE(list);
+    ok=fwrite(CACHE_MAGIC,CACHE_MAGIC_LEN,1,f)==1 &&
+	fwrite(&h,sizeof(h),1,f)==1 &&
+	fwrite(key->s,1,key->length,f)==key->length &&
+	(n=write_regions(list,f))>=0;
+    if (ok && n!=h.regions) {
+	/* Duplicates were dropped, fix the header */
+	h.regions=n;
+	ok=fseek(f,CACHE_MAGIC_LEN,SEEK_SET)==0 &&
+	    fwrite(&h,sizeof(h),1,f)==1;
+    }
+    if (fclose(f)!=0) ok=0;
+    if (!ok || rename(string_to_char(tmp),string_to_char(path))!=0) {
+	sgrep_error(sgrep,"Can't write cache entry '%s': %s\n",
+		    string_to_char(path),strerror(errno));
+	remove(string_to_char(tmp));
+	goto out;
+    }
+    sgrep_lock(sgrep);
+    stats.cache_stores++;
+    cache->stored++;
+    sgrep_unlock(sgrep);
+
+ out:
+    delete_string(tmp);
+    delete_string(path);
+    delete_string(key);
+}
+
+#if HAVE_UNIX
+struct CacheFile {
+    char *name;
+    time_t used;
+    double size;
+};
+
+static int cache_file_compare(const void *a, const void *b) {
+    time_t x=((const struct CacheFile *)a)->used;
+    time_t y=((const struct CacheFile *)b)->used;
+    return (x<y) ? -1 : (x>y);
+}
+
+/*
+ * Removes the least recently used entries, until the entries take at
+ * most SUBEXPR_CACHE_SIZE bytes
+ */
+static void evict_entries(SubexprCache *cache) {
+    SgrepData *sgrep=cache->sgrep;
+    struct CacheFile *files=NULL;
+    int n=0,allocated=0,i;
+    double total=0;
+    struct dirent *e;
+    struct stat st;
+    SgrepString *path;
+    size_t len;
+    DIR *d;
+
+    d=opendir(cache->dir);
+    if (d==NULL) return;
+    path=new_string(sgrep,strlen(cache->dir)+32);
+    while((e=readdir(d))!=NULL) {
+	len=strlen(e->d_name);
+	if (len<=strlen(CACHE_SUFFIX) ||
+	    strcmp(e->d_name+len-strlen(CACHE_SUFFIX),CACHE_SUFFIX)!=0) {
+	    continue;
+	}
+	string_clear(path);
+	string_cat(path,cache->dir);
+	string_push(path,'/');
+	string_cat(path,e->d_name);
+	if (stat(string_to_char(path),&st)!=0) continue;
+	if (n==allocated) {
+	    allocated=(allocated) ? allocated*2 : 64;
+	    files=(struct CacheFile *)sgrep_realloc(
+		files,allocated*sizeof(struct CacheFile));
+	}
+	files[n].name=sgrep_strdup(string_to_char(path));
+	files[n].used=st.st_mtime;
+	files[n].size=(double)st.st_size;
+	total+=files[n].size;
+	n++;
+    }
+    closedir(d);
+
+    if (total>SUBEXPR_CACHE_SIZE) {
+	qsort(files,n,sizeof(struct CacheFile),cache_file_compare);
+	for(i=0;i<n && total>SUBEXPR_CACHE_SIZE;i++) {
+	    if (unlink(files[i].name)==0) {
+		total-=files[i].size;
+		stats.cache_evictions++;
+	    }
+	}
+    }
+    for(i=0;i<n;i++) sgrep_free(files[i].name);
+    if (files) sgrep_free(files);
+    delete_string(path);
+}
+#endif
+
+/*
+ * Closes the cache. If this run added entries, the cache is trimmed
+ * to its size budget.
+ */
+void close_subexpr_cache(SubexprCache *cache) {
+    SGREPDATA(cache);
+
+#if HAVE_UNIX
+    if (cache->stored) evict_entries(cache);
+#endif
+    delete_string(cache->identity);
+    sgrep_free(cache->dir);
+    sgrep_free(cache);
+}
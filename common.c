@@ -53,6 +53,7 @@ ParseTreeNode *parse_and_optimize(SgrepData *sgrep,const char *query,
 	concat->parent=NULL;
 	concat->refcount=1;
 	concat->result=NULL;
+	clear_node_plan(concat);
 	root=concat;
     };
     return root;
@@ -282,13 +283,13 @@ int sgrep_progress(SgrepData *sgrep,char *format, ...) {
  * Data structure representing a list of input files
  */
 typedef struct {
-    int start;	/* Start index of a file */
-    int length;	/* Length of a file */
+    Offset start;	/* Start index of a file */
+    Offset length;	/* Length of a file */
     char *name;	/* Name of the file, NULL if stdin */
 } OneFile;
 struct FileListStruct {
     SgrepData *sgrep;
-    int total_size;   /* Total length of all files in bytes */
+    Offset total_size; /* Total length of all files in bytes */
     int num_files;    /* How many files */
     int allocated;    /* How many OneFile entries allocated */
     OneFile *files;   /* Since this list must be binary searchable, files
@@ -323,7 +324,7 @@ FileList *new_flist(SgrepData *sgrep) {
  * Adds a file to filelist *
  */
 
-void flist_add_known(FileList *ifs, const char *name, int length) {
+void flist_add_known(FileList *ifs, const char *name, Offset length) {
     SGREPDATA(ifs);
     if (ifs->num_files>=ifs->allocated) {
 	ifs->files=(OneFile *)
@@ -365,7 +366,7 @@ int flist_exists(FileList *list, const char *name) {
  */
 int flist_add(FileList *ifs, const char *name) {
     FILE *fd=NULL;
-    int ls=0;
+    long ls=0;
     SGREPDATA(ifs);
     TempFile *temp=NULL;
     
@@ -410,6 +411,13 @@ int flist_add(FileList *ifs, const char *name) {
 	sgrep_error(sgrep,"Ignoring zero sized file '%s'\n",name);
 	return SGREP_ERROR;
     }
+    if (ls>OFFSET_MAX-ifs->total_size) {
+	sgrep_error(sgrep,"File '%s': total input size is too large.%s\n",
+		    name,(sizeof(Offset)<8) ? 
+		    " Configure sgrep with --enable-large-offsets." : "");
+	ifs->last_errno=EFBIG;
+	return SGREP_ERROR;
+    }
     /* Found a valid file */
     /* sgrep_progress(sgrep,"file '%s' start=%d len=%d\n",
        name,ifs->total_size,ls); */
@@ -511,16 +519,16 @@ const char *flist_name(const FileList *list, int n) {
     return list->files[n].name;
 }
 
-int flist_length(const FileList *list, int n) {
+Offset flist_length(const FileList *list, int n) {
     if (n<0 || n>=list->num_files) return SGREP_ERROR;
     return list->files[n].length;
 }
-int flist_start(const FileList *list, int n) {
+Offset flist_start(const FileList *list, int n) {
     if (n<0 || n>=list->num_files) return SGREP_ERROR;
     return list->files[n].start;
 }
 
-int flist_total(const FileList *list) {
+Offset flist_total(const FileList *list) {
     return list->total_size;
 }
 int flist_files(const FileList *list) {
@@ -532,7 +540,7 @@ int flist_files(const FileList *list) {
  * resides using binary search 
  * returns -1 if region is outside file list 
  */
-int flist_search(const FileList *output_files, int s)
+int flist_search(const FileList *output_files, Offset s)
 {
 	int bs,be,bm;
 
@@ -661,26 +669,156 @@ FileList *check_files(SgrepData *sgrep, int argc, char *argv[],
 }
 
 
+/*
+ * The evaluation arena. Operators create and delete lots of short
+ * lived region lists, so the ListNodes of deleted lists are put to a
+ * free list and handed out again instead of going through malloc.
+ * The arena also keeps the temporary region stack of evaluator between
+ * evaluations. The arena is opened by eval() and lives until
+ * delete_eval_arena() releases everything at once, so that
+ * run_one_by_one() can reuse the same nodes for every file.
+ */
+struct EvalArenaStruct {
+    ListNode *free_nodes;	/* Free list of ListNodes */
+    int free_count;		/* Number of nodes in free list */
+    Region *stack;		/* Temporary stack, when not taken */
+    int stack_size;
+};
+
+/* Maximum number of ListNodes kept in the free list. Large lists are
+ * deleted only once, there is no point in hoarding their nodes */
+#define MAX_FREE_NODES 4096
+
+void open_eval_arena(SgrepData *sgrep) {
+    if (sgrep->arena) return;
+    sgrep->arena=sgrep_new(struct EvalArenaStruct);
+    sgrep->arena->free_nodes=NULL;
+    sgrep->arena->free_count=0;
+    sgrep->arena->stack=NULL;
+    sgrep->arena->stack_size=0;
+}
+
+/*
+ * Gives the temporary stack of the arena. *size is the minimum size
+ * wanted, and is set to the real size of the stack. If the stack is
+ * already taken by an evaluation running in another thread, a new
+ * stack is allocated.
+ */
+Region *arena_take_stack(SgrepData *sgrep, int *size) {
+    struct EvalArenaStruct *arena=sgrep->arena;
+    Region *stack;
+    int stack_size;
+
+    assert(arena);
+    sgrep_lock(sgrep);
+    stack=arena->stack;
+    stack_size=arena->stack_size;
+    arena->stack=NULL;
+    sgrep_unlock(sgrep);
+    if (stack==NULL || stack_size<*size) {
+	if (stack) sgrep_free(stack);
+	stack=(Region *)sgrep_malloc(*size*sizeof(Region));
+	stack_size=*size;
+    }
+    *size=stack_size;
+    return stack;
+}
+
+/*
+ * Gives the (possibly reallocated) temporary stack back to arena.
+ * When two stacks meet, the larger one is kept.
+ */
+void arena_return_stack(SgrepData *sgrep, Region *stack, int size) {
+    struct EvalArenaStruct *arena=sgrep->arena;
+
+    Region *old;
+
+    assert(arena);
+    sgrep_lock(sgrep);
+    old=arena->stack;
+    if (old==NULL || arena->stack_size<size) {
+	arena->stack=stack;
+	arena->stack_size=size;
+    } else {
+	old=stack;
+    }
+    sgrep_unlock(sgrep);
+    if (old) sgrep_free(old);
+}
+
+/*
+ * Frees the arena with everything in it. ListNodes freed after this
+ * go directly back to malloc.
+ */
+void delete_eval_arena(SgrepData *sgrep) {
+    struct EvalArenaStruct *arena=sgrep->arena;
+    ListNode *n;
+
+    if (!arena) return;
+    while(arena->free_nodes) {
+	n=arena->free_nodes;
+	arena->free_nodes=n->next;
+	sgrep_free(n);
+    }
+    if (arena->stack) sgrep_free(arena->stack);
+    sgrep_free(arena);
+    sgrep->arena=NULL;
+}
+
 /*
  * Allocates a new GC_NODE
  */
 ListNode *new_list_node(SgrepData *sgrep)
 {
-    ListNode *n;
+    ListNode *n=NULL;
+    sgrep_lock(sgrep);
     stats.gc_nodes++;
-    stats.gc_nodes_allocated++;
-    n=sgrep_new(ListNode);
+    if (sgrep->arena && sgrep->arena->free_nodes) {
+	n=sgrep->arena->free_nodes;
+	sgrep->arena->free_nodes=n->next;
+	sgrep->arena->free_count--;
+    } else {
+	stats.gc_nodes_allocated++;
+    }
+    sgrep_unlock(sgrep);
+    if (!n) n=sgrep_new(ListNode);
     n->prev=NULL;
     n->next=NULL;
     return n;
 }
 
+/*
+ * Frees a GC_NODE, to the free list of arena if there is room
+ */
+static void free_list_node(SgrepData *sgrep, ListNode *n)
+{
+    struct EvalArenaStruct *arena=sgrep->arena;
+    sgrep_lock(sgrep);
+    if (arena && arena->free_count<MAX_FREE_NODES) {
+	n->next=arena->free_nodes;
+	arena->free_nodes=n;
+	arena->free_count++;
+	n=NULL;
+    }
+    sgrep_unlock(sgrep);
+    if (n) sgrep_free(n);
+}
+
+static void encode_region_node(RegionList *l);
+
 /*
  * Inserts new ListNode to RegionList
  */
 void insert_list_node(RegionList *l) {
     ListNode *new_node;
     assert(l->length==LIST_NODE_SIZE);
+    if (LIST_IS_COMPRESSED(l)) {
+	/* Encode the full node and reuse it */
+	encode_region_node(l);
+	l->length=0;
+	l->nodes++;
+	return;
+    }
     new_node=new_list_node(l->sgrep);
     l->last->next=new_node;
     new_node->prev=l->last;
@@ -692,6 +830,97 @@ void insert_list_node(RegionList *l) {
 
 
 
+/*
+ * Grows the arrays of a contiguous list
+ */
+void grow_region_array(RegionList *l) {
+    SGREPDATA(l);
+    assert(LIST_IS_CONTIGUOUS(l) && l->length==l->allocated);
+    l->allocated+=l->allocated/2;
+    l->array.starts=(Offset *)sgrep_realloc(l->array.starts,
+					 l->allocated*sizeof(Offset));
+    l->array.ends=(Offset *)sgrep_realloc(l->array.ends,
+				       l->allocated*sizeof(Offset));
+}
+
+/*
+ * Makes room for n more regions in the arrays of a contiguous list
+ */
+void reserve_region_array(RegionList *l, int n)
+{
+    SGREPDATA(l);
+
+    assert(LIST_IS_CONTIGUOUS(l));
+    if (l->length+n<=l->allocated) return;
+    if (l->allocated+l->allocated/2>=l->length+n) {
+	l->allocated+=l->allocated/2;
+    } else {
+	l->allocated=l->length+n;
+    }
+    l->array.starts=(Offset *)sgrep_realloc(l->array.starts,
+					   l->allocated*sizeof(Offset));
+    l->array.ends=(Offset *)sgrep_realloc(l->array.ends,
+					 l->allocated*sizeof(Offset));
+}
+
+/*
+ * Adds n regions from arrays starts and ends to the end of list l.
+ * The regions must be start sorted and come after the regions already
+ * in l. A contiguous list gets them with one copy.
+ */
+void add_region_array(RegionList *l, const Offset *starts, const Offset *ends,
+		      int n)
+{
+    int i;
+
+    if (n<=0) return;
+    if (!LIST_IS_CONTIGUOUS(l)) {
+	for(i=0;i<n;i++) add_region(l,starts[i],ends[i]);
+	return;
+    }
+#ifndef NDEBUG
+    check_add_region(l,starts[0],ends[0]);
+#endif
+    reserve_region_array(l,n);
+    memcpy(l->array.starts+l->length,starts,n*sizeof(Offset));
+    memcpy(l->array.ends+l->length,ends,n*sizeof(Offset));
+    l->length+=n;
+}
+
+/*
+ * Runs shorter than this are found by scanning with the merge kernel
+ */
+#define MERGE_SCAN_LENGTH 32
+
+/*
+ * Gives the number of elements smaller than key in the sorted array
+ * a[0..n-1]. Short runs are scanned with the merge kernel, longer ones
+ * are first narrowed down by galloping and binary search.
+ */
+int merge_count_below(SgrepData *sgrep, const Offset *a, int n, Offset key)
+{
+    int lo,hi,step,middle;
+
+    if (n<=MERGE_SCAN_LENGTH || a[MERGE_SCAN_LENGTH-1]>=key) {
+	return sgrep->merge_kernel->count_below(
+	    a,(n<MERGE_SCAN_LENGTH) ? n : MERGE_SCAN_LENGTH,key);
+    }
+    /* a[0..lo-1] are smaller than key */
+    lo=MERGE_SCAN_LENGTH;
+    step=MERGE_SCAN_LENGTH;
+    while(lo+step<=n && a[lo+step-1]<key) {
+	lo+=step;
+	step*=2;
+    }
+    /* a[hi..n-1] are not */
+    hi=(lo+step<n) ? lo+step : n;
+    while(hi-lo>MERGE_SCAN_LENGTH) {
+	middle=lo+(hi-lo)/2;
+	if (a[middle]<key) lo=middle+1; else hi=middle;
+    }
+    return lo+sgrep->merge_kernel->count_below(a+lo,hi-lo,key);
+}
+
 /*
  * initializes a gc list 
  */
@@ -709,6 +938,12 @@ void init_region_list(RegionList *l)
       l->nested=0;
       l->sorted=START_SORTED;
       l->start_sorted_array=NULL;
+      l->array.starts=NULL;
+      l->array.ends=NULL;
+      l->end_sorted_array.starts=NULL;
+      l->end_sorted_array.ends=NULL;
+      l->allocated=0;
+      l->blocks=NULL;
 }
 
 	
@@ -723,11 +958,356 @@ RegionList *new_region_list(SgrepData *sgrep)
       l=sgrep_new(RegionList);
       l->sgrep=sgrep;
       init_region_list(l);
+      sgrep_lock(sgrep);
       stats.region_lists++; 
       stats.region_lists_now++;
+      sgrep_unlock(sgrep);
+      return l;
+}
+
+/*
+ * Creates a new region list, which stores its regions in contiguous
+ * arrays instead of ListNodes. Otherwise behaves like any other list.
+ */
+RegionList *new_contiguous_region_list(SgrepData *sgrep)
+{
+      RegionList *l;
+
+      l=new_region_list(sgrep);
+      free_list_node(sgrep,l->first);
+      l->first=NULL;
+      l->last=NULL;
+      l->allocated=LIST_NODE_SIZE;
+      l->array.starts=(Offset *)sgrep_malloc(l->allocated*sizeof(Offset));
+      l->array.ends=(Offset *)sgrep_malloc(l->allocated*sizeof(Offset));
       return l;
 }
 
+/*
+ * Compressed region lists store regions in delta encoded blocks of
+ * REGION_BLOCK_SIZE regions. Start points are stored as zigzag coded
+ * differences to the previous start point and end points as
+ * differences to the start point, both as variable length integers
+ * of seven bits per byte. Each block has a header with the start point
+ * of its first region and the position of its data, so that any block
+ * can be decoded without decoding the blocks before it.
+ */
+typedef struct {
+    Offset start;	/* Start point of first region in block */
+    size_t offset;	/* Where the block begins in data */
+} RegionBlockHeader;
+
+struct RegionBlocksStruct {
+    int blocks;		/* How many blocks have been encoded */
+    int allocated;	/* Size of headers array */
+    RegionBlockHeader *headers;
+    unsigned char *data;
+    size_t used;	/* Bytes of data used */
+    size_t size;	/* Bytes of data allocated */
+};
+
+#if LARGE_OFFSETS
+typedef unsigned long long UOffset;
+#else
+typedef unsigned int UOffset;
+#endif
+#define ZIGZAG(D) (((UOffset)(D)<<1)^(UOffset)((D)>>(sizeof(Offset)*8-1)))
+#define UNZIGZAG(U) ((Offset)((U)>>1)^-(Offset)((U)&1))
+/* Maximum size of one encoded block */
+#define MAX_BLOCK_BYTES (REGION_BLOCK_SIZE*2*((sizeof(Offset)*8+6)/7))
+
+#define PUT_VARINT(P,V) do { \
+    UOffset v_=(V); \
+    while(v_>=128) { *(P)++=(unsigned char)(v_|128); v_>>=7; } \
+    *(P)++=(unsigned char)v_; \
+} while(0)
+
+#define GET_VARINT(P,V) do { \
+    int shift_=7; \
+    (V)=*(P)&127; \
+    while(*(P)++&128) { (V)|=(UOffset)(*(P)&127)<<shift_; shift_+=7; } \
+} while(0)
+
+/*
+ * Creates a new region list, which delta encodes its regions as they
+ * are added. Compressed lists must be kept start sorted.
+ */
+RegionList *new_compressed_region_list(SgrepData *sgrep)
+{
+      RegionList *l;
+
+      l=new_region_list(sgrep);
+      l->blocks=sgrep_new(struct RegionBlocksStruct);
+      l->blocks->blocks=0;
+      l->blocks->allocated=16;
+      l->blocks->headers=(RegionBlockHeader *)
+	  sgrep_malloc(l->blocks->allocated*sizeof(RegionBlockHeader));
+      l->blocks->size=16*MAX_BLOCK_BYTES;
+      l->blocks->data=(unsigned char *)sgrep_malloc(l->blocks->size);
+      l->blocks->used=0;
+      STATS_ADD(compressed_lists,1);
+      return l;
+}
+
+/*
+ * Encodes the full node of a compressed list to blocks
+ */
+static void encode_region_node(RegionList *l) {
+    struct RegionBlocksStruct *b=l->blocks;
+    const Region *regions;
+    unsigned char *p;
+    Offset prev;
+    int i,j;
+    SGREPDATA(l);
+
+    assert(l->first==l->last && l->length==LIST_NODE_SIZE);
+    for(j=0;j<LIST_NODE_SIZE;j+=REGION_BLOCK_SIZE) {
+	regions=l->last->list+j;
+	if (b->blocks==b->allocated) {
+	    b->allocated+=b->allocated/2;
+	    b->headers=(RegionBlockHeader *)
+		sgrep_realloc(b->headers,
+			      b->allocated*sizeof(RegionBlockHeader));
+	}
+	if (b->size-b->used<MAX_BLOCK_BYTES) {
+	    b->size+=b->size/2;
+	    b->data=(unsigned char *)sgrep_realloc(b->data,b->size);
+	}
+	b->headers[b->blocks].start=regions[0].start;
+	b->headers[b->blocks].offset=b->used;
+	p=b->data+b->used;
+	prev=regions[0].start;
+	for(i=0;i<REGION_BLOCK_SIZE;i++) {
+	    assert(regions[i].end>=regions[i].start);
+	    if (i>0) PUT_VARINT(p,ZIGZAG(regions[i].start-prev));
+	    PUT_VARINT(p,regions[i].end-regions[i].start);
+	    prev=regions[i].start;
+	}
+	STATS_ADD(compressed_regions,REGION_BLOCK_SIZE);
+	STATS_ADD(compressed_bytes,(p-b->data)-b->used);
+	b->used=p-b->data;
+	b->blocks++;
+    }
+}
+
+/*
+ * Decodes given block of a compressed list to regions. Returns the
+ * number of regions in the block.
+ */
+static int get_region_block(const RegionList *l, int block, Region *regions) {
+    const struct RegionBlocksStruct *b=l->blocks;
+    const unsigned char *p;
+    Offset start;
+    UOffset v;
+    int i,n;
+
+    if (block>=b->blocks) {
+	/* Regions in the node not yet encoded */
+	i=(block-b->blocks)*REGION_BLOCK_SIZE;
+	n=l->length-i;
+	if (n>REGION_BLOCK_SIZE) n=REGION_BLOCK_SIZE;
+	memcpy(regions,l->last->list+i,n*sizeof(Region));
+	return n;
+    }
+    p=b->data+b->headers[block].offset;
+    start=b->headers[block].start;
+    for(i=0;i<REGION_BLOCK_SIZE;i++) {
+	if (i>0) {
+	    GET_VARINT(p,v);
+	    start+=UNZIGZAG(v);
+	}
+	GET_VARINT(p,v);
+	regions[i].start=start;
+	regions[i].end=start+(Offset)v;
+    }
+    return REGION_BLOCK_SIZE;
+}
+
+/*
+ * Decodes the block containing handle->ind into handle->block.
+ * Returns 0, if handle->ind is past the end of list.
+ */
+int decode_region_block(ListIterator *handle) {
+    const RegionList *l=handle->list;
+    int block;
+
+    if (handle->ind>=LIST_SIZE(l)) return 0;
+    block=handle->ind/REGION_BLOCK_SIZE;
+    handle->block_start=block*REGION_BLOCK_SIZE;
+    handle->block_len=get_region_block(l,block,handle->block);
+    return 1;
+}
+
+/*
+ * region_at() for compressed lists. Decodes only the part of the block
+ * before the region
+ */
+void compressed_region_at(const RegionList *l, int ind, Region *region) {
+    const struct RegionBlocksStruct *b=l->blocks;
+    const unsigned char *p;
+    Offset start;
+    UOffset v;
+    int block=ind/REGION_BLOCK_SIZE;
+    int i;
+
+    if (block>=b->blocks) {
+	*region=l->last->list[ind-b->blocks*REGION_BLOCK_SIZE];
+	return;
+    }
+    p=b->data+b->headers[block].offset;
+    start=b->headers[block].start;
+    for(i=ind%REGION_BLOCK_SIZE;i>0;i--) {
+	GET_VARINT(p,v);		/* Skip the length */
+	GET_VARINT(p,v);
+	start+=UNZIGZAG(v);
+    }
+    GET_VARINT(p,v);
+    region->start=start;
+    region->end=start+(Offset)v;
+}
+
+/*
+ * Returns the start point of first region in block
+ */
+static Offset block_first_start(const RegionList *l, int block) {
+    if (block<l->blocks->blocks) return l->blocks->headers[block].start;
+    return l->last->list[(block-l->blocks->blocks)*REGION_BLOCK_SIZE].start;
+}
+
+/*
+ * Finds the first region starting at or after index, beginning from
+ * region number start. Uses the block headers to skip to the right
+ * block, so only one block needs to be decoded.
+ */
+int compressed_find_first_start(const RegionList *l, int start, 
+				Offset index) {
+    Region regions[REGION_BLOCK_SIZE];
+    int size=LIST_SIZE(l);
+    int first,last,middle;
+    int i,n;
+
+    if (start>=size) return size;
+    /* Find the last block starting before index */
+    first=start/REGION_BLOCK_SIZE;
+    last=(size-1)/REGION_BLOCK_SIZE;
+    while(first<last) {
+	middle=(first+last+1)/2;
+	if (block_first_start(l,middle)<index) {
+	    first=middle;
+	} else {
+	    last=middle-1;
+	}
+    }
+    /* The region is in this block or starts the next one */
+    n=get_region_block(l,first,regions);
+    i=first*REGION_BLOCK_SIZE;
+    if (i<start) i=start;
+    for(;i<first*REGION_BLOCK_SIZE+n;i++) {
+	if (regions[i-first*REGION_BLOCK_SIZE].start>=index) return i;
+    }
+    return i;
+}
+
+/*
+ * Replaces the storage of list l with the storage of list c and
+ * deletes c along with the old storage of l.
+ */
+static void replace_region_list(RegionList *l, RegionList *c) {
+    RegionList tmp;
+    SGREPDATA(l);
+
+    c->refcount=l->refcount;
+    c->nested=l->nested;
+    c->next=l->next;
+    c->complete=l->complete;
+    tmp=*l;
+    *l=*c;
+    *c=tmp;
+    delete_region_list(c);
+    sgrep_lock(sgrep);
+    stats.region_lists--;
+    sgrep_unlock(sgrep);
+}
+
+/*
+ * Converts a list to a compressed list. The list is sorted by start
+ * points first.
+ */
+void compress_region_list(RegionList *l) {
+    RegionList *c;
+    ListIterator handle;
+    Region r;
+    SGREPDATA(l);
+
+    if (LIST_IS_COMPRESSED(l) || LIST_IS_CHARS(l)) return;
+    c=new_compressed_region_list(sgrep);
+    c->nested=l->nested;
+    start_region_search(l,&handle);
+    get_region(&handle,&r);
+    while(r.start!=-1) {
+	add_region(c,r.start,r.end);
+	get_region(&handle,&r);
+    }
+    replace_region_list(l,c);
+}
+
+/*
+ * Converts a compressed list back to an ordinary list
+ */
+static void decompress_region_list(RegionList *l) {
+    RegionList *c;
+    ListIterator handle;
+    Region r;
+    SGREPDATA(l);
+
+    assert(LIST_IS_COMPRESSED(l));
+    c=new_region_list(sgrep);
+    c->nested=l->nested;
+    start_region_search(l,&handle);
+    get_region(&handle,&r);
+    while(r.start!=-1) {
+	add_region(c,r.start,r.end);
+	get_region(&handle,&r);
+    }
+    replace_region_list(l,c);
+}
+
+/*
+ * Decodes a compressed list to a new chain of ListNodes having the
+ * same layout as the list would have uncompressed
+ */
+static ListNode *decode_list_nodes(RegionList *l) {
+    ListNode *first,*last;
+    ListIterator handle;
+    int i;
+    SGREPDATA(l);
+
+    first=last=new_list_node(sgrep);
+    start_region_search(l,&handle);
+    for(i=0;i<LIST_SIZE(l);i++) {
+	if (i>0 && i%LIST_NODE_SIZE==0) {
+	    last->next=new_list_node(sgrep);
+	    last->next->prev=last;
+	    last=last->next;
+	}
+	get_region(&handle,&last->list[i%LIST_NODE_SIZE]);
+    }
+    return first;
+}
+
+/*
+ * Returns a copy of given array of size regions
+ */
+static RegionArray copy_region_array(SgrepData *sgrep,
+				     const RegionArray *a, int size) {
+    RegionArray copy;
+    copy.starts=(Offset *)sgrep_malloc(size*sizeof(Offset));
+    copy.ends=(Offset *)sgrep_malloc(size*sizeof(Offset));
+    memcpy(copy.starts,a->starts,size*sizeof(Offset));
+    memcpy(copy.ends,a->ends,size*sizeof(Offset));
+    return copy;
+}
+
 /*
  * Copies a list of ListNodes. Returns a pointer to first a node.
  * if last is not NULL, returns also a pointer to last node
@@ -762,20 +1342,30 @@ ListNode *copy_list_nodes(SgrepData *sgrep,const ListNode *n,
  * chars list 'contains' every possible region of that size
  * (0,0) (1,1) (2,2) or (1,2) (2,3) (3,4)
  */
-void to_chars(RegionList *c,int chars, int end)
+void to_chars(RegionList *c,Offset chars, Offset end)
 {
     SGREPDATA(c);
     assert(c->length==0 && c->last==c->first);
+    assert(!LIST_IS_COMPRESSED(c));
     
     c->chars=chars-1;
+    if (LIST_IS_CONTIGUOUS(c))
+    {
+	sgrep_free(c->array.starts);
+	sgrep_free(c->array.ends);
+	c->array.starts=NULL;
+	c->array.ends=NULL;
+	c->allocated=0;
+    }
     if (c->first!=NULL)
     {
-	sgrep_free(c->first);
+	free_list_node(sgrep,c->first);
 	c->first=NULL;
 	c->last=NULL;
     }
     if (end==0) end=c->length+chars-2;
-    c->length=end-chars+2;
+    /* Region counts are ints even with LARGE_OFFSETS */
+    c->length=(int)(end-chars+2);
     if (c->length<=0)
     {
 	/* The gc list became empty, we reinit it to 
@@ -788,25 +1378,29 @@ void to_chars(RegionList *c,int chars, int end)
  * Adds a region to gc list 
  * s is start index, e end index
  */
-void check_add_region(const RegionList *l, int s, int e)
+void check_add_region(const RegionList *l, Offset s, Offset e)
 {
     /* Overkill asserts can save you day */
-    assert(l && l->first!=NULL);    
+    assert(l && (l->first!=NULL || LIST_IS_CONTIGUOUS(l)));
     assert(!l->complete);
     assert(s<=e);
-    assert(l->last->next==NULL);
-    assert(l->length>=0 || l->length<=LIST_NODE_SIZE);
+    if (LIST_IS_CONTIGUOUS(l)) {
+	assert(l->length>=0 && l->length<=l->allocated);
+    } else {
+	assert(l->last->next==NULL);
+	assert(l->length>=0 || l->length<=LIST_NODE_SIZE);
+    }
     
     /* Check that the list will stay start sorted */
     assert(
 	l->length==0 || l->sorted!=START_SORTED ||
-	LAST_NODE(l).start<s ||
-	(LAST_NODE(l).start==s && LAST_NODE(l).end<e));
+	LAST_START(l)<s ||
+	(LAST_START(l)==s && LAST_END(l)<e));
     
 
     /* Check that the list is nested only when l->nested is true */
     assert( l->nested || l->length==0 || l->sorted!=START_SORTED ||
-	    e>LAST_NODE(l).end);
+	    e>LAST_END(l));
 }
 
 /*
@@ -817,7 +1411,8 @@ void start_region_search(RegionList *l, ListIterator *handle)
 {
     SGREPDATA(l);
     assert(l->last==NULL || l->last->next==NULL);
-    assert(l->last!=NULL && l->length<=LIST_NODE_SIZE);
+    assert(LIST_IS_CONTIGUOUS(l) || 
+	   (l->last!=NULL && l->length<=LIST_NODE_SIZE));
     assert(l->length>=0);
 
     l->complete=1;
@@ -826,8 +1421,12 @@ void start_region_search(RegionList *l, ListIterator *handle)
     }
     handle->list=l;
     handle->ind=0;
-    handle->node=l->first;
-    stats.scans++;
+    handle->node=(LIST_IS_COMPRESSED(l)) ? NULL : l->first;
+    handle->array=l->array;
+    handle->blocks=l->blocks;
+    handle->block_start=0;
+    handle->block_len=0;
+    STATS_ADD(scans,1);
 }
 
 /*
@@ -839,7 +1438,8 @@ void start_region_search_from(RegionList *l, int index, ListIterator *handle)
 {
     SGREPDATA(l);
     assert(l->last==NULL || l->last->next==NULL);
-    assert(l->last!=NULL && l->length<=LIST_NODE_SIZE);
+    assert(LIST_IS_CONTIGUOUS(l) ||
+	   (l->last!=NULL && l->length<=LIST_NODE_SIZE));
     assert(l->length>=0);
 
     l->complete=1;
@@ -849,18 +1449,110 @@ void start_region_search_from(RegionList *l, int index, ListIterator *handle)
     handle->list=l;
     handle->ind=0;
     handle->node=l->first;
+    handle->array=l->array;
+    handle->blocks=l->blocks;
+    handle->block_start=0;
+    handle->block_len=0;
+    if (LIST_IS_CONTIGUOUS(l) || LIST_IS_COMPRESSED(l)) {
+	/* Index into whole list */
+	if (LIST_IS_COMPRESSED(l)) handle->node=NULL;
+	handle->ind= (index < LIST_SIZE(l)) ? index : LIST_SIZE(l);
+	STATS_ADD(scans,1);
+	return;
+    }
     while(index>=LIST_NODE_SIZE && handle->node->next) {
 	handle->node=handle->node->next;
 	index-=LIST_NODE_SIZE;
     }
     handle->ind= (index < l->length) ? index : l->length;
-    stats.scans++;
+    STATS_ADD(scans,1);
+}
+
+/*
+ * Skips the regions starting before start and gets the next region
+ * like get_region(). Contiguous and compressed lists and node lists
+ * having a start sorted array are searched by galloping from the
+ * current position, so skipping over k regions costs O(log k). From
+ * other node lists whole nodes are skipped.
+ */
+void seek_region(ListIterator *handle, Offset start, Region *reg) {
+    const RegionList *l=handle->list;
+    int size=LIST_SIZE(l);
+    int lo,bound,step,middle;
+    Region r;
+
+    /* Often there is nothing to skip */
+    get_region(handle,reg);
+    if (reg->start==-1 || reg->start>=start) return;
+
+    if (LIST_IS_CHARS(l)) {
+	/* Region number i starts from i */
+	handle->ind= (start<size) ? (int)start : size;
+	get_region(handle,reg);
+	return;
+    }
+    if (handle->node!=NULL && l->start_sorted_array==NULL) {
+	while(handle->node->next!=NULL &&
+	      handle->node->list[LIST_NODE_SIZE-1].start<start) {
+	    handle->node=handle->node->next;
+	    handle->ind=0;
+	}
+	do {
+	    get_region(handle,reg);
+	} while(reg->start!=-1 && reg->start<start);
+	return;
+    }
+
+    if (handle->node!=NULL) {
+	/* The position in node list is not known. However every region
+	 * before reg starts before start too, so search the whole list */
+	lo=0;
+    } else {
+	lo=handle->ind;
+    }
+    if (LIST_IS_COMPRESSED(l)) {
+	lo=compressed_find_first_start(l,lo,start);
+    } else {
+	/* Gallop to find bound, then binary search between */
+	bound=lo;
+	step=1;
+	while(bound<size) {
+	    region_at(l,bound,&r);
+	    if (r.start>=start) break;
+	    lo=bound+1;
+	    bound+=step;
+	    step+=step;
+	}
+	if (bound>size) bound=size;
+	while(lo<bound) {
+	    middle=lo+(bound-lo)/2;
+	    region_at(l,middle,&r);
+	    if (r.start<start) {
+		lo=middle+1;
+	    } else {
+		bound=middle;
+	    }
+	}
+    }
+
+    /* Move the iterator to region number lo */
+    if (handle->node==NULL) {
+	handle->ind=lo;
+    } else if (lo==size) {
+	handle->node=l->last;
+	handle->ind=l->length;
+    } else {
+	handle->node=l->start_sorted_array[lo>>LIST_NODE_BITS];
+	handle->ind=lo&(LIST_NODE_SIZE-1);
+    }
+    get_region(handle,reg);
 }
 
 void start_end_sorted_search(RegionList *l, ListIterator *handle) {
     SGREPDATA(l);
     assert(l->last==NULL || l->last->next==NULL);
-    assert(l->last!=NULL && l->length<=LIST_NODE_SIZE);
+    assert(LIST_IS_CONTIGUOUS(l) ||
+	   (l->last!=NULL && l->length<=LIST_NODE_SIZE));
     assert(l->length>=0);
 
     l->complete=1;
@@ -871,11 +1563,18 @@ void start_end_sorted_search(RegionList *l, ListIterator *handle) {
     handle->list=l;
     handle->ind=0;
     handle->node=get_end_sorted_list(l);
-    stats.scans++;
+    handle->array= (l->end_sorted_array.starts) ? 
+	l->end_sorted_array : l->array;
+    /* End sorted version of a compressed list is not compressed */
+    handle->blocks=NULL;
+    handle->block_start=0;
+    handle->block_len=0;
+    STATS_ADD(scans,1);
 }
 
 void list_set_sorted(RegionList *l, enum RegionListSorted sorted) {
     assert(!l->complete);
+    assert(!LIST_IS_COMPRESSED(l) || sorted==START_SORTED);
     l->sorted=sorted;
 }
 
@@ -897,7 +1596,7 @@ void last_region(RegionList *l)
 
 	l->current.ind=l->length;
 	l->current.node=l->last;
-	stats.scans++;
+	STATS_ADD(scans,1);
 }
 #endif
 
@@ -907,7 +1606,10 @@ void last_region(RegionList *l)
 #ifndef NDEBUG
 void check_get_region(const ListIterator *handle, const Region *reg)
 {
-    if (handle->list->last!=NULL)
+    if (handle->blocks!=NULL) {
+	assert(handle->node==NULL);
+	assert(handle->ind>=0 && handle->ind<=LIST_SIZE(handle->list));
+    } else if (handle->list->last!=NULL)
     {
 	assert(handle->list->last->next==NULL);
 	assert(handle->list->length<=LIST_NODE_SIZE);
@@ -925,7 +1627,9 @@ int check_region_at(const RegionList *l, int ind) {
     assert(l);
     assert(!l->chars);
     assert(ind>=0 && ind<LIST_SIZE(l));
-    assert(l->start_sorted_array && l->start_sorted_array[ind/LIST_NODE_SIZE]);
+    assert(LIST_IS_CONTIGUOUS(l) || LIST_IS_COMPRESSED(l) ||
+	   (l->start_sorted_array && 
+	    l->start_sorted_array[ind/LIST_NODE_SIZE]));
     return ind;
 }
 #endif
@@ -940,7 +1644,10 @@ int check_region_at(const RegionList *l, int ind) {
 #ifndef NDEBUG
 void check_prev_region(const ListIterator *handle,const Region *reg)
 {
-    if (handle->list->last!=NULL)
+    if (handle->blocks!=NULL) {
+	assert(handle->node==NULL);
+	assert(handle->ind<=LIST_SIZE(handle->list));
+    } else if (handle->list->last!=NULL)
     {
 	assert(handle->list->last->next==NULL);
 	assert(handle->list->length<=LIST_NODE_SIZE);
@@ -953,14 +1660,14 @@ void check_prev_region(const ListIterator *handle,const Region *reg)
 #endif
 
 /*
- * Frees a given gc list by putting its GC_NODE's to free_gc_node list 
- * and freeing GC_LIST node-
+ * Frees a given gc list by putting its GC_NODE's to the free list of
+ * evaluation arena and freeing GC_LIST node
  */
 void delete_region_list(RegionList *l)
 {
     SGREPDATA(l);
 #ifdef DEBUG
-    if (l->first==NULL)
+    if (LIST_IS_CHARS(l))
 	fprintf(stderr,"Freeing chars list\n");
     else
 	fprintf(stderr,"Freeing a list of size %d regions ..",LIST_SIZE(l));
@@ -969,18 +1676,36 @@ void delete_region_list(RegionList *l)
     if (l->start_sorted_array) {
 	sgrep_free(l->start_sorted_array);
     }
+    if (l->end_sorted_array.starts &&
+	l->end_sorted_array.starts!=l->array.starts) {
+	sgrep_free(l->end_sorted_array.starts);
+	sgrep_free(l->end_sorted_array.ends);
+    }
+    if (LIST_IS_CONTIGUOUS(l)) {
+	sgrep_free(l->array.starts);
+	sgrep_free(l->array.ends);
+    }
+    if (LIST_IS_COMPRESSED(l)) {
+	sgrep_free(l->blocks->headers);
+	sgrep_free(l->blocks->data);
+	sgrep_free(l->blocks);
+    }
+    /* End sorted list may share its nodes with the start sorted one */
+    if (l->end_sorted==l->first) l->end_sorted=NULL;
     while(l->first!=NULL) {
 	ListNode *next=l->first->next;
-	sgrep_free(l->first);
+	free_list_node(sgrep,l->first);
 	l->first=next;
     }
-    if (l->end_sorted!=l->first) while (l->end_sorted) {
+    while (l->end_sorted) {
 	ListNode *next=l->end_sorted->next;
-	sgrep_free(l->end_sorted);
+	free_list_node(sgrep,l->end_sorted);
 	l->end_sorted=next;
     }
     sgrep_free(l);
+    sgrep_lock(sgrep);
     stats.region_lists_now--;
+    sgrep_unlock(sgrep);
 #ifdef DEBUG
     fprintf(stderr," done\n");
     fprintf(stderr,"There is %d gc lists now\n",gc_lists_now);
@@ -1018,17 +1743,21 @@ void list_require_start_sorted_array(RegionList *l) {
     if (l->sorted!=START_SORTED) {
 	get_start_sorted_list(l);
     }
+    /* Contiguous and compressed lists can be indexed as they are */
+    if (LIST_IS_CONTIGUOUS(l) || LIST_IS_COMPRESSED(l)) return;
     assert(l->sorted==START_SORTED && l->first);
     l->start_sorted_array=create_node_array(l,l->first);
 }
 
 
+enum SortTypes {SORT_BY_START,SORT_BY_END };
+
+#ifdef SORT_WITH_QSORT
 /*
  * Recursive qsort for gc_list. Needs gc node index table created by
  * create_node_array 
  * A faster way to do this would be nice
  */
-enum SortTypes {SORT_BY_START,SORT_BY_END };
 void gc_qsort(ListNode **inds,int s,int e, enum SortTypes st)
 {
     Region creg,sreg;
@@ -1067,16 +1796,395 @@ void gc_qsort(ListNode **inds,int s,int e, enum SortTypes st)
     gc_qsort(inds,s,last-1,st);
     gc_qsort(inds,last+1,e,st);	
 }
-	
+
+/*
+ * Recursive qsort for contiguous lists. Sorts by keys, and regions
+ * having same key by keys2. Sorting by start points is
+ * array_qsort(starts,ends,...) and sorting by end points is
+ * array_qsort(ends,starts,...)
+ */
+void array_qsort(Offset *keys, Offset *keys2, int s, int e)
+{
+    Offset ck,ck2,t;
+    int i,m,last;
+
+    while (s<e) {
+	m=(s+e)/2;
+	ck=keys[m];keys[m]=keys[s];keys[s]=ck;
+	ck2=keys2[m];keys2[m]=keys2[s];keys2[s]=ck2;
+
+	last=s;
+	for(i=s+1;i<=e;i++)
+	{
+	    if (keys[i]<ck || (keys[i]==ck && keys2[i]<ck2))
+	    {
+		last++;
+		t=keys[i];keys[i]=keys[last];keys[last]=t;
+		t=keys2[i];keys2[i]=keys2[last];keys2[last]=t;
+	    }
+	}
+	t=keys[s];keys[s]=keys[last];keys[last]=t;
+	t=keys2[s];keys2[s]=keys2[last];keys2[last]=t;
+	/* Recurse into smaller half, loop on the bigger one */
+	if (last-s<e-last) {
+	    array_qsort(keys,keys2,s,last-1);
+	    s=last+1;
+	} else {
+	    array_qsort(keys,keys2,last+1,e);
+	    e=last-1;
+	}
+    }
+}
+#endif /* SORT_WITH_QSORT */
+
+/*
+ * LSD radix sort for region lists. Every region is turned into a key,
+ * having the sort key in the upper and the secondary key in the lower
+ * half. Keys are then sorted by the upper half eight bits at a time
+ * starting from the least significant byte. Passes where all keys have
+ * the same byte are skipped, so that lists with small offsets need only
+ * a few passes. Secondary keys matter only for regions having same
+ * sort key, which are rare, so those are sorted afterwards.
+ * Flipping the sign bit makes signed offsets sort right as unsigned.
+ */
+#if LARGE_OFFSETS
+typedef struct {
+    unsigned long long high;
+    unsigned long long low;
+} RadixKey;
+#define RADIX_SIGN 0x8000000000000000ull
+#define RADIX_SET(K,KEY,KEY2) do { \
+    (K).high=(unsigned long long)(KEY)^RADIX_SIGN; \
+    (K).low=(unsigned long long)(KEY2)^RADIX_SIGN; } while(0)
+#define RADIX_SORT_KEY(K) ((K).high)
+#define RADIX_LOW(K) ((Offset)((K).low^RADIX_SIGN))
+#define RADIX_LESS(A,B) ((A).high<(B).high || \
+			 ((A).high==(B).high && (A).low<(B).low))
+#else
+typedef unsigned long long RadixKey;
+#define RADIX_SIGN 0x80000000u
+#define RADIX_SET(K,KEY,KEY2) do { \
+    (K)=((RadixKey)((unsigned int)(KEY)^RADIX_SIGN)<<32) | \
+	(RadixKey)((unsigned int)(KEY2)^RADIX_SIGN); } while(0)
+#define RADIX_SORT_KEY(K) ((unsigned int)((K)>>32))
+#define RADIX_LOW(K) ((Offset)((unsigned int)(K)^RADIX_SIGN))
+#define RADIX_LESS(A,B) ((A)<(B))
+#endif
+#define RADIX_HIGH(K) ((Offset)(RADIX_SORT_KEY(K)^RADIX_SIGN))
+#define RADIX_BITS 8
+#define RADIX_SIZE (1<<RADIX_BITS)
+#define RADIX_PASSES ((int)sizeof(Offset)*8/RADIX_BITS)
+#define RADIX_DIGIT(K,PASS) \
+    ((int)(RADIX_SORT_KEY(K)>>((PASS)*RADIX_BITS))&(RADIX_SIZE-1))
+
+/*
+ * One piece of parallel radix sort. Every thread counts and moves
+ * the keys of its own part of the list.
+ */
+struct RadixJob {
+    const RadixKey *src;
+    RadixKey *dst;
+    int start,end;
+    int pass;                      /* Current pass, or -1 for all */
+    int counts[RADIX_PASSES][RADIX_SIZE];
+};
+
+static void *radix_count_job(void *arg) {
+    struct RadixJob *job=(struct RadixJob *)arg;
+    int i,p;
+    
+    if (job->pass<0) {
+	memset(job->counts,0,sizeof(job->counts));
+	for(i=job->start;i<job->end;i++) {
+	    RadixKey key=job->src[i];
+	    for(p=0;p<RADIX_PASSES;p++) {
+		job->counts[p][RADIX_DIGIT(key,p)]++;
+	    }
+	}
+    } else {
+	int *counts=job->counts[job->pass];
+	memset(counts,0,sizeof(job->counts[0]));
+	for(i=job->start;i<job->end;i++) {
+	    counts[RADIX_DIGIT(job->src[i],job->pass)]++;
+	}
+    }
+    return NULL;
+}
+
+static void *radix_scatter_job(void *arg) {
+    struct RadixJob *job=(struct RadixJob *)arg;
+    /* Here counts have been turned to offsets */
+    int *offsets=job->counts[job->pass];
+    int i;
+
+    for(i=job->start;i<job->end;i++) {
+	RadixKey key=job->src[i];
+	job->dst[offsets[RADIX_DIGIT(key,job->pass)]++]=key;
+    }
+    return NULL;
+}
+
+/*
+ * Sorts size keys. tmp must have room for size keys too. When threads
+ * is bigger than one, the list is split to that many parts, which
+ * are counted and moved in parallel.
+ */
+static void radix_sort(SgrepData *sgrep, RadixKey *keys, RadixKey *tmp,
+		       int size, int threads) {
+    struct RadixJob *jobs;
+    int totals[RADIX_PASSES][RADIX_SIZE];
+    RadixKey *src=keys;
+    RadixKey *dst=tmp;
+    RadixKey *swap;
+    int p,d,t,offset;
+
+    assert(threads>=1 && threads<=MAX_THREADS);
+    /* The jobs are too big for the stacks of the threads */
+    jobs=(struct RadixJob *)sgrep_malloc(threads*sizeof(struct RadixJob));
+    for(t=0;t<threads;t++) {
+	jobs[t].start=(int)((double)size*t/threads);
+	jobs[t].end=(int)((double)size*(t+1)/threads);
+	jobs[t].pass=-1;
+	jobs[t].src=src;
+    }
+    /* All the byte histograms can be counted at once, since they
+     * do not depend on the order of the keys */
+    run_in_threads(radix_count_job,jobs,sizeof(struct RadixJob),threads);
+    memset(totals,0,sizeof(totals));
+    for(t=0;t<threads;t++) {
+	for(p=0;p<RADIX_PASSES;p++) {
+	    for(d=0;d<RADIX_SIZE;d++) {
+		totals[p][d]+=jobs[t].counts[p][d];
+	    }
+	}
+    }
+    
+    for(p=0;p<RADIX_PASSES;p++) {
+	if (totals[p][RADIX_DIGIT(keys[0],p)]==size) {
+	    /* Every key has the same digit */
+	    continue;
+	}
+	if (threads>1) {
+	    /* Counts of previous passes are stale */
+	    for(t=0;t<threads;t++) {
+		jobs[t].src=src;
+		jobs[t].pass=p;
+	    }
+	    run_in_threads(radix_count_job,jobs,sizeof(struct RadixJob),
+			   threads);
+	}
+	/* Turn counts to offsets: every thread gets its own slice
+	 * of every bucket */
+	offset=0;
+	for(d=0;d<RADIX_SIZE;d++) {
+	    if (threads==1) {
+		jobs[0].counts[p][d]=offset;
+		offset+=totals[p][d];
+	    } else for(t=0;t<threads;t++) {
+		int count=jobs[t].counts[p][d];
+		jobs[t].counts[p][d]=offset;
+		offset+=count;
+	    }
+	}
+	for(t=0;t<threads;t++) {
+	    jobs[t].src=src;
+	    jobs[t].dst=dst;
+	    jobs[t].pass=p;
+	}
+	run_in_threads(radix_scatter_job,jobs,sizeof(struct RadixJob),threads);
+	swap=src;
+	src=dst;
+	dst=swap;
+    }
+    if (src!=keys) {
+	memcpy(keys,src,size*sizeof(RadixKey));
+    }
+    sgrep_free(jobs);
+}
+
+static int radix_key_compare(const void *a, const void *b) {
+    const RadixKey *ka=(const RadixKey *)a;
+    const RadixKey *kb=(const RadixKey *)b;
+    return RADIX_LESS(*ka,*kb) ? -1 : RADIX_LESS(*kb,*ka);
+}
+
+/*
+ * Sorts the runs of keys having same upper half by their lower half
+ */
+static void radix_sort_ties(RadixKey *keys, int size) {
+    int i,j,run;
+    RadixKey key;
+    
+    for(i=0;i<size;i=run) {
+	for(run=i+1;
+	    run<size && RADIX_SORT_KEY(keys[run])==RADIX_SORT_KEY(keys[i]);
+	    run++);
+	if (run-i<2) continue;
+	if (run-i>16) {
+	    qsort(keys+i,run-i,sizeof(RadixKey),radix_key_compare);
+	    continue;
+	}
+	/* Insertion sort for short runs */
+	for(j=i+1;j<run;j++) {
+	    int k;
+	    key=keys[j];
+	    for(k=j;k>i && RADIX_LESS(key,keys[k-1]);k--) {
+		keys[k]=keys[k-1];
+	    }
+	    keys[k]=key;
+	}
+    }
+}
+
+/*
+ * Returns how many threads should be used for sorting a list of size
+ * regions. Only the threads not busy with other work are taken, and
+ * they must be given back with release_sort_threads()
+ */
+static int sort_threads(SgrepData *sgrep, int size) {
+    int n;
+
+    if (size<PARALLEL_SORT_LIMIT || sgrep->threads<=1) return 1;
+    sgrep_lock(sgrep);
+    n=sgrep->threads-sgrep->busy_threads;
+    if (n>1) {
+	sgrep->busy_threads+=n-1;
+	stats.parallel_sorts++;
+    } else {
+	n=1;
+    }
+    sgrep_unlock(sgrep);
+    return n;
+}
+
+static void release_sort_threads(SgrepData *sgrep, int threads) {
+    if (threads<=1) return;
+    sgrep_lock(sgrep);
+    sgrep->busy_threads-=threads-1;
+    sgrep_unlock(sgrep);
+}
+
+/*
+ * Radix sorts size regions in a chain of ListNodes
+ */
+static void sort_list_nodes(SgrepData *sgrep, ListNode *first, int size,
+			    enum SortTypes st) {
+    RadixKey *keys;
+    ListNode *n;
+    int i,j,threads;
+    int sorted=1;
+    
+    keys=(RadixKey *)sgrep_malloc(2*size*sizeof(RadixKey));
+    for(n=first,i=0,j=0;i<size;i++,j++) {
+	if (j==LIST_NODE_SIZE) {
+	    n=n->next;
+	    j=0;
+	}
+	if (st==SORT_BY_START) {
+	    RADIX_SET(keys[i],n->list[j].start,n->list[j].end);
+	} else {
+	    RADIX_SET(keys[i],n->list[j].end,n->list[j].start);
+	}
+	if (i>0 && RADIX_LESS(keys[i],keys[i-1])) sorted=0;
+    }
+    if (sorted) {
+	sgrep_free(keys);
+	return;
+    }
+    threads=sort_threads(sgrep,size);
+    radix_sort(sgrep,keys,keys+size,size,threads);
+    release_sort_threads(sgrep,threads);
+    radix_sort_ties(keys,size);
+    for(n=first,i=0,j=0;i<size;i++,j++) {
+	if (j==LIST_NODE_SIZE) {
+	    n=n->next;
+	    j=0;
+	}
+	if (st==SORT_BY_START) {
+	    n->list[j].start=RADIX_HIGH(keys[i]);
+	    n->list[j].end=RADIX_LOW(keys[i]);
+	} else {
+	    n->list[j].end=RADIX_HIGH(keys[i]);
+	    n->list[j].start=RADIX_LOW(keys[i]);
+	}
+    }
+    sgrep_free(keys);
+}
+
+/*
+ * Radix sorts size regions in contiguous arrays. Sorting by end points
+ * is done by giving ends as keys and starts as keys2
+ */
+static void sort_region_array(SgrepData *sgrep, Offset *keys, Offset *keys2,
+			      int size) {
+    RadixKey *radix_keys;
+    int i,threads;
+    int sorted=1;
+
+    radix_keys=(RadixKey *)sgrep_malloc(2*size*sizeof(RadixKey));
+    for(i=0;i<size;i++) {
+	RADIX_SET(radix_keys[i],keys[i],keys2[i]);
+	if (i>0 && RADIX_LESS(radix_keys[i],radix_keys[i-1])) sorted=0;
+    }
+    if (sorted) {
+	sgrep_free(radix_keys);
+	return;
+    }
+    threads=sort_threads(sgrep,size);
+    radix_sort(sgrep,radix_keys,radix_keys+size,size,threads);
+    release_sort_threads(sgrep,threads);
+    radix_sort_ties(radix_keys,size);
+    for(i=0;i<size;i++) {
+	keys[i]=RADIX_HIGH(radix_keys[i]);
+	keys2[i]=RADIX_LOW(radix_keys[i]);
+    }
+    sgrep_free(radix_keys);
+}
+
+/*
+ * get_end_sorted_list() for contiguous lists. The end sorted
+ * version is left to s->end_sorted_array, if it differs from s->array
+ */
+static void get_end_sorted_array(RegionList *s)
+{
+    SGREPDATA(s);
+    
+    if (s->sorted==END_SORTED ||
+	(s->sorted==START_SORTED && (!s->nested)) ||
+	LIST_SIZE(s)<2 ||
+	s->end_sorted_array.starts) {
+	return;
+    }
+    if (s->sorted==NOT_SORTED) {
+	s->sorted=END_SORTED;
+	s->end_sorted_array=s->array;
+    } else {
+	s->end_sorted_array=copy_region_array(sgrep,&s->array,s->length);
+    }
+#ifdef SORT_WITH_QSORT
+    array_qsort(s->end_sorted_array.ends,s->end_sorted_array.starts,
+		0,s->length-1);
+#else
+    sort_region_array(sgrep,s->end_sorted_array.ends,
+		      s->end_sorted_array.starts,s->length);
+#endif
+    STATS_ADD(sorts_by_end,1);
+}
 
 ListNode *get_end_sorted_list(RegionList *s)
 {
     int size;
+#ifdef SORT_WITH_QSORT
     ListNode **inds;
+#endif
     SGREPDATA(s);
 
     assert(s);
     s->complete=1;
+    if (LIST_IS_CONTIGUOUS(s)) {
+	get_end_sorted_array(s);
+	return NULL;
+    }
     if (s->sorted==END_SORTED) {
 	return s->first;
     }
@@ -1094,18 +2202,24 @@ ListNode *get_end_sorted_list(RegionList *s)
 	return s->end_sorted;
     }
     /* Create new copy, only if we need to save start sorted version */
-    if (s->sorted==NOT_SORTED) {
+    if (LIST_IS_COMPRESSED(s)) {
+	s->end_sorted=decode_list_nodes(s);
+    } else if (s->sorted==NOT_SORTED) {
 	s->sorted=END_SORTED;
 	s->end_sorted=s->first;
     } else {
 	s->end_sorted=copy_list_nodes(sgrep,s->first,NULL);
     }
     /* Sort the copy */
+#ifdef SORT_WITH_QSORT
     inds=create_node_array(s,s->end_sorted); 
     gc_qsort(inds,0,size-1,SORT_BY_END);
     sgrep_free(inds);
+#else
+    sort_list_nodes(sgrep,s->end_sorted,size,SORT_BY_END);
+#endif
     
-    stats.sorts_by_end++;
+    STATS_ADD(sorts_by_end,1);
     return s->end_sorted;
 }
 
@@ -1119,7 +2233,9 @@ ListNode *get_end_sorted_list(RegionList *s)
 ListNode *get_start_sorted_list(RegionList *s)
 {   
     int size;
+#ifdef SORT_WITH_QSORT
     ListNode **inds;
+#endif
     SGREPDATA(s);
 
     assert(s);
@@ -1133,6 +2249,21 @@ ListNode *get_start_sorted_list(RegionList *s)
 	s->sorted=START_SORTED;
 	return s->first;
     }
+    if (LIST_IS_CONTIGUOUS(s)) {
+	/* Create new copy, only if we need to save end sorted version */
+	if (s->sorted==END_SORTED) {
+	    assert(s->array.starts==s->end_sorted_array.starts);
+	    s->array=copy_region_array(sgrep,&s->end_sorted_array,size);
+	}
+	s->sorted=START_SORTED;
+#ifdef SORT_WITH_QSORT
+	array_qsort(s->array.starts,s->array.ends,0,size-1);
+#else
+	sort_region_array(sgrep,s->array.starts,s->array.ends,size);
+#endif
+	STATS_ADD(sorts_by_start,1);
+	return NULL;
+    }
     /* Create new copy, only if we need to save end sorted version */
     if (s->sorted==END_SORTED) {
 	assert(s->first==s->end_sorted);
@@ -1141,11 +2272,15 @@ ListNode *get_start_sorted_list(RegionList *s)
     s->sorted=START_SORTED;
 
     /* Sort the copy */
+#ifdef SORT_WITH_QSORT
     inds=create_node_array(s,s->first); 
     gc_qsort(inds,0,size-1,SORT_BY_START);
     sgrep_free(inds);
+#else
+    sort_list_nodes(sgrep,s->first,size,SORT_BY_START);
+#endif
     
-    stats.sorts_by_start++;
+    STATS_ADD(sorts_by_start,1);
     return s->first;
 }
 
@@ -1162,9 +2297,25 @@ void remove_duplicates(RegionList *s)
 	/* We know only how to remove remove_duplicates from start sorted
 	 * lists */
 	assert(s);
+	if (LIST_IS_COMPRESSED(s)) decompress_region_list(s);
 	start_region_search(s,&r);
 	assert(s->sorted==START_SORTED);
-	stats.remove_duplicates++;
+	STATS_ADD(remove_duplicates,1);
+
+	if (LIST_IS_CONTIGUOUS(s)) {
+	    int i,j;
+	    Offset *starts=s->array.starts;
+	    Offset *ends=s->array.ends;
+	    for(i=1,j=0;i<s->length;i++) {
+		if (starts[i]!=starts[j] || ends[i]!=ends[j]) {
+		    j++;
+		    starts[j]=starts[i];
+		    ends[j]=ends[i];
+		}
+	    }
+	    if (s->length>0) s->length=j+1;
+	    return;
+	}
 
 	start_region_search(s,&s_handle);	
 	get_region(&s_handle,&p1);
@@ -1195,7 +2346,7 @@ void remove_duplicates(RegionList *s)
 	{
 		t=r.node;
 		r.node=r.node->next;
-		sgrep_free(t);
+		free_list_node(sgrep,t);
 	}
 	s->last->next=NULL;
 }
@@ -40,6 +40,7 @@ typedef struct {
 RegionList *recursive_eval(Evaluator *,ParseTreeNode *root);
 RegionList *eval_operator(Evaluator *,ParseTreeNode *root);
 RegionList *or(RegionList *,RegionList *);
+static RegionList *or_arrays(RegionList *,RegionList *);
 RegionList *nest_order(Evaluator *, RegionList *,RegionList *,int);
 RegionList *quote(RegionList *,RegionList *,int);
 RegionList *in(RegionList *,RegionList *,int);
@@ -60,6 +61,124 @@ RegionList *eval_near(RegionList *l, RegionList *r,int num);
 RegionList *near_before(RegionList *l, RegionList *r,int num);
 
 int free_tree_node(ParseTreeNode *node);
+static void release_subtree(Evaluator *, ParseTreeNode *node);
+static int skip_operand(Evaluator *, ParseTreeNode *node);
+static void note_evaluation(ParseTreeNode *node, const RegionList *list);
+static void note_probes(ParseTreeNode *node, RegionList *l, RegionList *r);
+static RegionList *first_from_cursor(Evaluator *, ParseTreeNode *root);
+static RegionCursor *open_list_cursor(Evaluator *, ParseTreeNode *node);
+static int parallel_subtrees(Evaluator *, ParseTreeNode *left, int left_type,
+			     ParseTreeNode *right, int right_type,
+			     void **l, void **r);
+
+/* Kinds of results of subtrees evaluated by parallel_subtrees() */
+#define JOB_LIST 0		/* Region list from recursive_eval() */
+#define JOB_CURSOR 1		/* Cursor from open_cursor() */
+#define JOB_LIST_CURSOR 2	/* Cursor from open_list_cursor() */
+static RegionCursor *open_cursor(Evaluator *evaluator, ParseTreeNode *root);
+static RegionList *or_merge(Evaluator *evaluator, ParseTreeNode *root);
+
+/*
+ * Tells whether operator should seek in list longer with seek_region()
+ * instead of stepping through it with get_region(). The cost model of
+ * plan_probe() decides. Prepares the list for seeking, so this must be
+ * called before start_region_search()
+ */
+static int use_seek(RegionList *longer, RegionList *shorter) {
+    SGREPDATA(longer);
+
+    if (!plan_probe(longer,shorter)) return 0;
+    if (!LIST_IS_CHARS(longer)) list_require_start_sorted_array(longer);
+    STATS_ADD(seeking_operations,1);
+    return 1;
+}
+
+/*
+ * Like seek_region(), but skips the regions ending before end. Only
+ * for lists without nesting, where the end points are sorted too.
+ */
+static void seek_region_end(ListIterator *handle, Offset end, Region *reg) {
+    Region prev;
+
+    seek_region(handle,end,reg);
+    /* Regions ending at or after end may start before it. Because
+     * the ends are sorted, they are just before reg */
+    if (reg->start!=-1) prev_region(handle,&prev);
+    prev_region(handle,&prev);
+    while(prev.start!=-1 && prev.end>=end) {
+	prev_region(handle,&prev);
+    }
+    if (prev.start!=-1) get_region(handle,&prev);
+    get_region(handle,reg);
+}
+
+/*
+ * For contiguous lists: skips reg, the region last read from handle,
+ * and the regions after it whose point in points (the start or end
+ * array of the list) is smaller than key. Gets the next region to reg
+ * and returns the number of regions skipped.
+ */
+static int skip_run(ListIterator *handle, const Offset *points,
+		    Offset key, Region *reg) {
+    SGREPDATA(handle->list);
+    int first=handle->ind-1;
+    int n;
+
+    n=merge_count_below(sgrep,points+first,LIST_SIZE(handle->list)-first,
+			key);
+    handle->ind=first+n;
+    get_region(handle,reg);
+    return n;
+}
+
+/*
+ * Gets the list of a phrase from the index
+ */
+static void lookup_index_phrase(Evaluator *evaluator, ParseTreeNode *root) {
+    SGREPDATA(evaluator);
+
+    assert(root->leaf->phrase!=NULL);
+    assert(sgrep->index_reader);
+    if (root->leaf->phrase->s[0]=='#') {
+	/* Builtin, can't be found from index */
+	const char *s=string_to_char(root->leaf->phrase);
+	RegionList *list=new_region_list(sgrep);
+	root->leaf->regions=list;
+	if (strcmp(s,"#start")==0) {
+	    Offset start=flist_start(evaluator->files,0);
+	    add_region(list,start,start);
+	} else if (strcmp(s,"#end")==0) {
+	    Offset end=flist_total(evaluator->files)-1;
+	    add_region(list,end,end);
+	} else {
+	    sgrep_error(sgrep,"Don't know how to handle phrase %s\n",s);
+	}
+    } else {
+	root->leaf->regions=index_lookup(sgrep->index_reader,
+					 root->leaf->phrase->s);
+    }
+}
+
+/*
+ * With an index the phrase lists are looked up only when needed. The
+ * plan needs their sizes, so they are looked up before making it.
+ * Subtrees found from the subexpression cache are left alone, as they
+ * are not evaluated.
+ */
+static void lookup_index_leaves(Evaluator *evaluator, ParseTreeNode *node) {
+    SGREPDATA(evaluator);
+
+    if (node==NULL || node->result) return;
+    if (node->oper==PHRASE) {
+	if (node->leaf->regions==NULL) lookup_index_phrase(evaluator,node);
+	return;
+    }
+    if (sgrep->subexpr_cache && cache_has_entry(sgrep->subexpr_cache,node)) {
+	return;
+    }
+    lookup_index_leaves(evaluator,node->left);
+    lookup_index_leaves(evaluator,node->right);
+}
 
 RegionList *eval(struct SgrepStruct *sgrep,
 		     const FileList *file_list,
@@ -69,11 +188,15 @@ RegionList *eval(struct SgrepStruct *sgrep,
 
     evaluator.sgrep=sgrep;
     evaluator.files=file_list;
+    /* Nodes and stack are recycled through the arena, which is kept
+     * for later evaluations */
+    open_eval_arena(sgrep);
     evaluator.tmp_stack_size=DEFAULT_STACK_SIZE;
-    evaluator.tmp_stack=(Region *)sgrep_malloc(DEFAULT_STACK_SIZE*
-	sizeof(Region));
+    evaluator.tmp_stack=arena_take_stack(sgrep,&evaluator.tmp_stack_size);
+    if (sgrep->index_file) lookup_index_leaves(&evaluator,root);
+    plan_tree(sgrep,root);
     r=recursive_eval(&evaluator,root);
-    if (evaluator.tmp_stack) sgrep_free(evaluator.tmp_stack);
+    arena_return_stack(sgrep,evaluator.tmp_stack,evaluator.tmp_stack_size);
     return r;
 }
 
@@ -104,30 +227,7 @@ RegionList *recursive_eval(Evaluator *evaluator,ParseTreeNode *root)
 	{
 	    /* Check for lazy evaluation mode */
 	    if (sgrep->index_file && root->leaf->regions==NULL) {
-		assert(root->leaf->phrase!=NULL);
-		assert(sgrep->index_reader);
-		
-		if (root->leaf->phrase->s[0]=='#') {
-		    /* Builtin, can't be found from index */
-		    const char *s=string_to_char(root->leaf->phrase);
-		    RegionList *list=new_region_list(sgrep);
-		    root->leaf->regions=list;
-		    if (strcmp(s,"#start")==0) {
-			int start=flist_start(evaluator->files,0);
-			add_region(list,start,start);
-		    } else if (strcmp(s,"#end")==0) {
-			int end=flist_total(evaluator->files)-1;
-			add_region(list,end,end);
-		    } else {
-			sgrep_error(sgrep,
-				    "Don't know how to handle phrase %s\n",
-				    s);
-		    }				    
-		} else {
-		    root->leaf->regions=index_lookup(
-			sgrep->index_reader,
-			root->leaf->phrase->s);
-		}
+		lookup_index_phrase(evaluator,root);
 	    }
 	    assert(root->leaf->regions!=NULL);
 	    
@@ -142,12 +242,23 @@ RegionList *recursive_eval(Evaluator *evaluator,ParseTreeNode *root)
 
 	/* If gc_list is still NULL, it means that it hasn't been 
 	 * evaluated yet */
+	if ( a==NULL && sgrep->subexpr_cache &&
+	     (a=cache_lookup(sgrep->subexpr_cache,root))!=NULL )
+	{
+	    /* Found from the cache, the subtrees are not needed */
+	    a->refcount=root->refcount;
+	    release_subtree(evaluator,root->left);
+	    release_subtree(evaluator,root->right);
+	}
 	if ( a==NULL )
 	{
 	    /* Eval it now */
 
 	    a=eval_operator(evaluator,root);
 	    a->refcount=root->refcount;
+	    if (sgrep->subexpr_cache) {
+		cache_store(sgrep->subexpr_cache,root,a);
+	    }
 	    /* We free subtrees unneeded gclists */
 	    if (free_tree_node(root->left))
 	    {
@@ -173,8 +284,10 @@ RegionList *recursive_eval(Evaluator *evaluator,ParseTreeNode *root)
 #endif		
 	
 	/* Keeps track of longest used gc list */
+	sgrep_lock(sgrep);
 	if (LIST_SIZE(a)>stats.longest_list)
 		stats.longest_list=LIST_SIZE(a);
+	sgrep_unlock(sgrep);
 #ifdef ASSERT_NESTS
 	/* We check that if list isn't marked as nested, it really isn't */
 	if (!a->nested)
@@ -194,6 +307,7 @@ RegionList *recursive_eval(Evaluator *evaluator,ParseTreeNode *root)
 	}
 #endif	
 
+	if (root->result==NULL) note_evaluation(root,a);
 	root->result=a;	
 
 #ifdef DEBUG
@@ -210,19 +324,63 @@ RegionList *recursive_eval(Evaluator *evaluator,ParseTreeNode *root)
 RegionList *eval_operator(Evaluator *evaluator,ParseTreeNode *root)
 {
     RegionList *a,*l,*r;
+    ParseTreeNode *first_node,*second_node;
+    RegionList **first_list,**second_list;
+    void *pl,*pr;
+    SGREPDATA(evaluator);
 
     a=NULL;
     assert(root->left!=NULL);
 
+    /* first() needs only the first regions of its subtree */
+    if (root->oper==FIRST) {
+	STATS_ADD(operators_evaluated,1);
+	return first_from_cursor(evaluator,root);
+    }
+    /* Chains of or are merged at once */
+    if (root->oper==OR && root->number>2) {
+	STATS_ADD(operators_evaluated,1);
+	return or_merge(evaluator,root);
+    }
 	
-    /* Evaluate left and right subtrees first */
-    l=recursive_eval(evaluator,root->left);
-    /* Functions don't have right subtree. */
-    if (root->right==NULL) r=NULL;
-    else r=recursive_eval(evaluator,root->right);
+    /* Evaluate left and right subtrees first, in the planned order.
+     * When the first one is expected to be empty, it is evaluated alone
+     * so that the other one can be skipped. */
+    if (root->plan.flags&PLAN_RIGHT_FIRST) {
+	first_node=root->right;
+	first_list=&r;
+	second_node=root->left;
+	second_list=&l;
+    } else {
+	first_node=root->left;
+	first_list=&l;
+	second_node=root->right;
+	second_list=&r;
+    }
+    if (!((root->plan.flags&PLAN_SHORT_CIRCUIT) &&
+	  first_node->plan.estimate==0) &&
+	parallel_subtrees(evaluator,root->left,JOB_LIST,
+			  root->right,JOB_LIST,&pl,&pr)) {
+	l=(RegionList *)pl;
+	r=(RegionList *)pr;
+    } else {
+	*first_list=recursive_eval(evaluator,first_node);
+	/* Functions don't have right subtree. */
+	if (second_node==NULL) {
+	    *second_list=NULL;
+	} else if ((root->plan.flags&PLAN_SHORT_CIRCUIT) &&
+		   LIST_SIZE(*first_list)==0 &&
+		   skip_operand(evaluator,second_node)) {
+	    STATS_ADD(operators_evaluated,1);
+	    return new_region_list(evaluator->sgrep);
+	} else {
+	    *second_list=recursive_eval(evaluator,second_node);
+	}
+    }
     
     /* Statistics */
-    evaluator->sgrep->statistics.operators_evaluated++;
+    STATS_ADD(operators_evaluated,1);
+    note_probes(root,l,r);
 
     /* Find the correct evaluation function */
     switch (root->oper) {
@@ -311,6 +469,206 @@ RegionList *eval_operator(Evaluator *evaluator,ParseTreeNode *root)
     return a;
 }
 
+/*
+ * Parallel evaluation of sibling subtrees. Two subtrees may be evaluated
+ * at the same time only when they share no tree nodes: a list read by
+ * several parents may be sorted or freed while it is read. Shared nodes
+ * have refcount>1 and constant lists refcount -1 (see
+ * create_reference_counters()). Memory and list bookkeeping is locked,
+ * the operation counters shown by -T are not and may be a bit off.
+ */
+struct SubtreeJob {
+    Evaluator evaluator;
+    ParseTreeNode *node;
+    int type;			/* What is made of the subtree */
+    void *result;
+};
+
+/*
+ * Tells whether no node in the subtree is shared or already evaluated
+ */
+static int private_subtree(const ParseTreeNode *node) {
+    if (node==NULL) return 1;
+    if (node->refcount!=1 || node->result!=NULL) return 0;
+    if (node->oper==PHRASE) return 1;
+    return private_subtree(node->left) && private_subtree(node->right);
+}
+
+/*
+ * Tells whether evaluating the subtree is worth a thread. Phrase
+ * lists are ready, unless they are looked up from an index.
+ */
+static int heavy_subtree(SgrepData *sgrep, const ParseTreeNode *node) {
+    if (node->oper!=PHRASE) return 1;
+    return sgrep->index_file && node->leaf->regions==NULL;
+}
+
+static void *subtree_job(void *arg) {
+    struct SubtreeJob *job=(struct SubtreeJob *)arg;
+
+    switch(job->type) {
+    case JOB_LIST:
+	job->result=recursive_eval(&job->evaluator,job->node);
+	break;
+    case JOB_CURSOR:
+	job->result=open_cursor(&job->evaluator,job->node);
+	break;
+    case JOB_LIST_CURSOR:
+	job->result=open_list_cursor(&job->evaluator,job->node);
+	break;
+    }
+    return NULL;
+}
+
+/*
+ * Evaluates subtree left in this thread and subtree right in another
+ * one, if they are independent and there is a thread to spare. The
+ * types tell whether lists or cursors are wanted. Returns 0 if the
+ * subtrees were not evaluated.
+ */
+static int parallel_subtrees(Evaluator *evaluator,
+			     ParseTreeNode *left, int left_type,
+			     ParseTreeNode *right, int right_type,
+			     void **l, void **r) {
+    struct SubtreeJob jobs[2];
+    int spare;
+    SGREPDATA(evaluator);
+
+    if (sgrep->threads<=1 || right==NULL ||
+	!heavy_subtree(sgrep,left) || !heavy_subtree(sgrep,right) ||
+	!private_subtree(left) || !private_subtree(right)) {
+	return 0;
+    }
+    sgrep_lock(sgrep);
+    spare=(sgrep->busy_threads+1<sgrep->threads);
+    if (spare) {
+	sgrep->busy_threads++;
+	stats.parallel_subtrees++;
+    }
+    sgrep_unlock(sgrep);
+    if (!spare) return 0;
+
+    jobs[0].evaluator=*evaluator;
+    jobs[0].node=left;
+    jobs[0].type=left_type;
+    /* The other thread needs a stack of its own */
+    jobs[1].evaluator=*evaluator;
+    jobs[1].evaluator.tmp_stack_size=DEFAULT_STACK_SIZE;
+    jobs[1].evaluator.tmp_stack=(Region *)sgrep_malloc(
+	DEFAULT_STACK_SIZE*sizeof(Region));
+    jobs[1].node=right;
+    jobs[1].type=right_type;
+    run_in_threads(subtree_job,jobs,sizeof(struct SubtreeJob),2);
+
+    /* Our stack may have grown */
+    evaluator->tmp_stack=jobs[0].evaluator.tmp_stack;
+    evaluator->tmp_stack_size=jobs[0].evaluator.tmp_stack_size;
+    sgrep_free(jobs[1].evaluator.tmp_stack);
+    sgrep_lock(sgrep);
+    sgrep->busy_threads--;
+    sgrep_unlock(sgrep);
+    *l=jobs[0].result;
+    *r=jobs[1].result;
+    return 1;
+}
+
+/*
+ * The parent of node was read from the cache, so node won't be
+ * evaluated for it. A subtree shared with other parents is still
+ * evaluated for them, others are skipped. The reference counts of
+ * the parse tree itself are left alone, free_parse_tree() needs them.
+ */
+static void release_subtree(Evaluator *evaluator, ParseTreeNode *node)
+{
+    if (node==NULL || node->refcount==-1) return;
+    if (node->result==NULL && node->refcount>1) {
+	recursive_eval(evaluator,node);
+    }
+    if (node->result!=NULL) {
+	free_tree_node(node);
+	return;
+    }
+    if (node->oper==PHRASE) {
+	if (node->leaf->regions) {
+	    delete_region_list(node->leaf->regions);
+	    node->leaf->regions=NULL;
+	}
+	return;
+    }
+    release_subtree(evaluator,node->left);
+    release_subtree(evaluator,node->right);
+}
+
+/*
+ * The other operand of the parent of node was empty, so the parent
+ * does not need node. Skips node unless somebody else needs it too.
+ * Returns 1 if node was skipped.
+ */
+static int skip_operand(Evaluator *evaluator, ParseTreeNode *node)
+{
+    SGREPDATA(evaluator);
+
+    if (node->refcount!=1 || node->result!=NULL) return 0;
+    release_subtree(evaluator,node);
+    node->plan.shown|=PLAN_SKIPPED;
+    sgrep_lock(sgrep);
+    stats.short_circuits++;
+    sgrep_unlock(sgrep);
+    return 1;
+}
+
+/*
+ * Adds a list computed for node to the figures shown with -E. The
+ * regions of streamed nodes (list NULL) are added by their cursors.
+ */
+static void note_evaluation(ParseTreeNode *node, const RegionList *list)
+{
+    node->plan.evaluations++;
+    if (node->plan.estimate<0 || node->plan.estimated<0) {
+	node->plan.estimated=-1;
+    } else {
+	node->plan.estimated+=node->plan.estimate;
+    }
+    if (list) node->plan.regions+=LIST_SIZE(list);
+    node->plan.shown|=node->plan.flags;
+}
+
+/*
+ * Records which lists the operator of node will probe instead of
+ * merging and whether it can skip outer() or inner() of the right list.
+ * These are decided by the operators, using plan_probe() like here.
+ */
+static void note_probes(ParseTreeNode *node, RegionList *l, RegionList *r)
+{
+    int probe_l,probe_r;
+
+    if (r==NULL || LIST_IS_CHARS(l) || LIST_IS_CHARS(r)) return;
+    probe_l=plan_probe(l,r);
+    probe_r=plan_probe(r,l);
+    switch(node->oper) {
+    case IN:
+    case NOT_IN:
+    case CONTAINING:
+    case NOT_CONTAINING:
+#ifdef OPTIMIZE_SORTS
+	if (!r->nested) node->plan.shown|=PLAN_NO_PREPROCESS;
+#endif
+	if (probe_r) node->plan.shown|=PLAN_PROBE_RIGHT;
+	if (probe_l && node->oper==IN) node->plan.shown|=PLAN_PROBE_LEFT;
+	break;
+    case EQUAL:
+    case NOT_EQUAL:
+    case NEAR:
+	if (probe_r) node->plan.shown|=PLAN_PROBE_RIGHT;
+	if (probe_l && node->oper!=NOT_EQUAL) {
+	    node->plan.shown|=PLAN_PROBE_LEFT;
+	}
+	break;
+    default:
+	break;
+    }
+}
+
 /*
  * Decrements tree nodes reference counter, and frees nodes gc list if
  * counter comes down to 0. Returns 1 if something was freed, 0
@@ -384,6 +742,79 @@ Region first_of(ListIterator *lp,ListIterator *rp)
 	return r_reg;
 }
 
+/*
+ * Adds n regions from arrays to the result of or_arrays()
+ */
+static void add_or_run(RegionList *a, const Offset *starts,
+		       const Offset *ends, int n, Offset *prev_end)
+{
+#ifdef OPTIMIZE_SORTS
+	if (ends[0]<=*prev_end)
+	{
+		/* We had nesting */
+		a->nested=1;
+	}
+#endif
+	add_region_array(a,starts,ends,n);
+	*prev_end=ends[n-1];
+}
+
+/*
+ * or() for two contiguous lists. The regions of one list starting
+ * before the next region of the other list are copied as one run.
+ */
+static RegionList *or_arrays(RegionList *l,RegionList *r)
+{
+	ListIterator lp,rp;
+	const Offset *ls,*le,*rs,*re;
+	int i,j,nl,nr,n;
+	Offset prev_end=-1;
+	RegionList *a;
+	SGREPDATA(l);
+
+	STATS_ADD(kernel_merges,1);
+	start_region_search(l,&lp);
+	start_region_search(r,&rp);
+	ls=lp.array.starts;
+	le=lp.array.ends;
+	rs=rp.array.starts;
+	re=rp.array.ends;
+	nl=LIST_SIZE(l);
+	nr=LIST_SIZE(r);
+	a=new_contiguous_region_list(sgrep);
+#ifdef OPTIMIZE_SORTS
+	a->nested=l->nested || r->nested;
+#endif
+	i=j=0;
+	while(i<nl && j<nr)
+	{
+		if (ls[i]<rs[j])
+		{
+			n=merge_count_below(sgrep,ls+i,nl-i,rs[j]);
+			add_or_run(a,ls+i,le+i,n,&prev_end);
+			i+=n;
+		} else if (rs[j]<ls[i])
+		{
+			n=merge_count_below(sgrep,rs+j,nr-j,ls[i]);
+			add_or_run(a,rs+j,re+j,n,&prev_end);
+			j+=n;
+		} else if (le[i]<re[j])
+		{
+			add_or_run(a,ls+i,le+i,1,&prev_end);
+			i++;
+		} else
+		{
+			/* Same regions are added once */
+			if (le[i]==re[j]) i++;
+			add_or_run(a,rs+j,re+j,1,&prev_end);
+			j++;
+		}
+	}
+	if (i<nl) add_or_run(a,ls+i,le+i,nl-i,&prev_end);
+	if (j<nr) add_or_run(a,rs+j,re+j,nr-j,&prev_end);
+	return a;
+}
+
 /*
  * Handles or operation
  */
@@ -404,7 +835,10 @@ RegionList *or(RegionList *l,RegionList *r)
 #ifdef DEBUG
 	fprintf(stderr,"or called\n");
 #endif
-	stats.or_oper++;
+	STATS_ADD(or_oper,1);
+	if (LIST_IS_CONTIGUOUS(l) && LIST_IS_CONTIGUOUS(r)) {
+		return or_arrays(l,r);
+	}
 	a=new_region_list(sgrep);
 #ifdef OPTIMIZE_SORTS
 	prev.start=-1;
@@ -447,7 +881,7 @@ RegionList *nest_order(Evaluator *evaluator,
     Region r_reg,l_reg;              
     int nest_depth=0;
     int nestings;
-    int s,e;
+    Offset s,e;
     SGREPDATA(evaluator);
 #ifdef PROGRESS_REPORTS
     char *oper_name;
@@ -459,7 +893,7 @@ RegionList *nest_order(Evaluator *evaluator,
 #endif
     start_region_search(r,&rp);
     
-    stats.order++;
+    STATS_ADD(order,1);
     a=new_region_list(sgrep);
     a->nested=l->nested || r->nested;
 #ifdef DEBUG
@@ -561,6 +995,7 @@ containment */
 	ListIterator lp,rp;
 	RegionList *a,*r2;
 	Region r_reg,l_reg,r_reg2;
+	int seek_l,seek_r;
 	char *oper_name;
 #ifdef PROGRESS_REPORTS
 	int prog;int prog_start;
@@ -572,11 +1007,11 @@ containment */
 #endif
 	if (not) 
 	{
-		stats.not_in++;
+		STATS_ADD(not_in,1);
 		oper_name="not in";
 	} else 
 	{
-		stats.in++;
+		STATS_ADD(in,1);
 		oper_name="in";
 	}
 	a=new_region_list(sgrep);
@@ -585,10 +1020,6 @@ containment */
 	a->nested=l->nested;
 #endif
 	
-	start_region_search(l,&lp);
-	get_region(&lp,&l_reg);
-	
-	
        /* 
  	* To simplify things we do an outer function on right gc_list 
  	*/
@@ -601,6 +1032,12 @@ containment */
 #ifdef OPTIMIZE_SORTS
 	} else r2=NULL;
 #endif
+	/* Left regions can be skipped only when they are not output */
+	seek_l=!not && use_seek(l,r);
+	seek_r=use_seek(r,l);
+
+	start_region_search(l,&lp);
+	get_region(&lp,&l_reg);
 	start_region_search(r,&rp);
 
 #ifdef PROGRESS_REPORTS
@@ -622,7 +1059,8 @@ containment */
 			   in right region or any right region that follows
 			   current one */
 			if (not) add_region(a,l_reg.start,l_reg.end);
-			get_region(&lp,&l_reg);
+			if (seek_l) seek_region(&lp,r_reg.start,&l_reg);
+			else get_region(&lp,&l_reg);
 		} else /* l_reg.start>=r_reg.start */
 		{
 			if (l_reg.end<=r_reg.end)
@@ -676,6 +1114,15 @@ containment */
 						/* Since left region starts after new right region,
 						 * We can safely skip previous right */
 						r_reg=r_reg2;
+						if (seek_r)
+						{
+							/* Skip to the last right region
+							   starting at or before left one */
+							seek_region(&rp,l_reg.start+1,&r_reg2);
+							if (r_reg2.start!=-1) prev_region(&rp,&r_reg2);
+							prev_region(&rp,&r_reg);
+							get_region(&rp,&r_reg2);
+						}
 					} else
 					{
 						/* Left region is not in previous or next 
@@ -727,7 +1174,7 @@ RegionList *outer(RegionList *gcl)
 	prog=0;
 #endif
 
-	stats.outer++;
+	STATS_ADD(outer,1);
 	reg2.start=0;
 	a=new_region_list(sgrep);
 	start_region_search(gcl,&p);
@@ -785,7 +1232,7 @@ RegionList *inner(Evaluator *evaluator,RegionList *gcl)
 #ifdef DEBUG
     fprintf(stderr,"inner called\n");
 #endif	
-    stats.inner++;
+    STATS_ADD(inner,1);
     a=new_region_list(sgrep);
     inner_stack=evaluator->tmp_stack;
 
@@ -860,6 +1307,7 @@ containment */
 	ListIterator lp,rp;
 	RegionList *a,*r2;
 	Region r_reg,l_reg;
+	int seek_r;
 	SGREPDATA(evaluator);
 #ifdef PROGRESS_REPORTS
 	char *oper_name;
@@ -869,13 +1317,11 @@ containment */
 #ifdef DEBUG
 	fprintf(stderr,"containing called\n");
 #endif
-	if (not) stats.not_containing++; else stats.containing++;
+	if (not) STATS_ADD(not_containing,1); else STATS_ADD(containing,1);
 	a=new_region_list(sgrep);
 #ifdef OPTIMIZE_SORTS
 	a->nested=l->nested;
 #endif
-	start_region_search(l,&lp);
-	get_region(&lp,&l_reg);
 
 /* To simplify things we do an inner function on right gc_list */
 #ifdef OPTIMIZE_SORTS
@@ -893,6 +1339,10 @@ containment */
 	prog=0;
 	prog_start=LIST_SIZE(l)+LIST_SIZE(r);
 #endif
+	/* Right regions starting before left region can be skipped */
+	seek_r=use_seek(r,l);
+	start_region_search(l,&lp);
+	get_region(&lp,&l_reg);
 	start_region_search(r,&rp);
 	
 	get_region(&rp,&r_reg);
@@ -901,7 +1351,8 @@ containment */
 		if ( l_reg.start>r_reg.start )
 		{
 			/* right starts before left */
-			get_region(&rp,&r_reg);
+			if (seek_r) seek_region(&rp,l_reg.start,&r_reg);
+			else get_region(&rp,&r_reg);
 		} else if ( l_reg.end>=r_reg.end )
 		{
 			/* left contains right */
@@ -940,6 +1391,9 @@ RegionList *equal(RegionList *l,RegionList *r,int not)
 	ListIterator lp,rp;
 	RegionList *a;
 	Region r_reg,l_reg;
+	int seek_l,seek_r;
+	int kernel_l,kernel_r;
+	int first,n;
 	SGREPDATA(l);
 #ifdef PROGRESS_REPORTS
 	char *oper_name;
@@ -949,11 +1403,19 @@ RegionList *equal(RegionList *l,RegionList *r,int not)
 #ifdef DEBUG
 	fprintf(stderr,"equal called\n");
 #endif
-	if (not) stats.not_equal++; else stats.equal++;
-	a=new_region_list(sgrep);
+	if (not) STATS_ADD(not_equal,1); else STATS_ADD(equal,1);
+	/* Runs of contiguous lists are skipped (or copied) with the merge
+	 * kernel, which also gallops over long runs like seek_region() */
+	kernel_l=LIST_IS_CONTIGUOUS(l);
+	kernel_r=LIST_IS_CONTIGUOUS(r);
+	if (kernel_l || kernel_r) STATS_ADD(kernel_merges,1);
+	a= (kernel_l) ? new_contiguous_region_list(sgrep) :
+		new_region_list(sgrep);
 #ifdef OPTIMIZE_SORTS
 	a->nested=l->nested;
 #endif
+	seek_l=!kernel_l && !not && use_seek(l,r);
+	seek_r=!kernel_r && use_seek(r,l);
 	start_region_search(l,&lp);
 	get_region(&lp,&l_reg);
 
@@ -971,11 +1433,25 @@ RegionList *equal(RegionList *l,RegionList *r,int not)
 	{
 		if ( l_reg.start<r_reg.start )
 		{
+			if (kernel_l)
+			{
+				first=lp.ind-1;
+				n=skip_run(&lp,lp.array.starts,r_reg.start,
+					   &l_reg);
+				if (not) add_region_array(a,
+							  lp.array.starts+first,
+							  lp.array.ends+first,n);
+				continue;
+			}
 			if (not) add_region(a,l_reg.start,l_reg.end);
-			get_region(&lp,&l_reg);
+			if (seek_l) seek_region(&lp,r_reg.start,&l_reg);
+			else get_region(&lp,&l_reg);
 		} else if ( r_reg.start<l_reg.start )
 		{
-			get_region(&rp,&r_reg);
+			if (kernel_r) skip_run(&rp,rp.array.starts,l_reg.start,
+					       &r_reg);
+			else if (seek_r) seek_region(&rp,l_reg.start,&r_reg);
+			else get_region(&rp,&r_reg);
 		} else  /*  r_reg.start=l_reg.start */
 			if ( l_reg.end<r_reg.end )
 			{
@@ -992,6 +1468,13 @@ RegionList *equal(RegionList *l,RegionList *r,int not)
 			}
 	}
 	/* When right list ended, there still might be something in left list */
+	if (not && kernel_l && l_reg.start!=-1)
+	{
+		first=lp.ind-1;
+		add_region_array(a,lp.array.starts+first,lp.array.ends+first,
+				 LIST_SIZE(l)-first);
+		return a;
+	}
 	while (not && l_reg.start!=-1)
 	{
 		add_region(a,l_reg.start,l_reg.end);
@@ -1019,7 +1502,7 @@ RegionList *concat(RegionList *l)
 #ifdef DEBUG
 	fprintf(stderr,"concat called\n");
 #endif
-	stats.concat++;
+	STATS_ADD(concat,1);
 	a=new_region_list(sgrep);
 	start_region_search(l,&lp);
 	get_region(&lp,&reg1);
@@ -1061,9 +1544,9 @@ RegionList *extracting(RegionList *l,RegionList *r)
 	ListIterator lp,rp,tmpp;
 	RegionList *a,*r2,*tmp,*new_tmp;
 	Region l_reg,r_reg;
-	int prev_s=-1;
-	int prev_e=-1;
-	int last_tmp;
+	Offset prev_s=-1;
+	Offset prev_e=-1;
+	Offset last_tmp;
 #ifdef PROGRESS_REPORTS
 	char *oper_name;
 	int prog;int prog_start;
@@ -1072,7 +1555,7 @@ RegionList *extracting(RegionList *l,RegionList *r)
 #ifdef DEBUG
 	fprintf(stderr,"extracting called\n");
 #endif
-	stats.extracting++;
+	STATS_ADD(extracting,1);
 	/* to simplify things we do concat on right gc_list. Result stays
 	   the same anyway */
 	r2=concat(r);
@@ -1199,12 +1682,12 @@ RegionList *join(Evaluator *evaluator,RegionList *l,int number)
 #endif
 	assert(number>0);
 
-	stats.join++;
+	STATS_ADD(join,1);
 	a=new_region_list(sgrep);
 #ifdef OPTIMIZE_SORTS
 	a->nested=l->nested;
 #endif	
-	if ( l->first==NULL )
+	if ( LIST_IS_CHARS(l) )
 	{
 		/* This is an optimized chars node */
 		to_chars(a,(l->chars+1)*number,
@@ -1392,7 +1875,7 @@ RegionList *quote(RegionList *l,RegionList *r,int type)
 #ifdef DEBUG
 	fprintf(stderr,"quote called\n");
 #endif	
-	stats.quote++;
+	STATS_ADD(quote,1);
 	a=new_region_list(sgrep);
 
 #ifdef PROGRESS_REPORTS
@@ -1459,12 +1942,15 @@ RegionList *quote(RegionList *l,RegionList *r,int type)
  * NOTE: assumes that require_start_sorted_array has been called for
  * list
  */
-int list_find_first_start(RegionList *list, int start, int index) {
+int list_find_first_start(RegionList *list, int start, Offset index) {
     int end;
     int middle;
     Region region;
 
-    assert(list->start_sorted_array);
+    if (LIST_IS_COMPRESSED(list)) {
+	return compressed_find_first_start(list,start,index);
+    }
+    assert(list->start_sorted_array || LIST_IS_CONTIGUOUS(list));
     end=LIST_SIZE(list);
     assert(start<=end);
 
@@ -1505,7 +1991,7 @@ RegionList *parenting(Evaluator *evaluator,RegionList *l, RegionList *r) {
     int sp=0; /* Stack pointer */
     SGREPDATA(l);
 
-    stats.parenting++;
+    STATS_ADD(parenting,1);
 
     /* Initialization */
     result=new_region_list(sgrep);
@@ -1603,12 +2089,12 @@ RegionList *childrening(RegionList *children,
     Region parent,child,next_child;
     int childrens;
     RegionList *saved_parents;
-    int last_parent_end;
+    Offset last_parent_end;
     int loops=0;
-    int first;
+    Offset first;
     SGREPDATA(children);
     
-    stats.childrening++;
+    STATS_ADD(childrening,1);
 
     /* Initialization */
     start_region_search(parents,&parent_i);    
@@ -1722,13 +2208,24 @@ RegionList *eval_near(RegionList *l,
     ListIterator first_i, second_i;
     Region result,first,second;
     RegionList *result_list;
+    int seek_first,seek_second;
+    int kernel_first,kernel_second;
     SGREPDATA(l);
 
     /* To simplify things, we outer() on first and second */
     first_list= (l->nested) ? outer(l) : l;
     second_list= (r->nested) ? outer(r) : r;
     
-    /* Initialize */
+    /* Initialize. Without nesting the end points are sorted too, so
+     * contiguous lists can skip the regions ending too far with the
+     * merge kernel */
+    kernel_first=how_near>=0 && LIST_IS_CONTIGUOUS(first_list);
+    kernel_second=how_near>=0 && LIST_IS_CONTIGUOUS(second_list);
+    if (kernel_first || kernel_second) STATS_ADD(kernel_merges,1);
+    seek_first=!kernel_first && how_near>=0 &&
+	use_seek(first_list,second_list);
+    seek_second=!kernel_second && how_near>=0 &&
+	use_seek(second_list,first_list);
     start_region_search(first_list,&first_i);
     get_region(&first_i,&first);
     start_region_search(second_list,&second_i);
@@ -1758,8 +2255,16 @@ RegionList *eval_near(RegionList *l,
 		    result.start=first.start;
 		    result.end=second.end;
 		}
+		get_region(&first_i,&first);
+	    } else if (kernel_first) {
+		skip_run(&first_i,first_i.array.ends,
+			 second.start-1-how_near,&first);
+	    } else if (seek_first) {
+		/* Skip the first regions ending too far from second */
+		seek_region_end(&first_i,second.start-1-how_near,&first);
+	    } else {
+		get_region(&first_i,&first);
 	    }
-	    get_region(&first_i,&first);
 
 	} else {
 
@@ -1780,8 +2285,15 @@ RegionList *eval_near(RegionList *l,
 		    result.start=second.start;
 		    result.end=first.end;
 		}
+		get_region(&second_i,&second);
+	    } else if (kernel_second) {
+		skip_run(&second_i,second_i.array.ends,
+			 first.start-1-how_near,&second);
+	    } else if (seek_second) {
+		seek_region_end(&second_i,first.start-1-how_near,&second);
+	    } else {
+		get_region(&second_i,&second);
 	    }
-	    get_region(&second_i,&second);
 	}
     }
     
@@ -1807,7 +2319,7 @@ RegionList *near_before(RegionList *l,
     ListIterator first_i;
     int second_size;
     int second_i;
-    Region first;
+    Region first,second;
     RegionList *result_list;
     SGREPDATA(l);
 
@@ -1829,12 +2341,10 @@ RegionList *near_before(RegionList *l,
     /* Do the job */
     while(first.start!=-1 && second_i<second_size) {
 	    
-	    if (region_lvalue_at(second_list,second_i).start-1-
-		first.end <= how_near) {		
+	    region_at(second_list,second_i,&second);
+	    if (second.start-1-first.end <= how_near) {		
 		/* Found a match */
-		add_region(result_list,
-			   first.start,
-			   region_lvalue_at(second_list,second_i).end);
+		add_region(result_list,first.start,second.end);
 	    }
 	    /* Next */
 	    get_region(&first_i,&first);
@@ -1854,3 +2364,744 @@ RegionList *near_before(RegionList *l,
 
     return result_list;
 }
+
+/*
+ * Streaming evaluation.
+ *
+ * Instead of materializing every intermediate region list, the
+ * operators which produce their result in start point order while
+ * reading their inputs in order are evaluated through cursors, which
+ * pull regions from their inputs only when asked for the next region.
+ * Blocking operators, subtrees shared by several parents and the right
+ * inputs of in and containing (which need prev_region()) are
+ * evaluated to region lists as before and read through list cursors.
+ * So memory is needed only for the blocking points and the result can
+ * be written while it is being evaluated.
+ */
+typedef enum { LIST_CURSOR, OR_CURSOR, IN_CURSOR, CONTAINING_CURSOR,
+	       EQUAL_CURSOR, CONCAT_CURSOR, FIRST_CURSOR,
+	       MERGE_CURSOR } CursorType;
+
+/* Next region of an input of MERGE_CURSOR, kept in a heap */
+typedef struct {
+    Region reg;
+    int input;
+} MergeHead;
+
+struct RegionCursorStruct {
+    SgrepData *sgrep;
+    CursorType type;
+    ParseTreeNode *node;	/* Tree node whose list is read. Freed with
+				 * free_tree_node() */
+    ParseTreeNode *planned;	/* Streamed tree node, gets the regions
+				 * given to its plan */
+    RegionList *list;		/* List read by LIST_CURSOR. The right
+				 * list of IN_CURSOR and CONTAINING_CURSOR */
+    RegionList *own;		/* List created by cursor, deleted with it */
+    ListIterator iter;		/* Iterator for list */
+    struct RegionCursorStruct *left;
+    struct RegionCursorStruct *right;
+    Region l_reg;		/* Current region of left input */
+    Region r_reg;		/* Current region of right input */
+    int not;			/* The not variant of operator */
+    int number;			/* FIRST_CURSOR: regions left,
+				 * MERGE_CURSOR: number of inputs */
+    int regions;		/* Number of regions given */
+    struct RegionCursorStruct **inputs;	/* Inputs of MERGE_CURSOR */
+    MergeHead *heap;		/* Next regions of inputs, smallest first */
+    int heap_size;
+    int *taken;			/* Inputs which gave the current region */
+};
+
+static RegionCursor *alloc_cursor(SgrepData *sgrep, CursorType type) {
+    RegionCursor *c;
+
+    c=sgrep_new(RegionCursor);
+    c->sgrep=sgrep;
+    c->type=type;
+    c->node=NULL;
+    c->planned=NULL;
+    c->list=NULL;
+    c->own=NULL;
+    c->left=NULL;
+    c->right=NULL;
+    c->l_reg.start=c->l_reg.end=-1;
+    c->r_reg.start=c->r_reg.end=-1;
+    c->not=0;
+    c->number=0;
+    c->regions=0;
+    c->inputs=NULL;
+    c->heap=NULL;
+    c->heap_size=0;
+    c->taken=NULL;
+    return c;
+}
+
+/*
+ * Creates a cursor reading given list. The list is not freed with
+ * the cursor.
+ */
+RegionCursor *new_list_cursor(RegionList *list) {
+    RegionCursor *c;
+
+    c=alloc_cursor(list->sgrep,LIST_CURSOR);
+    c->list=list;
+    start_region_search(list,&c->iter);
+    return c;
+}
+
+/*
+ * Evaluates a subtree to a list and creates a cursor reading it
+ */
+static RegionCursor *open_list_cursor(Evaluator *evaluator,
+				      ParseTreeNode *node) {
+    RegionCursor *c;
+
+    c=new_list_cursor(recursive_eval(evaluator,node));
+    c->node=node;
+    return c;
+}
+
+/*
+ * Makes cursor c read list, which was created for it. The inputs
+ * of c are not needed any more.
+ */
+static void materialize_cursor(RegionCursor *c, RegionList *list) {
+    if (c->left) delete_region_cursor(c->left);
+    if (c->right) delete_region_cursor(c->right);
+    c->left=NULL;
+    c->right=NULL;
+    c->type=LIST_CURSOR;
+    c->list=list;
+    c->own=list;
+    start_region_search(list,&c->iter);
+}
+
+/*
+ * Tells whether the materializing operators would probe list a or b
+ * instead of merging them. Then they are faster than the cursors.
+ */
+static int unbalanced(const RegionList *a, const RegionList *b) {
+    return plan_probe(a,b) || plan_probe(b,a);
+}
+
+/*
+ * Tells whether cursor c is known to give no regions
+ */
+static int empty_cursor(const RegionCursor *c) {
+    return c->type==LIST_CURSOR && LIST_SIZE(c->list)==0;
+}
+
+/*
+ * Opens the inputs of cursor c: the left one as a cursor and the right
+ * one as given by right_type, in the planned order. Independent inputs
+ * are opened in parallel. Returns 0 if the first input was empty and
+ * the other was not opened, so the result is empty.
+ */
+static int open_inputs(Evaluator *evaluator, ParseTreeNode *root,
+			RegionCursor *c, int right_type) {
+    int plan=root->plan.flags;
+    void *l,*r;
+
+    if (!((plan&PLAN_SHORT_CIRCUIT) &&
+	  ((plan&PLAN_RIGHT_FIRST) ? root->right : root->left)
+	  ->plan.estimate==0) &&
+	parallel_subtrees(evaluator,root->left,JOB_CURSOR,
+			  root->right,right_type,&l,&r)) {
+	c->left=(RegionCursor *)l;
+	c->right=(RegionCursor *)r;
+	return 1;
+    }
+    if (plan&PLAN_RIGHT_FIRST) {
+	c->right=(right_type==JOB_CURSOR) ?
+	    open_cursor(evaluator,root->right) :
+	    open_list_cursor(evaluator,root->right);
+	if ((plan&PLAN_SHORT_CIRCUIT) && empty_cursor(c->right) &&
+	    skip_operand(evaluator,root->left)) {
+	    return 0;
+	}
+	c->left=open_cursor(evaluator,root->left);
+	return 1;
+    }
+    c->left=open_cursor(evaluator,root->left);
+    if ((plan&PLAN_SHORT_CIRCUIT) && empty_cursor(c->left) &&
+	skip_operand(evaluator,root->right)) {
+	return 0;
+    }
+    if (right_type==JOB_CURSOR) {
+	c->right=open_cursor(evaluator,root->right);
+    } else {
+	c->right=open_list_cursor(evaluator,root->right);
+    }
+    return 1;
+}
+
+/*
+ * Heap operations for MERGE_CURSOR. Regions are ordered by start point
+ * and then by end point, like in region lists.
+ */
+#define HEAD_BEFORE(A,B) ((A).reg.start<(B).reg.start || \
+	((A).reg.start==(B).reg.start && (A).reg.end<(B).reg.end))
+
+static void merge_heap_up(MergeHead *heap, int i) {
+    MergeHead h=heap[i];
+
+    while(i>0 && HEAD_BEFORE(h,heap[(i-1)/2])) {
+	heap[i]=heap[(i-1)/2];
+	i=(i-1)/2;
+    }
+    heap[i]=h;
+}
+
+static void merge_heap_down(MergeHead *heap, int n, int i) {
+    MergeHead h=heap[i];
+    int child;
+
+    while((child=2*i+1)<n) {
+	if (child+1<n && HEAD_BEFORE(heap[child+1],heap[child])) child++;
+	if (!HEAD_BEFORE(heap[child],h)) break;
+	heap[i]=heap[child];
+	i=child;
+    }
+    heap[i]=h;
+}
+
+/*
+ * Puts the next region of input i of merge cursor c to the heap
+ */
+static void merge_pull(RegionCursor *c, int i) {
+    MergeHead h;
+
+    cursor_get_region(c->inputs[i],&h.reg);
+    if (h.reg.start==-1) return;
+    h.input=i;
+    c->heap[c->heap_size]=h;
+    merge_heap_up(c->heap,c->heap_size++);
+}
+
+/*
+ * Creates a cursor merging all the operands of an n-ary or (see
+ * or_operands()) with a heap, so that every region is handled once
+ * instead of once for every or in the chain. When lists is set, the
+ * operands are evaluated to lists, and the ones which are children of
+ * root are left for recursive_eval() to free.
+ */
+static RegionCursor *open_merge_cursor(Evaluator *evaluator,
+				       ParseTreeNode *root, int lists) {
+    RegionCursor *c;
+    ParseTreeNode **operands;
+    ParseTreeNode *left,*right;
+    int i;
+    SGREPDATA(evaluator);
+
+    /* The children of root which are operands, not chained ors */
+    left=(root->left->oper==OR && root->left->refcount==1) ?
+	NULL : root->left;
+    right=(root->right->oper==OR && root->right->refcount==1) ?
+	NULL : root->right;
+    c=alloc_cursor(sgrep,MERGE_CURSOR);
+    c->number=root->number;
+    operands=(ParseTreeNode **)
+	sgrep_malloc(c->number*sizeof(ParseTreeNode *));
+    i=or_operands(root,operands);
+    assert(i==c->number);
+    c->inputs=(RegionCursor **)sgrep_malloc(c->number*sizeof(RegionCursor *));
+    c->heap=(MergeHead *)sgrep_malloc(c->number*sizeof(MergeHead));
+    c->taken=(int *)sgrep_malloc(c->number*sizeof(int));
+    for(i=0;i<c->number;i++) {
+	if (lists) {
+	    c->inputs[i]=open_list_cursor(evaluator,operands[i]);
+	    /* A shared operand may be found several times */
+	    if (operands[i]==left) {
+		c->inputs[i]->node=NULL;
+		left=NULL;
+	    } else if (operands[i]==right) {
+		c->inputs[i]->node=NULL;
+		right=NULL;
+	    }
+	} else {
+	    c->inputs[i]=open_cursor(evaluator,operands[i]);
+	}
+    }
+    sgrep_free(operands);
+    for(i=0;i<c->number;i++) merge_pull(c,i);
+    STATS_ADD(or_oper,c->number-1);
+    return c;
+}
+
+/*
+ * Next region of n-ary or. A region found from several inputs is given
+ * once, and every one of those inputs moves to its next region.
+ */
+static void merge_next(RegionCursor *c, Region *reg) {
+    MergeHead *heap=c->heap;
+    int i,taken=0;
+
+    if (c->heap_size==0) {
+	reg->start=reg->end=-1;
+	return;
+    }
+    *reg=heap[0].reg;
+    do {
+	c->taken[taken++]=heap[0].input;
+	heap[0]=heap[--c->heap_size];
+	if (c->heap_size>0) merge_heap_down(heap,c->heap_size,0);
+    } while(c->heap_size>0 && heap[0].reg.start==reg->start &&
+	    heap[0].reg.end==reg->end);
+    for(i=0;i<taken;i++) merge_pull(c,c->taken[i]);
+}
+
+/*
+ * Evaluates an n-ary or to a list
+ */
+static RegionList *or_merge(Evaluator *evaluator, ParseTreeNode *root) {
+    RegionCursor *c;
+    RegionList *a;
+    Region r;
+    Offset prev_end=-1;
+    SGREPDATA(evaluator);
+
+    c=open_merge_cursor(evaluator,root,1);
+    a=new_contiguous_region_list(sgrep);
+    for(merge_next(c,&r);r.start!=-1;merge_next(c,&r)) {
+#ifdef OPTIMIZE_SORTS
+	if (r.end<=prev_end) {
+	    /* We had nesting */
+	    a->nested=1;
+	}
+	prev_end=r.end;
+#endif
+	add_region(a,r.start,r.end);
+    }
+    delete_region_cursor(c);
+    return a;
+}
+
+/*
+ * Creates a cursor for the subtree starting from root
+ */
+static RegionCursor *open_operator_cursor(Evaluator *evaluator,
+					  ParseTreeNode *root) {
+    RegionCursor *c;
+    SGREPDATA(evaluator);
+
+    /* Shared subtrees and already evaluated ones are read from lists.
+     * With the subexpression cache everything is evaluated to lists, so
+     * that the lists can be cached */
+    if (root->result!=NULL || root->refcount!=1 || sgrep->subexpr_cache) {
+	return open_list_cursor(evaluator,root);
+    }
+    switch(root->oper) {
+    case OR:
+	if (root->number>2) {
+	    c=open_merge_cursor(evaluator,root,0);
+	    STATS_ADD(operators_evaluated,1);
+	    return c;
+	}
+	c=alloc_cursor(sgrep,OR_CURSOR);
+	open_inputs(evaluator,root,c,JOB_CURSOR);
+	STATS_ADD(or_oper,1);
+	cursor_get_region(c->right,&c->r_reg);
+	break;
+    case IN:
+    case NOT_IN:
+	c=alloc_cursor(sgrep,IN_CURSOR);
+	c->not=(root->oper==NOT_IN);
+	if (!open_inputs(evaluator,root,c,JOB_LIST_CURSOR)) {
+	    STATS_ADD(operators_evaluated,1);
+	    materialize_cursor(c,new_region_list(sgrep));
+	    return c;
+	}
+	if (c->left->type==LIST_CURSOR &&
+	    unbalanced(c->left->list,c->right->list)) {
+	    STATS_ADD(operators_evaluated,1);
+	    materialize_cursor(c,in(c->left->list,c->right->list,c->not));
+	    return c;
+	}
+	if (c->not) STATS_ADD(not_in,1); else STATS_ADD(in,1);
+	/* Like in(), do an outer() on right list */
+	c->list=c->right->list;
+#ifdef OPTIMIZE_SORTS
+	if (c->list->nested)
+#endif
+	{
+	    c->own=outer(c->list);
+	    c->list=c->own;
+	}
+	start_region_search(c->list,&c->iter);
+	get_region(&c->iter,&c->r_reg);
+	break;
+    case CONTAINING:
+    case NOT_CONTAINING:
+	c=alloc_cursor(sgrep,CONTAINING_CURSOR);
+	c->not=(root->oper==NOT_CONTAINING);
+	if (!open_inputs(evaluator,root,c,JOB_LIST_CURSOR)) {
+	    STATS_ADD(operators_evaluated,1);
+	    materialize_cursor(c,new_region_list(sgrep));
+	    return c;
+	}
+	if (c->left->type==LIST_CURSOR &&
+	    unbalanced(c->left->list,c->right->list)) {
+	    STATS_ADD(operators_evaluated,1);
+	    materialize_cursor(c,containing(evaluator,c->left->list,
+					    c->right->list,c->not));
+	    return c;
+	}
+	if (c->not) STATS_ADD(not_containing,1); else STATS_ADD(containing,1);
+	/* Like containing(), do an inner() on right list */
+	c->list=c->right->list;
+#ifdef OPTIMIZE_SORTS
+	if (c->list->nested)
+#endif
+	{
+	    c->own=inner(evaluator,c->list);
+	    c->list=c->own;
+	}
+	start_region_search(c->list,&c->iter);
+	get_region(&c->iter,&c->r_reg);
+	break;
+    case EQUAL:
+    case NOT_EQUAL:
+	c=alloc_cursor(sgrep,EQUAL_CURSOR);
+	c->not=(root->oper==NOT_EQUAL);
+	if (!open_inputs(evaluator,root,c,JOB_CURSOR)) {
+	    STATS_ADD(operators_evaluated,1);
+	    materialize_cursor(c,new_region_list(sgrep));
+	    return c;
+	}
+	if (c->left->type==LIST_CURSOR && c->right->type==LIST_CURSOR &&
+	    unbalanced(c->left->list,c->right->list)) {
+	    STATS_ADD(operators_evaluated,1);
+	    materialize_cursor(c,equal(c->left->list,c->right->list,c->not));
+	    return c;
+	}
+	if (c->not) STATS_ADD(not_equal,1); else STATS_ADD(equal,1);
+	cursor_get_region(c->right,&c->r_reg);
+	break;
+    case CONCAT:
+	c=alloc_cursor(sgrep,CONCAT_CURSOR);
+	c->left=open_cursor(evaluator,root->left);
+	STATS_ADD(concat,1);
+	break;
+    case FIRST:
+	c=alloc_cursor(sgrep,FIRST_CURSOR);
+	c->left=open_cursor(evaluator,root->left);
+	c->number=root->number;
+	break;
+    default:
+	/* Blocking operators */
+	return open_list_cursor(evaluator,root);
+    }
+    STATS_ADD(operators_evaluated,1);
+    cursor_get_region(c->left,&c->l_reg);
+    return c;
+}
+
+/*
+ * Like open_operator_cursor(), and adds the evaluation to the plan of
+ * root. Lists read by list cursors were added by recursive_eval().
+ */
+static RegionCursor *open_cursor(Evaluator *evaluator, ParseTreeNode *root) {
+    RegionCursor *c;
+
+    c=open_operator_cursor(evaluator,root);
+    if (c->type!=LIST_CURSOR) {
+	/* The regions are counted as they are given */
+	note_evaluation(root,NULL);
+	root->plan.shown|=PLAN_STREAMED;
+	c->planned=root;
+    } else if (c->own) {
+	/* Materialized by the cursor */
+	note_evaluation(root,c->own);
+    }
+    return c;
+}
+
+/*
+ * Evaluates first(n,expr) by pulling only the first n regions of expr
+ * through a cursor. The streamed operators of expr stop there.
+ */
+static RegionList *first_from_cursor(Evaluator *evaluator,
+				     ParseTreeNode *root) {
+    RegionCursor *c;
+    RegionList *result;
+    Region r;
+    Offset end=-1;
+    int num;
+    SGREPDATA(evaluator);
+
+    c=open_cursor(evaluator,root->left);
+    /* The subtree list is freed by recursive_eval() */
+    c->node=NULL;
+    result=new_region_list(sgrep);
+    for(num=root->number;num>0;num--) {
+	cursor_get_region(c,&r);
+	if (r.start==-1) break;
+	/* The regions may nest */
+	if (LIST_SIZE(result)>0 && r.end<=end) result->nested=1;
+	add_region(result,r.start,r.end);
+	end=r.end;
+    }
+    if (num==0 && c->type!=LIST_CURSOR) STATS_ADD(early_stops,1);
+    delete_region_cursor(c);
+    return result;
+}
+
+/*
+ * Creates a cursor giving the result of evaluating the parse tree
+ * starting from root. Blocking subtrees are evaluated right away, the
+ * rest when the regions are asked for with cursor_get_region().
+ */
+RegionCursor *eval_cursor(struct SgrepStruct *sgrep,
+			  const FileList *file_list,
+			  ParseTreeNode *root) {
+    RegionCursor *c;
+    Evaluator evaluator;
+
+    evaluator.sgrep=sgrep;
+    evaluator.files=file_list;
+    open_eval_arena(sgrep);
+    evaluator.tmp_stack_size=DEFAULT_STACK_SIZE;
+    evaluator.tmp_stack=arena_take_stack(sgrep,&evaluator.tmp_stack_size);
+    if (sgrep->index_file) lookup_index_leaves(&evaluator,root);
+    plan_tree(sgrep,root);
+    c=open_cursor(&evaluator,root);
+    arena_return_stack(sgrep,evaluator.tmp_stack,evaluator.tmp_stack_size);
+    return c;
+}
+
+/* Moves the left or right input of cursor to next region */
+#define NEXT_LEFT(C) cursor_get_region((C)->left,&(C)->l_reg)
+#define NEXT_RIGHT(C) cursor_get_region((C)->right,&(C)->r_reg)
+
+/*
+ * Next region of in or not in. Same as the loop in in()
+ */
+static void in_next(RegionCursor *c, Region *reg) {
+    Region l_reg,r_reg2;
+
+    while(c->r_reg.start!=-1 && c->l_reg.start!=-1) {
+	l_reg=c->l_reg;
+	if (l_reg.start<c->r_reg.start) {
+	    NEXT_LEFT(c);
+	    if (c->not) goto found;
+	} else if (l_reg.end<=c->r_reg.end) {
+	    /* Left region is in right region. The inclusion must be
+	     * proper */
+	    NEXT_LEFT(c);
+	    if ((l_reg.start>c->r_reg.start ||
+		 l_reg.end<c->r_reg.end) != c->not) goto found;
+	} else if (l_reg.start==c->r_reg.start) {
+	    NEXT_LEFT(c);
+	    if (c->not) goto found;
+	} else {
+	    /* Left and right region are overlapping */
+	    get_region(&c->iter,&r_reg2);
+	    if (r_reg2.start==-1) {
+		if (l_reg.start>c->r_reg.end) {
+		    c->r_reg=r_reg2;
+		} else {
+		    NEXT_LEFT(c);
+		    if (c->not) goto found;
+		}
+	    } else if (l_reg.start>=r_reg2.start) {
+		c->r_reg=r_reg2;
+	    } else {
+		prev_region(&c->iter,&r_reg2);
+		NEXT_LEFT(c);
+		if (c->not) goto found;
+	    }
+	}
+    }
+    /* Rest of the left list is not in any right region */
+    if (c->not && c->l_reg.start!=-1) {
+	l_reg=c->l_reg;
+	NEXT_LEFT(c);
+	goto found;
+    }
+    reg->start=reg->end=-1;
+    return;
+ found:
+    *reg=l_reg;
+}
+
+/*
+ * Next region of containing or not containing
+ */
+static void containing_next(RegionCursor *c, Region *reg) {
+    Region l_reg;
+
+    while(c->r_reg.start!=-1 && c->l_reg.start!=-1) {
+	l_reg=c->l_reg;
+	if (l_reg.start>c->r_reg.start) {
+	    /* right starts before left */
+	    get_region(&c->iter,&c->r_reg);
+	} else if (l_reg.end>=c->r_reg.end) {
+	    /* Left contains right. The containment must be proper */
+	    NEXT_LEFT(c);
+	    if ((l_reg.start<c->r_reg.start ||
+		 l_reg.end>c->r_reg.end) != c->not) goto found;
+	} else {
+	    /* left comes after right */
+	    NEXT_LEFT(c);
+	    if (c->not) goto found;
+	}
+    }
+    if (c->not && c->l_reg.start!=-1) {
+	l_reg=c->l_reg;
+	NEXT_LEFT(c);
+	goto found;
+    }
+    reg->start=reg->end=-1;
+    return;
+ found:
+    *reg=l_reg;
+}
+
+/*
+ * Next region of equal or not equal
+ */
+static void equal_next(RegionCursor *c, Region *reg) {
+    Region l_reg;
+
+    while(c->r_reg.start!=-1 && c->l_reg.start!=-1) {
+	l_reg=c->l_reg;
+	if (l_reg.start<c->r_reg.start ||
+	    (l_reg.start==c->r_reg.start && l_reg.end<c->r_reg.end)) {
+	    NEXT_LEFT(c);
+	    if (c->not) goto found;
+	} else if (c->r_reg.start<l_reg.start || c->r_reg.end<l_reg.end) {
+	    NEXT_RIGHT(c);
+	} else {
+	    NEXT_RIGHT(c);
+	    NEXT_LEFT(c);
+	    if (!c->not) goto found;
+	}
+    }
+    if (c->not && c->l_reg.start!=-1) {
+	l_reg=c->l_reg;
+	NEXT_LEFT(c);
+	goto found;
+    }
+    reg->start=reg->end=-1;
+    return;
+ found:
+    *reg=l_reg;
+}
+
+/*
+ * Next region of or. Same regions in both inputs are given once
+ */
+static void or_next(RegionCursor *c, Region *reg) {
+    if (c->r_reg.start==-1 ||
+	(c->l_reg.start!=-1 &&
+	 (c->l_reg.start<c->r_reg.start ||
+	  (c->l_reg.start==c->r_reg.start && c->l_reg.end<c->r_reg.end)))) {
+	*reg=c->l_reg;
+	if (reg->start!=-1) NEXT_LEFT(c);
+    } else {
+	*reg=c->r_reg;
+	if (c->l_reg.start==c->r_reg.start && c->l_reg.end==c->r_reg.end) {
+	    NEXT_LEFT(c);
+	}
+	NEXT_RIGHT(c);
+    }
+}
+
+/*
+ * Next region of concat. Overlapping and adjacent regions are
+ * concatenated
+ */
+static void concat_next(RegionCursor *c, Region *reg) {
+    Region next;
+
+    *reg=c->l_reg;
+    if (reg->start==-1) return;
+    cursor_get_region(c->left,&next);
+    while(next.start!=-1 && next.start<=reg->end+1) {
+	if (next.end>reg->end) reg->end=next.end;
+	cursor_get_region(c->left,&next);
+    }
+    c->l_reg=next;
+}
+
+/*
+ * Gives the next region from cursor to reg, or (-1,-1) when there
+ * are no more regions
+ */
+void cursor_get_region(RegionCursor *c, Region *reg) {
+    switch(c->type) {
+    case LIST_CURSOR:
+	get_region(&c->iter,reg);
+	break;
+    case OR_CURSOR:
+	or_next(c,reg);
+	break;
+    case MERGE_CURSOR:
+	merge_next(c,reg);
+	break;
+    case IN_CURSOR:
+	in_next(c,reg);
+	break;
+    case CONTAINING_CURSOR:
+	containing_next(c,reg);
+	break;
+    case EQUAL_CURSOR:
+	equal_next(c,reg);
+	break;
+    case CONCAT_CURSOR:
+	concat_next(c,reg);
+	break;
+    case FIRST_CURSOR:
+	if (c->number<=0) {
+	    reg->start=reg->end=-1;
+	    break;
+	}
+	*reg=c->l_reg;
+	if (reg->start!=-1) {
+	    c->number--;
+	    if (c->number>0) NEXT_LEFT(c);
+	}
+	break;
+    }
+    if (reg->start!=-1) c->regions++;
+}
+
+/*
+ * Reads the rest of the cursor, or until it has given limit regions
+ * when limit is positive. Returns the number of regions it gave in
+ * total.
+ */
+int cursor_count_regions(RegionCursor *c, int limit) {
+    Region reg;
+    SGREPDATA(c);
+
+    while(limit<=0 || c->regions<limit) {
+	cursor_get_region(c,&reg);
+	if (reg.start==-1) return c->regions;
+    }
+    STATS_ADD(early_stops,1);
+    return c->regions;
+}
+
+/*
+ * Deletes a cursor with its inputs. The lists of the tree nodes read
+ * are freed, when they are not needed any more.
+ */
+void delete_region_cursor(RegionCursor *c) {
+    SGREPDATA(c);
+
+    if (c->left) delete_region_cursor(c->left);
+    if (c->right) delete_region_cursor(c->right);
+    if (c->inputs) {
+	int i;
+	for(i=0;i<c->number;i++) delete_region_cursor(c->inputs[i]);
+	sgrep_free(c->inputs);
+	sgrep_free(c->heap);
+	sgrep_free(c->taken);
+    }
+    if (c->own) delete_region_list(c->own);
+    if (c->node) free_tree_node(c->node);
+    if (c->planned) c->planned->plan.regions+=c->regions;
+    sgrep_free(c);
+}
@@ -38,12 +38,23 @@
  */
 #define DOT_REGIONS (1<<17) /* 65536*2 */
 
-#define INDEX_VERSION_MAGIC ("sgrep-index v0")
-
-/* If we would need larger index than MAX_INDEX_SIZE we would have
- * to deal with 64 bit wide integers.
+/*
+ * Version 0 indexes store the header, the term array and the file list
+ * as 32 bit integers. Version 1 is written when compiled with
+ * LARGE_OFFSETS and uses 64 bit integers for those. Postings are
+ * variable length in both.
  */
-#define MAX_INDEX_SIZE (INT_MAX)
+#define INDEX_V0_MAGIC ("sgrep-index v0")
+#define INDEX_V1_MAGIC ("sgrep-index v1")
+#if LARGE_OFFSETS
+# define INDEX_VERSION_MAGIC INDEX_V1_MAGIC
+# define INDEX_INT_SIZE 8
+#else
+# define INDEX_VERSION_MAGIC INDEX_V0_MAGIC
+# define INDEX_INT_SIZE 4
+#endif
+
+#define MAX_INDEX_SIZE (OFFSET_MAX)
 #define EXTERNAL_INDEX_BLOCK_SIZE 32
 #define max_term_len 256
 
@@ -93,10 +104,10 @@ struct IndexBufferStruct {
 	} map;
     } list;
     /* Last index added to this buffer. This will be zero when the buffer
-     * is created, INT_MAX when the buffer has been scanner and -1
+     * is created, OFFSET_MAX when the buffer has been scanner and -1
      * if this buffer corresponds to stop word (and therefore is not used )
      */
-    int last_index;
+    Offset last_index;
     int saved_bytes; /* How many bytes of this entry have been saved to a
 		      * memory load file */
     /* block_used will >= 0 for internal buffer, <0 for external buffers
@@ -114,6 +125,7 @@ struct IndexReaderStruct {
     void *map;
     size_t size;
     int len;    
+    int int_size; /* Width of header, term array and file list integers */
     const unsigned char *array;
     const void *entries;    
 };
@@ -158,13 +170,13 @@ typedef struct IndexWriterStruct {
     /* Statistics */
     int terms;
     int postings;
-    int total_postings_bytes;
+    Offset total_postings_bytes;
     int total_string_bytes;
     int strings_lcps_compressed;
     int entry_lengths[8];
-    int flist_start;
-    int flist_size;
-    int total_index_file_size;
+    Offset flist_start;
+    Offset flist_size;
+    Offset total_index_file_size;
 
     int failed;
 } IndexWriter;
@@ -245,6 +257,29 @@ static int get_int(const unsigned char *ptr, int ind) {
     return (ptr[0]<<24) | (ptr[1]<<16) | (ptr[2]<<8) | ptr[3];
 }
 
+/*
+ * Header, term array and file list integers are INDEX_INT_SIZE wide
+ * when writing. When reading, the width depends on index version.
+ */
+static int put_offset(Offset i,FILE* stream) {
+#if LARGE_OFFSETS
+    put_int((int)(i>>32),stream);
+#endif
+    put_int((int)i,stream);
+    return INDEX_INT_SIZE;
+}
+
+static Offset get_offset(const unsigned char *ptr, int ind, int size) {
+#if LARGE_OFFSETS
+    if (size==8) {
+	return ((Offset)get_int(ptr,ind*2)<<32) | 
+	    (unsigned int)get_int(ptr,ind*2+1);
+    }
+#endif
+    assert(size==4);
+    return get_int(ptr,ind);
+}
+
 /*
  * Writes postings of from given IndexBuffer to given stream.
  * Does NOT check write errors: they have to be checked later.
@@ -298,7 +333,7 @@ void display_index_statistics(IndexWriter *writer) {
     size=writer->spool_size*sizeof(struct IndexBlock);
     fprintf(f,"Indexer memory usage:\n");
     fprintf(f,"%dK bytes postings, %dK postings spool size, %dK used\n",
-	    writer->total_postings_bytes/1024,
+	    (int)(writer->total_postings_bytes/1024),
 	    size/1024,
 	    writer->spool_used/1024);
     fprintf(f,"%d individual terms of %d term postings (%d%%)\n",
@@ -310,7 +345,8 @@ void display_index_statistics(IndexWriter *writer) {
 	    fprintf(f,"%8d:%8d, %8dK (%d%%)\n",i+1,
 		   writer->entry_lengths[i],
 		   (i+1)*writer->entry_lengths[i]/1024,
-		   (i+1)*writer->entry_lengths[i]*100/writer->total_postings_bytes);
+		   (int)((i+1)*writer->entry_lengths[i]*100/
+			 writer->total_postings_bytes));
 	}
     }
     fprintf(f,"Hash array size %dK\n",
@@ -455,7 +491,7 @@ void add_byte(IndexWriter *writer,IndexBuffer *buf, unsigned char byte) {
  */
 #define NEGATIVE_NUMBER_TAG ((unsigned char)255)
 #define END_OF_POSTINGS_TAG ((unsigned char)127)
-void add_integer(IndexWriter *writer, IndexBuffer *buf, int num) {
+void add_integer(IndexWriter *writer, IndexBuffer *buf, Offset num) {
     if (num<0) {
 	/* Negative number: Add the NEGATIVE_NUMBER tag */
 	add_byte(writer,buf,NEGATIVE_NUMBER_TAG);
@@ -492,13 +528,23 @@ void add_integer(IndexWriter *writer, IndexBuffer *buf, int num) {
 	add_byte(writer,buf,(num>>16)&255);
 	add_byte(writer,buf,(num>>8)&255);
 	add_byte(writer,buf,num&255);
+#if LARGE_OFFSETS
+    } else {
+	/* First byte 11110001, then 64 bits */
+	int i;
+	add_byte(writer,buf,0xf1);
+	for(i=56;i>=0;i-=8) {
+	    add_byte(writer,buf,(num>>i)&255);
+	}
+#else
     } else {
 	/* More than 32 bits. Shouldn't happen with ints. */
 	sgrep_error(writer->sgrep,"Index value %u is too big!\n",num);
+#endif
     }
 }
     
-void add_entry(IndexWriter *writer,IndexBuffer *buf, int index) {
+void add_entry(IndexWriter *writer,IndexBuffer *buf, Offset index) {
     assert(index>=0);
     index-=buf->last_index;
     buf->last_index+=index;
@@ -538,9 +584,9 @@ unsigned char get_byte(IndexBuffer *buf) {
 #endif /* 0 */
 }
 
-int get_integer(IndexBuffer *buf) {
+Offset get_integer(IndexBuffer *buf) {
     unsigned char i;
-    int r;
+    Offset r;
     int negative=0;
 
     i=get_byte(buf);
@@ -550,7 +596,7 @@ int get_integer(IndexBuffer *buf) {
     }
     if (i==END_OF_POSTINGS_TAG) {
 	/* Found end of index */
-	return INT_MAX;
+	return OFFSET_MAX;
     }
     else if (i<127) r=i; /* 8 bits starting with 0 */
     else if ((i&(128+64))==128) {
@@ -573,6 +619,13 @@ int get_integer(IndexBuffer *buf) {
 	r|=get_byte(buf)<<16;
 	r|=get_byte(buf)<<8;
 	r|=get_byte(buf);
+#if LARGE_OFFSETS
+    } else if(i==0xf1) {
+	/* 72 bits starting with 0xf1 */
+	int j;
+	r=0;
+	for(j=0;j<8;j++) r=(r<<8)|get_byte(buf);
+#endif
     } else {
 	assert(0 && "Corrupted index file");
 	abort();
@@ -580,9 +633,9 @@ int get_integer(IndexBuffer *buf) {
     return (negative)?-r:r;
 }
 
-unsigned int get_entry(IndexBuffer *buf) {
-    int r=get_integer(buf);
-    if (r==INT_MAX) return r;
+Offset get_entry(IndexBuffer *buf) {
+    Offset r=get_integer(buf);
+    if (r==OFFSET_MAX) return r;
     buf->last_index+=r;
     assert(buf->last_index>=0);
     /* fprintf(stderr,"%d\n",buf->last_index); */
@@ -679,9 +732,9 @@ int read_stop_word_file(IndexWriter *writer, const char *filename) {
 }
 
 int add_region_to_index(IndexWriter *writer,
-		      const char *str, int start, int end) {
+		      const char *str, Offset start, Offset end) {
     IndexBuffer *ib;
-    int len;
+    Offset len;
     SGREPDATA(writer);
 
     
@@ -737,14 +790,14 @@ int add_region_to_index(IndexWriter *writer,
 }
 
 int get_region_index(IndexBuffer *buf, Region *region) {
-    int saved_index;
-    int s,e;
+    Offset saved_index;
+    Offset s,e;
 
     saved_index=buf->last_index;
-    assert(saved_index!=INT_MAX);
+    assert(saved_index!=OFFSET_MAX);
     s=get_entry(buf);
-    if (s==INT_MAX) {
-	buf->last_index=INT_MAX;
+    if (s==OFFSET_MAX) {
+	buf->last_index=OFFSET_MAX;
 	return 0;
     }
 
@@ -762,7 +815,7 @@ int get_region_index(IndexBuffer *buf, Region *region) {
 	    }
 	    /* Switch to normal state. Need to read also end index */
 	    e=get_entry(buf);
-	    assert(e!=INT_MAX);
+	    assert(e!=OFFSET_MAX);
 	    buf->last_len=0-(e-s+1);
 	    region->start=s;
 	    region->end=e;
@@ -775,7 +828,7 @@ int get_region_index(IndexBuffer *buf, Region *region) {
     }
     /* Normal state. Read also end point */
     e=get_entry(buf);
-    assert(e!=INT_MAX);
+    assert(e!=OFFSET_MAX);
     if (e-s+1==-buf->last_len) {
 	/* Same length twice. Switch to CH state */
 	buf->last_len=e-s+1;
@@ -1013,14 +1066,14 @@ void count_statistics(IndexWriter *writer) {
     if (writer->file_list) {
 	const char *name;
 
-	writer->flist_size=4; /* Number of files */
+	writer->flist_size=INDEX_INT_SIZE; /* Number of files */
 	for(i=0;i<flist_files(writer->file_list);i++) {
 	    name=flist_name(writer->file_list,i);
-	    writer->flist_size+=4;
+	    writer->flist_size+=INDEX_INT_SIZE;
 	    if (name!=NULL) {
 		writer->flist_size+=strlen(name)+1;
 	    }
-	    writer->flist_size+=4;
+	    writer->flist_size+=INDEX_INT_SIZE;
 	}
     } else {
 	writer->flist_size=0;
@@ -1030,7 +1083,7 @@ void count_statistics(IndexWriter *writer) {
      * Count the size of index file to be written
      */
     writer->total_index_file_size=1024+
-	writer->terms*4+
+	(Offset)writer->terms*INDEX_INT_SIZE+
 	writer->total_string_bytes-writer->strings_lcps_compressed+
 	writer->terms+
 	(writer->total_postings_bytes+writer->terms);
@@ -1039,7 +1092,7 @@ void count_statistics(IndexWriter *writer) {
 }
 
 int write_index_term_array(IndexWriter *writer, FILE *stream) {
-    int i=0;
+    Offset i=0;
     int possible_stop_word_size=0;
     IndexBuffer *tmp=NULL;
     FILE *stop_stream=NULL;
@@ -1048,7 +1101,7 @@ int write_index_term_array(IndexWriter *writer, FILE *stream) {
     for(tmp=writer->sorted_buffers;tmp;tmp=tmp->next) {
         int wbytes;
 	/* Index to start of postings for this term */
-	put_int(i,stream);
+	put_offset(i,stream);
 
 	if (tmp->last_index==-1) {
 	    /* This term was a stop word. From now on it is used just like
@@ -1063,7 +1116,7 @@ int write_index_term_array(IndexWriter *writer, FILE *stream) {
 	    tmp->saved_bytes+
 	    ((tmp->block_used>=0) ? tmp->block_used : tmp->list.external.bytes);
 	i+=wbytes;
-	wbytes+=4;
+	wbytes+=INDEX_INT_SIZE;
 
 	/* Check for stop word limit */
 	if (writer->options->stop_word_limit && 
@@ -1123,37 +1176,41 @@ void write_index_header(IndexWriter *writer) {
 	      INDEX_VERSION_MAGIC,
 	      writer->terms,writer->postings);
     l+=fprintf(stream,"1024 bytes header (%d%%)\n",
-	       1024*100/writer->total_index_file_size);
+	       (int)(1024*100/writer->total_index_file_size));
     l+=fprintf(stream,"%d bytes term index (%d%%)\n",
-	       writer->terms*4,
-	       writer->terms*4*100/writer->total_index_file_size);
+	       writer->terms*INDEX_INT_SIZE,
+	       (int)((Offset)writer->terms*INDEX_INT_SIZE*100/
+		     writer->total_index_file_size));
     l+=fprintf(stream,"%d bytes strings (%d%%)\n  %d total strings\n  %d compressed with lcps (-%d%%)\n",
 	       writer->total_string_bytes-
 	              writer->strings_lcps_compressed+writer->terms,
-	       (writer->total_string_bytes-writer->strings_lcps_compressed+
-		writer->terms)*100/writer->total_index_file_size,
+	       (int)((Offset)(writer->total_string_bytes-
+			      writer->strings_lcps_compressed+
+			      writer->terms)*100/
+		     writer->total_index_file_size),
 	       writer->total_string_bytes,
 	       writer->strings_lcps_compressed-writer->terms,
 	       (writer->strings_lcps_compressed-writer->terms)*100/
 	             writer->total_string_bytes);
-    l+=fprintf(stream,"%d bytes postings (%d%%)\n",
+    l+=fprintf(stream,OFFSET_FORMAT" bytes postings (%d%%)\n",
 	       writer->total_postings_bytes+writer->terms,
-	       (writer->total_postings_bytes+writer->terms)*100/
-	             writer->total_index_file_size);
-    l+=fprintf(stream,"%d bytes file list (%d%%)\n",
+	       (int)((writer->total_postings_bytes+writer->terms)*100/
+		     writer->total_index_file_size));
+    l+=fprintf(stream,OFFSET_FORMAT" bytes file list (%d%%)\n",
 	       writer->flist_size,
-	       writer->flist_size*100/writer->total_index_file_size);    
-    l+=fprintf(stream,"%d total index size\n--\n",
+	       (int)(writer->flist_size*100/writer->total_index_file_size));
+    l+=fprintf(stream,OFFSET_FORMAT" total index size\n--\n",
 	       writer->total_index_file_size);
     while(l<512) {
 	putc(0,stream);
 	l++;
     }
 
-    l+=put_int(writer->terms,stream); /* Number of terms */
-    l+=put_int(1024,stream);          /* Starting index of term array */
-    l+=put_int(1024+writer->terms*4,stream); /* Starting index of strings and postings */
-    l+=put_int(writer->flist_start,stream); /* Starting index of file list */
+    l+=put_offset(writer->terms,stream); /* Number of terms */
+    l+=put_offset(1024,stream);          /* Starting index of term array */
+    /* Starting index of strings and postings */
+    l+=put_offset(1024+(Offset)writer->terms*INDEX_INT_SIZE,stream);
+    l+=put_offset(writer->flist_start,stream); /* Starting index of file list */
 
     while(l<1024) {
 	putc(0,stream);
@@ -1162,9 +1219,9 @@ void write_index_header(IndexWriter *writer) {
 }
 
 int write_index_terms(IndexWriter *writer) {
-    int total_internal_bytes=0;
-    int total_external_bytes=0;
-    int total_saved_bytes=0;
+    Offset total_internal_bytes=0;
+    Offset total_external_bytes=0;
+    Offset total_saved_bytes=0;
     int written_terms=0;
     IndexBuffer *tmp;
     FILE *stream;
@@ -1294,19 +1351,19 @@ int write_index_file_list(IndexWriter *writer) {
     if (writer->file_list) {
 	const char *name;
 	/* Number of files */
-	put_int(flist_files(writer->file_list),stream);
+	put_offset(flist_files(writer->file_list),stream);
 	/* Entry for each file */
 	for(i=0;i<flist_files(writer->file_list);i++) {
 	    name=flist_name(writer->file_list,i);
 	    if (name==NULL) {
-		put_int(0,stream);
+		put_offset(0,stream);
 	    } else {
-		put_int(strlen(name),stream);
+		put_offset(strlen(name),stream);
 		fputs(name,stream);
 		/* remember the trailing zero */
 		putc(0,stream);
 	    }
-	    put_int(flist_length(writer->file_list,i),stream);
+	    put_offset(flist_length(writer->file_list,i),stream);
 	}	
     }
     return SGREP_OK;
@@ -1321,7 +1378,7 @@ int write_index(IndexWriter *writer) {
     count_common_prefixes(writer);
 
     count_statistics(writer);
-    sgrep_progress(sgrep,"Writing index file of %dK\n",
+    sgrep_progress(sgrep,"Writing index file of "OFFSET_FORMAT"K\n",
 		   writer->total_index_file_size/1024);
 
     write_index_header(writer);
@@ -1430,7 +1487,7 @@ int create_index(const IndexOptions *options) {
 
     if (writer->options->index_stats) {
 	display_index_statistics(writer);
-	sgrep_error(sgrep,"Indexed %d files having %dK total size\n",
+	sgrep_error(sgrep,"Indexed %d files having "OFFSET_FORMAT"K total size\n",
 		    flist_files(writer->file_list), 
 		    flist_total(writer->file_list)/1024);
     }
@@ -1473,7 +1530,8 @@ int do_recursive_lookup(struct LookupStruct *ls, int s,int e,
     int rc,lc;
 
     /* Rebuild current entry */
-    str=(const char *)ls->map->entries+get_int(ls->map->array,s+middle);
+    str=(const char *)ls->map->entries+
+	get_offset(ls->map->array,s+middle,ls->map->int_size);
     if (str[0]>0) {
 	assert(pstr!=NULL);
 	strncpy(npstr,pstr,str[0]);
@@ -1553,7 +1611,7 @@ void dump_entry(const char *entry, const unsigned char *regions,
     map_buffer=new_map_buffer(sgrep,entry,regions);
     fprintf(f,"%s:[",entry);
     while(get_region_index(map_buffer,&region)) {
-	fprintf(f,"(%d,%d)",region.start,region.end);
+	fprintf(f,"("OFFSET_FORMAT","OFFSET_FORMAT")",region.start,region.end);
     }
     fprintf(f,"]\n");
     delete_map_buffer(sgrep,map_buffer);
@@ -1592,7 +1650,7 @@ Region *merge_regions(SgrepData *sgrep,
 		      const int length2, const Region *array2,
 		      int *return_length) {
     Region region1,region2;
-    Region eor={INT_MAX,INT_MAX};
+    Region eor={OFFSET_MAX,OFFSET_MAX};
     int ind1=0;
     int ind2=0;
     int m=0;
@@ -1664,14 +1722,14 @@ void read_and_sort_postings(const char *entry, const unsigned char *regions,
 	    if (first.start<tmp.start || first.end<tmp.end) {
 		/* First is before. Add it */
 		ARRAY_PUSH(array,first,size,length);
-		first.start=INT_MAX;
-		read->one.start=INT_MAX;
+		first.start=OFFSET_MAX;
+		read->one.start=OFFSET_MAX;
 	    } else {
 		assert(first.start==tmp.start);
 		if (first.end==tmp.end) {
 		    /* Same region, skip first */
-		    first.start=INT_MAX;
-		    read->one.start=INT_MAX;
+		    first.start=OFFSET_MAX;
+		    read->one.start=OFFSET_MAX;
 		}
 	    }
 	}
@@ -1685,9 +1743,9 @@ void read_and_sort_postings(const char *entry, const unsigned char *regions,
 	return;
     }
     /* first may sometimes be also last :) */
-    if (first.start!=INT_MAX) {
+    if (first.start!=OFFSET_MAX) {
 	ARRAY_PUSH(array,first,size,length);
-	read->one.start=INT_MAX;
+	read->one.start=OFFSET_MAX;
     }
     /* If size==1, we just save the new list */
     if (length==1) {
@@ -1802,15 +1860,28 @@ IndexReader *new_index_reader(SgrepData *sgrep,const char *filename) {
     }
     
     ptr=(const unsigned char *)imap->map;
-    if (strncmp((const char *)ptr,INDEX_VERSION_MAGIC,
-		strlen(INDEX_VERSION_MAGIC))!=0) {
+    if (strncmp((const char *)ptr,INDEX_V0_MAGIC,
+		strlen(INDEX_V0_MAGIC))==0) {
+	imap->int_size=4;
+    } else if (strncmp((const char *)ptr,INDEX_V1_MAGIC,
+		       strlen(INDEX_V1_MAGIC))==0) {
+#if LARGE_OFFSETS
+	imap->int_size=8;
+#else
+	sgrep_error(sgrep,"Index '%s' uses 64 bit offsets. Recompile sgrep with --enable-large-offsets to use it.\n",
+		    filename);
+	goto error;
+#endif
+    } else {
 	sgrep_error(sgrep,"File '%s' is not an sgrep index.\n",filename);
 	goto error;
     }
     ptr+=512;
-    imap->len=get_int(ptr,0);
-    imap->array=((const unsigned char*)imap->map)+get_int(ptr,1);
-    imap->entries=((const char *)imap->map)+get_int(ptr,2);
+    imap->len=(int)get_offset(ptr,0,imap->int_size);
+    imap->array=((const unsigned char*)imap->map)+
+	get_offset(ptr,1,imap->int_size);
+    imap->entries=((const char *)imap->map)+
+	get_offset(ptr,2,imap->int_size);
 	    
 
     sgrep_progress(sgrep,"Using index '%s' of %dK size containing %d terms\n",
@@ -1824,10 +1895,11 @@ IndexReader *new_index_reader(SgrepData *sgrep,const char *filename) {
 }
 
 FileList *index_file_list(IndexReader *imap) {
-    int file_list_start;
+    Offset file_list_start;
+    int w=imap->int_size;
     SGREPDATA(imap);
 
-    file_list_start=get_int(((const unsigned char *)imap->map)+512,3);
+    file_list_start=get_offset(((const unsigned char *)imap->map)+512,3,w);
     /* Check and read file list */
     if (file_list_start) {
 	/* Index contains a file list */
@@ -1835,22 +1907,22 @@ FileList *index_file_list(IndexReader *imap) {
 	int files;
 	int i;
 	int l;
-	int size;
+	Offset size;
 	const char *name;
 	FileList *file_list;
 
 	file_list=new_flist(sgrep);
 	flist_ptr=((const unsigned char *)imap->map)+file_list_start;
 
-	files=get_int(flist_ptr,0);
+	files=(int)get_offset(flist_ptr,0,w);
  	/* fprintf(stderr,"%d files\n",files); */
 	for(i=0;i<files;i++) {
-	    flist_ptr+=4;
-	    l=get_int(flist_ptr,0);
-	    flist_ptr+=4;
+	    flist_ptr+=w;
+	    l=(int)get_offset(flist_ptr,0,w);
+	    flist_ptr+=w;
 	    name=(const char *)flist_ptr;
 	    flist_ptr+=l+1;
-	    size=get_int(flist_ptr,0);
+	    size=get_offset(flist_ptr,0,w);
 	    /* fprintf(stderr,"%d %s %d\n",l,name,size); */
 	    flist_add_known(file_list,name,size);
 	}
@@ -1892,7 +1964,7 @@ RegionList *index_lookup_sorting(IndexReader *map, const char *term,
     reader->regions_merged=0;
     reader->lists_merged=0;
     reader->one.start=
-	reader->one.end=INT_MAX;
+	reader->one.end=OFFSET_MAX;
     memset(&reader->sizes,0,sizeof(reader->sizes));
     memset(&reader->regions,0,sizeof(reader->regions));
     reader->saved_size=LIST_NODE_SIZE;
@@ -1906,7 +1978,7 @@ RegionList *index_lookup_sorting(IndexReader *map, const char *term,
     sgrep_free(reader->saved_array);
 
     /* Check for the one region "array" */
-    if (reader->one.start!=INT_MAX) {
+    if (reader->one.start!=OFFSET_MAX) {
 	current=sgrep_new(Region);
 	current[0]=reader->one;
 	len=1;
@@ -1944,7 +2016,11 @@ RegionList *index_lookup_sorting(IndexReader *map, const char *term,
     }
 
     /* FIXME: This loop could be avoided. */
-    result=new_region_list(sgrep);
+    if (sgrep->compress_lists) {
+	result=new_compressed_region_list(sgrep);
+    } else {
+	result=new_region_list(sgrep);
+    }
     result->nested=1;
     reader->lists_merged++;
     reader->regions_merged+=len;
@@ -2006,7 +2082,12 @@ RegionList *index_lookup(IndexReader *map,const char *term) {
 	ls.begin=NULL;
 	ls.end=NULL;
     } else {
-	l=new_region_list(sgrep);
+	/* Postings of one term are already sorted */
+	if (sgrep->compress_lists) {
+	    l=new_compressed_region_list(sgrep);
+	} else {
+	    l=new_region_list(sgrep);
+	}
 	if (term[0]=='@') {
 	    l->nested=1;
 	} else {
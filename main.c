@@ -47,6 +47,8 @@ int environ_options();
 int run_stream(FileList *files, ParseTreeNode *, struct PHRASE_NODE *p_list);
 int run_one_by_one(FileList *files, ParseTreeNode *, 
 		   struct PHRASE_NODE *p_list);
+int run_parallel_files(FileList *files, ParseTreeNode *,
+		       struct PHRASE_NODE *p_list);
 void create_constant_lists();
 void delete_constant_lists();
 
@@ -62,6 +64,8 @@ int have_times=0;       /* Should we show info about used time in the end (-t) *
 int display_count=0;    /* Should we display only count of matching regions (-c) */
 int no_output=0;        /* Should we supress normal output (-q) */
 int show_expr=0;	/* only show expression, don't execute it (-P) */
+int show_plan=0;	/* Should we show the evaluation plan in the end (-E) */
+char *cache_dir=NULL;	/* Subexpression cache directory (-k) */
 
 /* Which preprocessor to use (-p) */
 char *preprocessor=DEFAULT_PREPROCESSOR; 
@@ -113,9 +117,12 @@ const struct OptionData option_data[]= {
 	{ 'c',NULL,"display only count of matching regions" },
 	{ 'D',NULL,"obsolete synonym for -v"},
 	{ 'd',NULL,"don't do concat on result list"},
+	{ 'E',NULL,"show the evaluation plan in the end" },
 	{ 'h',NULL,"help (means this text)" },
 	{ 'i',NULL,"ignore case distinctions in phrases" },
 	{ 'I',NULL,"switches to indexing mode, when given as first option" },
+	{ 'j',"<jobs>","evaluate <jobs> files at the same time" },
+	{ 'k',"<dir>","cache evaluated subexpressions of index queries in <dir>" },
 	{ 'l',NULL,"long output format" },
 	{ 'N',NULL,"don't add trailing newline" },
 	{ 'n',NULL,"don't read $HOME/"USER_SGREPRC" or "SYSTEM_SGREPRC},
@@ -131,6 +138,7 @@ const struct OptionData option_data[]= {
 #endif
 	{ 'V',NULL,"display version information" },
 	{ 'v',NULL,"verbose mode. Shows what is going on"},
+	{ 'z',NULL,"keep region lists compressed to save memory"},
 	{ 'e',"<expression>","execute expression (after preprocessing)" },
 	{ 'f',"<file>","read expression from file" },
 	{ 'F',"<file>","read list of input files from <file> instead of command line" },
@@ -166,6 +174,10 @@ int main(int argc, char *argv[])
     sgrep->print_all=0;
     sgrep->chars_list=NULL;
     sgrep->stream_mode=0;
+    sgrep->threads=online_cpus();
+    if (sgrep->threads>MAX_THREADS) sgrep->threads=MAX_THREADS;
+    sgrep->file_jobs=1;
+    sgrep->merge_kernel=select_merge_kernel();
     
     sgrep->progress_stream=stderr;
     sgrep->scanner_type=SGML_SCANNER;
@@ -304,6 +316,19 @@ int main(int argc, char *argv[])
     
 	
 	
+    /*
+     * Evaluated subexpressions are cached only for index queries,
+     * where the input is known not to have changed
+     */
+    if (cache_dir) {
+	if (sgrep->index_file) {
+	    sgrep->subexpr_cache=open_subexpr_cache(sgrep,cache_dir,
+						    sgrep->index_file);
+	} else {
+	    sgrep_error(sgrep,"Warning: -k is ignored without an index (-x).\n");
+	}
+    }
+
     /*
      * Evaluation style depends on sgrep->stream_mode 
      */
@@ -311,7 +336,13 @@ int main(int argc, char *argv[])
 	run_stream(input_files,root,p_list);
     else
 	run_one_by_one(input_files,root,p_list);
+
+    if (sgrep->subexpr_cache) {
+	close_subexpr_cache(sgrep->subexpr_cache);
+	sgrep->subexpr_cache=NULL;
+    }
     
+    if (show_plan) print_plan(sgrep,stderr,root);
     free_parse_tree(sgrep,root);
     delete_constant_lists();
 
@@ -338,6 +369,7 @@ int main(int argc, char *argv[])
 		stats.region_lists_now);
     }
     if (option_space) sgrep_free(option_space);
+    delete_eval_arena(sgrep);
 
     check_memory_leaks(sgrep);
     if (stats.output==0) {
@@ -374,16 +406,190 @@ void CALC_TIME(struct tms *TIME) {
 }
 #endif
 
+#if HAVE_OPEN_MEMSTREAM
+/*
+ * Evaluation of several files at the same time (-j). Every worker
+ * thread has its own copy of the parse tree and phrase lists, and takes
+ * the next file nobody has taken yet. The output of a file is kept in
+ * memory until the outputs of the files before it have been written,
+ * so the output is the same as without -j.
+ */
+struct FileOutput {
+    char *buf;			/* From open_memstream() */
+    size_t size;
+    int done;			/* Has the file been evaluated */
+};
+
+struct ParallelRun {
+    FileList *files;
+    int next;			/* Next file to take */
+    int written;		/* Files whose output has been written */
+    int writing;		/* Is some worker writing outputs */
+    int stop;			/* -q has found a region */
+    int print_newline;		/* Newline after the last file */
+    struct FileOutput *outputs;
+};
+
+struct FileWorker {
+    struct ParallelRun *run;
+    ParseTreeNode *root;
+    struct PHRASE_NODE *p_list;
+};
+
+/*
+ * Writes the outputs which are ready, in file order. Called and
+ * returns with sgrep_lock() held, but does the writing unlocked.
+ */
+static void write_ready_outputs(struct ParallelRun *run) {
+    struct FileOutput *o;
+
+    if (run->writing) return; /* The other writer sees our output */
+    run->writing=1;
+    while(run->written<flist_files(run->files) &&
+	  run->outputs[run->written].done) {
+	o=&run->outputs[run->written];
+	sgrep_unlock(sgrep);
+	if (o->buf) {
+	    fwrite(o->buf,1,o->size,stdout);
+	    free_memstream_buffer(o->buf);
+	    o->buf=NULL;
+	}
+	sgrep_lock(sgrep);
+	run->written++;
+    }
+    run->writing=0;
+}
+
+static void *file_worker(void *arg) {
+    struct FileWorker *w=(struct FileWorker *)arg;
+    struct ParallelRun *run=w->run;
+    struct FileOutput *o;
+    RegionCursor *result;
+    FILE *stream;
+    int i,regions;
+    int last=flist_files(run->files)-1;
+
+    for(;;) {
+	sgrep_lock(sgrep);
+	i=run->stop ? last+1 : run->next++;
+	sgrep_unlock(sgrep);
+	if (i>last) break;
+	o=&run->outputs[i];
+
+	w->root->result=NULL;
+	search(sgrep,w->p_list,run->files,i,i);
+	result=eval_cursor(sgrep,run->files,w->root);
+	if ( !display_count && !no_output ) {
+	    stream=open_memstream(&o->buf,&o->size);
+	    if (stream) {
+		write_region_cursor(sgrep,stream,result,run->files,
+				    i==last && run->print_newline);
+		fclose(stream);
+	    } else {
+		sgrep_error(sgrep,"open_memstream: %s\n",strerror(errno));
+	    }
+	}
+	regions=cursor_count_regions(result,no_output ? 1 : 0);
+	delete_region_cursor(result);
+
+	sgrep_lock(sgrep);
+	stats.output+=regions;
+	if (no_output && regions>0) run->stop=1;
+	o->done=1;
+	write_ready_outputs(run);
+	sgrep_unlock(sgrep);
+    }
+    return NULL;
+}
+
+/*
+ * Runs sgrep file by file with sgrep->file_jobs workers. Returns
+ * SGREP_ERROR without doing anything, if the parse tree can't be
+ * copied for the workers.
+ */
+int run_parallel_files(FileList *files, ParseTreeNode *root,
+		       struct PHRASE_NODE *p_list)
+{
+	struct FileWorker workers[MAX_THREADS];
+	struct ParallelRun run;
+	int n,i;
+
+	n=sgrep->file_jobs;
+	if (n>flist_files(files)) n=flist_files(files);
+	for(i=0;i<n;i++) {
+	    workers[i].run=&run;
+	    workers[i].root=copy_parse_tree(sgrep,root,p_list,
+					    &workers[i].p_list);
+	    if (!workers[i].root) {
+		/* Constant lists are shared, trees having them are not
+		 * copied */
+		while(--i>=0) free_parse_tree_copy(sgrep,workers[i].root);
+		return SGREP_ERROR;
+	    }
+	}
+	run.files=files;
+	run.next=0;
+	run.written=0;
+	run.writing=0;
+	run.stop=0;
+	run.print_newline=sgrep->print_newline;
+	run.outputs=(struct FileOutput *)sgrep_calloc(
+	    flist_files(files),sizeof(struct FileOutput));
+
+	/* The workers share the arena, so it is opened before them. The
+	 * workers use up the threads for evaluating subtrees */
+	open_eval_arena(sgrep);
+	sgrep->busy_threads+=n-1;
+	run_in_threads(file_worker,workers,sizeof(struct FileWorker),n);
+	sgrep->busy_threads-=n-1;
+
+	for(i=0;i<flist_files(files);i++) {
+	    /* Outputs left unwritten after -q stopped the run */
+	    if (run.outputs[i].buf) {
+		free_memstream_buffer(run.outputs[i].buf);
+	    }
+	}
+	sgrep_free(run.outputs);
+	for(i=0;i<n;i++) free_parse_tree_copy(sgrep,workers[i].root);
+
+	/*
+	 * Now only constant lists should be left
+	 */
+	assert(stats.region_lists_now==stats.constant_lists);
+	if ( display_count && !no_output )
+	{
+	    printf("%d\n",stats.output);
+	}
+	fflush(stdout);
+
+#if HAVE_TIMES
+	/* Scanning and evaluation are not timed separately */
+	tps.acsearch=tps.parsing;
+	times(&tps.eval);
+	tps.output=tps.eval;
+#endif
+	return SGREP_OK;
+}
+#endif
+
 /* 
  * Runs sgrep file by file
  */
 int run_one_by_one(FileList *files, ParseTreeNode *root, 
 		    struct PHRASE_NODE *p_list)
 {
-	RegionList *result;
+	RegionCursor *result;
 	int i;
 	int save_print_newline;
 
+#if HAVE_OPEN_MEMSTREAM
+	/* The workers would fill the plans of their own trees */
+	if (sgrep->file_jobs>1 && flist_files(files)>1 && !show_plan &&
+	    run_parallel_files(files,root,p_list)==SGREP_OK) {
+	    return SGREP_OK;
+	}
+#endif
+
 #if HAVE_TIMES
 	struct tms t_pmatch,t_eval,t_output;
 
@@ -408,37 +614,39 @@ int run_one_by_one(FileList *files, ParseTreeNode *root,
 	    root->result=NULL;
 	    
 	    /* chars list size is the size of file being evaluates */
-	    sgrep->chars_list->length=flist_length(files,i);
+	    sgrep->chars_list->length=(int)flist_length(files,i);
 	    
 	    search(sgrep,p_list,files,i,i);
 	    CALC_TIME(&t_pmatch);
 	    
-	    result=eval(sgrep,files,root);
-	    stats.output+=LIST_SIZE(result);
+	    /* The blocking parts of the query are evaluated here, the
+	     * rest while the result is written */
+	    result=eval_cursor(sgrep,files,root);
 	    CALC_TIME(&t_eval);
 
 	    /* FIXME: save_sgrep->print_newline is a horrible historical kludge */
 	    if (i==flist_files(files)-1) {
 		sgrep->print_newline=save_print_newline;
 	    }
-	    if ( !display_count && !no_output && (
-		LIST_SIZE(result)>0 || sgrep->print_all ))
+	    if ( !display_count && !no_output )
 	    {
-		write_region_list(sgrep,stdout,result,files);
+		write_region_cursor(sgrep,stdout,result,files,
+				    sgrep->print_newline);
 	    }
+	    /* With -q the first region is enough */
+	    stats.output+=cursor_count_regions(result,no_output ? 1 : 0);
 	    
-	    /* We free result list,except when we got constant list
-	       as result list */
-	    if (stats.region_lists_now==stats.constant_lists+1)
-	    {
-		free_gclist(result);
-	    }
+	    /* Frees the lists, except constant lists */
+	    delete_region_cursor(result);
 	    CALC_TIME(&t_output);
 	    
 	    /*
 	     * Now only constant lists should be left
 	     */
 	    assert(stats.region_lists_now==stats.constant_lists);
+
+	    /* No need to scan the rest of the files with -q */
+	    if (no_output && stats.output>0) break;
 	}
 	if ( display_count && !no_output )
 	{
@@ -467,7 +675,7 @@ int run_one_by_one(FileList *files, ParseTreeNode *root,
  */
 int run_stream(FileList *files, ParseTreeNode *root, struct PHRASE_NODE *p_list)
 {
-	RegionList *result;
+	RegionCursor *result;
 			
 	/* Pattern matching on input files */	
 #ifdef DEBUG
@@ -482,33 +690,33 @@ int run_stream(FileList *files, ParseTreeNode *root, struct PHRASE_NODE *p_list)
 #ifdef DEBUG
 	fprintf(stderr,"Evaluating.\n");
 #endif
-	result=eval(sgrep,files,root);
+	result=eval_cursor(sgrep,files,root);
 	if (result==NULL) return SGREP_ERROR;
-
-	if (stats.region_lists_now>stats.constant_lists+1) {
-	    sgrep_error(sgrep,"Query leaked %d gc lists\n",
-			stats.region_lists_now-stats.constant_lists+1);
-	}
 	times(&tps.eval);
 	
-	/* Outputting result */
+	/* Outputting result. The streamed part of the query is evaluated
+	 * as the regions are written */
 #ifdef DEBUG
 	fprintf(stderr,"Output result.\n");
 	fflush(stderr);
 #endif
 	
-	stats.output=LIST_SIZE(result);
+	/* We show result list only if there wasn't -c option, and there was
+	   something to output */
+	if ( !display_count && !no_output )
+	    write_region_cursor(sgrep,stdout,result,files,
+				sgrep->print_newline);
+	stats.output=cursor_count_regions(result,no_output ? 1 : 0);
 	/* Should we show the count of matching regions */
 	if ( display_count )
 	{
-		printf("%d\n",LIST_SIZE(result));
+		printf("%d\n",stats.output);
+	}
+	delete_region_cursor(result);
+	if (stats.region_lists_now>stats.constant_lists) {
+	    sgrep_error(sgrep,"Query leaked %d gc lists\n",
+			stats.region_lists_now-stats.constant_lists);
 	}
-	/* We show result list only if there wasn't -c option, and there was
-	   something to output */
-	if ( !display_count && !no_output && (
-			stats.output>0 || sgrep->print_all ))
-	    write_region_list(sgrep,stdout,result,files);
-	free_gclist(result);
 	fflush(stdout);
 	times(&tps.output);
 	return SGREP_OK;
@@ -753,6 +961,12 @@ int get_options(char *argv[])
 		case 'T':
 			have_stats=1;
 			break;
+		case 'E':
+			show_plan=1;
+			break;
+		case 'z':
+			sgrep->compress_lists=1;
+			break;
 		case 't':
 			have_times=1;
 			break;
@@ -847,6 +1061,22 @@ int get_options(char *argv[])
 		case 'n':
 			read_sgreprc=0;
 			break;
+		case 'j': {
+		    char *arg;
+		    arg=get_arg(sgrep,&argv,&i,&j);
+		    if (!arg) return SGREP_ERROR;
+		    sgrep->file_jobs=atoi(arg);
+		    if (sgrep->file_jobs<1 || sgrep->file_jobs>MAX_THREADS) {
+			fprintf(stderr,"-j takes a number from 1 to %d\n",
+				MAX_THREADS);
+			return SGREP_ERROR;
+		    }
+		    break;
+		}
+		case 'k':
+		    cache_dir=get_arg(sgrep,&argv,&i,&j);
+		    if (!cache_dir) return SGREP_ERROR;
+		    break;
 		case 'O': {
 		    char *arg;
 		    arg=get_arg(sgrep,&argv,&i,&j);
@@ -910,10 +1140,38 @@ int get_options(char *argv[])
 void show_stats()
 {
 	fprintf(stderr,
-	"Scanned %d files, having total of %dK size finding %d phrases.\n",
+	"Scanned %d files, having total of "OFFSET_FORMAT"K size finding %d phrases.\n",
 		stats.scanned_files,
 		stats.scanned_bytes/1024,
 		stats.phrases);
+	if (stats.ac_states) {
+		fprintf(stderr,
+			"Phrase automate had %d states, %d byte classes (%dK table)\n",
+			stats.ac_states,stats.ac_classes,
+			(int)((stats.ac_table_bytes+1023)/1024));
+		fprintf(stderr,
+			"Phrases start with %d bytes, prefilter %s%s skipped "
+			OFFSET_FORMAT"K (%d%%)\n",
+			stats.ac_start_bytes,stats.ac_prefilter,
+			stats.ac_prefilter_dropped ? 
+			" (dropped, too many candidates)" : "",
+			stats.ac_prefilter_skipped/1024,
+			(int)(stats.ac_prefilter_skipped/
+			      (stats.input_size/100+1)));
+	}
+	if (stats.regex_dfa_states) {
+		fprintf(stderr,
+			"Regex DFA had %d states (dropped %d times), prefilters skipped "
+			OFFSET_FORMAT"K, NFA matched "OFFSET_FORMAT"K\n",
+			stats.regex_dfa_states,stats.regex_dfa_flushes,
+			stats.regex_skipped/1024,
+			stats.regex_verified/1024);
+	}
+	if (stats.sgml_kernel) {
+		fprintf(stderr,
+			"SGML scanner skipped "OFFSET_FORMAT"K of text and words with %s kernel\n",
+			stats.sgml_skipped/1024,stats.sgml_kernel);
+	}
 	fprintf(stderr,"Operator tree size was %d, optimized %d\n",
 		stats.parse_tree_size,
 		stats.parse_tree_size-stats.optimized_nodes);
@@ -945,10 +1203,22 @@ void show_stats()
 		stats.peak_memory_usage/1024,stats.reallocs);
 #endif
 	fprintf(stderr," %d gc lists created", stats.region_lists);
-  	fprintf(stderr," %d gc blocks used, %d gc blocks allocated.\n",
+  	fprintf(stderr," %d gc blocks used, %d gc blocks allocated",
 		stats.gc_nodes,stats.gc_nodes_allocated);
+	fprintf(stderr," (%d%% recycled).\n",
+		(stats.gc_nodes-stats.gc_nodes_allocated)*100/
+		(stats.gc_nodes+1));
 	fprintf(stderr," Longest list size was %d regions.\n",
 		stats.longest_list);
+	if (stats.compressed_lists) {
+		fprintf(stderr,
+			" %d compressed lists, %dK regions encoded to %dK (%d%%)\n",
+			stats.compressed_lists,
+			(int)(stats.compressed_regions*sizeof(Region)/1024),
+			(int)(stats.compressed_bytes/1024),
+			(int)(stats.compressed_bytes*100/
+			      (stats.compressed_regions*sizeof(Region)+1)));
+	}
 	fprintf(stderr,
 		"Things done:\n %d %s\n %d %s, %d %s, %d %s\n",
 		stats.scans,"gc lists scanned",
@@ -956,13 +1226,38 @@ void show_stats()
 		stats.sorts_by_end,"sorts by end point"
 		,stats.remove_duplicates,"remove duplicates"
 		);
+#ifdef USE_THREADS
+	fprintf(stderr," %d sorts done in parallel\n",stats.parallel_sorts);
+	fprintf(stderr," %d subtree pairs evaluated in parallel\n",
+		stats.parallel_subtrees);
+	fprintf(stderr," %d searches scanned files in parallel\n",
+		stats.parallel_scans);
+#endif
 #ifdef OPTIMIZE_SORTS
 	fprintf(stderr," %d sorts optimized\n",stats.sorts_optimized);
 #endif
+	fprintf(stderr," %d operations skipped ahead in a longer list\n",
+		stats.seeking_operations);
+	fprintf(stderr," %d evaluations stopped early\n",stats.early_stops);
+	fprintf(stderr," %d subtrees skipped as the other operand was empty\n",
+		stats.short_circuits);
+	fprintf(stderr," %d operations merged with %s merge kernel\n",
+		stats.kernel_merges,sgrep->merge_kernel->name);
+	if (stats.cache_hits || stats.cache_misses) {
+		fprintf(stderr,
+			" %d cache hits, %d misses, %d entries stored, %d evicted\n",
+			stats.cache_hits,stats.cache_misses,
+			stats.cache_stores,stats.cache_evictions);
+	}
 	if (stats.optimized_phrases)
 	{
 		fprintf(stderr," %d same phrases\n",stats.optimized_phrases);
 	}
+	if (stats.flattened_ors)
+	{
+		fprintf(stderr," %d chains of or evaluated as n-ary or\n",
+			stats.flattened_ors);
+	}
 }		
 
 
@@ -25,6 +25,7 @@ typedef struct {
     int tree_size;
     int optimized_nodes;
     int optimized_phrases;
+    int flattened_ors;
 } Optimizer;
 
 
@@ -385,6 +386,69 @@ void create_reference_counters(ParseTreeNode *root) {
     }    
 }
 
+/*
+ * Puts the operands of the chain of or operators starting from node to
+ * operands, and returns their number. Or nodes read by nobody else are
+ * part of the chain, other subtrees are operands. operands may be NULL
+ * when only the number is needed.
+ */
+static int add_or_operands(const ParseTreeNode *node,
+			   ParseTreeNode **operands, int n) {
+    ParseTreeNode *child;
+    int i;
+
+    for(i=0;i<2;i++) {
+	child=(i==0) ? node->left : node->right;
+	if (child->oper==OR && child->refcount==1) {
+	    n=add_or_operands(child,operands,n);
+	} else {
+	    if (operands) operands[n]=child;
+	    n++;
+	}
+    }
+    return n;
+}
+
+int or_operands(const ParseTreeNode *node, ParseTreeNode **operands) {
+    assert(node->oper==OR);
+    return add_or_operands(node,operands,0);
+}
+
+/*
+ * Marks the chains of three or more or operators (like the ones made by
+ * the macros in sample.sgreprc) to be evaluated as one n-ary or: the top
+ * node of the chain gets the number of operands. The tree must have the
+ * reference counters.
+ */
+static void flatten_or_chains(Optimizer *o, ParseTreeNode *node,
+			      int in_chain, ParseTreeNode **shared,
+			      int *n_shared) {
+    int i,operands;
+
+    if (node==NULL || node->oper==PHRASE) return;
+    if (node->refcount>1) {
+	/* Shared subtrees are flattened once */
+	for(i=0;i<*n_shared;i++) {
+	    if (shared[i]==node) return;
+	}
+	shared[(*n_shared)++]=node;
+    }
+    if (node->oper==OR && !in_chain) {
+	operands=or_operands(node,NULL);
+	if (operands>2) {
+	    node->number=operands;
+	    o->flattened_ors++;
+	}
+    }
+    flatten_or_chains(o,node->left,
+		      node->oper==OR && node->left->oper==OR &&
+		      node->left->refcount==1,shared,n_shared);
+    flatten_or_chains(o,node->right,
+		      node->oper==OR && node->right &&
+		      node->right->oper==OR && node->right->refcount==1,
+		      shared,n_shared);
+}
+
 #ifdef DEBUG_OPTTREE
 /*
  * Prints the optimized tree to stderr
@@ -490,6 +554,7 @@ void optimize_tree(struct SgrepStruct *sgrep,
     optimizer.tree_size=0;
     optimizer.optimized_nodes=0;
     optimizer.optimized_phrases=0;
+    optimizer.flattened_ors=0;
 
     /* We need nodes parent information for optimization */
     optimizer.tree_size=add_parents(*root,NULL);
@@ -504,10 +569,238 @@ void optimize_tree(struct SgrepStruct *sgrep,
     shrink_tree(&optimizer);
 	
     create_reference_counters(*root);
+
+    /* Chains of ors are evaluated as one n-ary or */
+    {
+	ParseTreeNode **shared;
+	int n_shared=0;
+	shared=(ParseTreeNode **)
+	    sgrep_malloc(optimizer.tree_size*sizeof(ParseTreeNode *));
+	flatten_or_chains(&optimizer,*root,0,shared,&n_shared);
+	sgrep_free(shared);
+    }
 #ifdef DEBUG_OPTTREE
     print_opt_tree(*root,0,0);
 #endif
     stats.parse_tree_size+=optimizer.tree_size;
     stats.optimized_phrases+=optimizer.optimized_phrases;
     stats.optimized_nodes+=optimizer.optimized_nodes;
+    stats.flattened_ors+=optimizer.flattened_ors;
+}
+
+/*
+ * Cost based planning. The plan of a node is made when the lists of the
+ * leaves are known, so the sizes of the other lists can be estimated.
+ * Costs are counted in steps of a linear merge of two lists.
+ */
+#define PROBE_STEP_COST 2.0	/* One step of a binary search */
+#define ARRAY_COPY_COST 0.25	/* Copying a region to a start sorted array */
+
+/* Which operands make the result of an operator empty, when empty */
+#define EMPTY_LEFT 1
+#define EMPTY_RIGHT 2
+
+void clear_node_plan(ParseTreeNode *node) {
+    node->plan.estimate=-1;
+    node->plan.round=0;
+    node->plan.flags=0;
+    node->plan.shown=0;
+    node->plan.evaluations=0;
+    node->plan.estimated=0;
+    node->plan.regions=0;
+}
+
+static int empty_operands(const ParseTreeNode *node) {
+    switch(node->oper) {
+    case OR:
+	return 0;
+    case NOT_IN:
+    case NOT_CONTAINING:
+    case NOT_EQUAL:
+    case EXTRACTING:
+	return EMPTY_LEFT;
+    default:
+	/* Functions have only the left operand */
+	return (node->right) ? EMPTY_LEFT|EMPTY_RIGHT : EMPTY_LEFT;
+    }
+}
+
+/* Smaller of two estimates. The result can't be larger than a known one */
+static double min_estimate(double a, double b) {
+    if (a<0) return b;
+    if (b<0) return a;
+    return (a<b) ? a : b;
+}
+
+static double sum_estimate(double a, double b) {
+    return (a<0 || b<0) ? -1 : a+b;
+}
+
+/*
+ * Estimates the number of regions in the list of node. Evaluated nodes
+ * and leaves with their lists give the exact size, the other ones are
+ * guessed from the sizes of their operands.
+ */
+static double estimate_node(ParseTreeNode *node, int round) {
+    double l,r,e;
+
+    if (node->plan.round==round) return node->plan.estimate;
+    node->plan.round=round;
+    if (node->result) {
+	e=LIST_SIZE(node->result);
+    } else if (node->oper==PHRASE) {
+	e=(node->leaf->regions) ? LIST_SIZE(node->leaf->regions) : -1;
+    } else {
+	l=estimate_node(node->left,round);
+	r=(node->right) ? estimate_node(node->right,round) : -1;
+	switch(node->oper) {
+	case OR:
+	case EXTRACTING:
+	    e=sum_estimate(l,r);
+	    break;
+	case NOT_IN:
+	case NOT_CONTAINING:
+	case NOT_EQUAL:
+	case OUTER:
+	case INNER:
+	case CONCAT:
+	case JOIN:
+	case FIRST_BYTES:
+	case LAST_BYTES:
+	    e=l;
+	    break;
+	case FIRST:
+	case LAST:
+	    e=min_estimate(l,node->number);
+	    break;
+	default:
+	    /* Operators giving regions of one operand matching the other */
+	    e=min_estimate(l,r);
+	    break;
+	}
+	node->plan.flags&=~(PLAN_RIGHT_FIRST|PLAN_SHORT_CIRCUIT);
+	if (node->right && (empty_operands(node)&EMPTY_RIGHT) &&
+	    r>=0 && (l<0 || r<l)) {
+	    /* The smaller operand is cheaper to get, and more likely to
+	     * be empty */
+	    node->plan.flags|=PLAN_RIGHT_FIRST;
+	}
+	if (node->right && empty_operands(node)) {
+	    node->plan.flags|=PLAN_SHORT_CIRCUIT;
+	}
+    }
+    node->plan.estimate=e;
+    return e;
+}
+
+/*
+ * Makes the plan of the tree starting from root. Called before every
+ * evaluation of the tree, as the leaf lists change from file to file.
+ */
+void plan_tree(SgrepData *sgrep, ParseTreeNode *root) {
+    estimate_node(root,root->plan.round+1);
+}
+
+/*
+ * Tells whether it is cheaper to probe list longer with a binary
+ * search for every region of list shorter than to merge the two lists.
+ * Probing needs longer as a start sorted array, which may have to be
+ * made first.
+ */
+int plan_probe(const RegionList *longer, const RegionList *shorter) {
+    double n=LIST_SIZE(longer);
+    double m=LIST_SIZE(shorter);
+    double probe;
+    int steps;
+
+    if (n<=m) return 0;
+    for(steps=1;(1<<steps)<n && steps<31;steps++);
+    probe=m*steps*PROBE_STEP_COST;
+    if (!LIST_IS_CHARS(longer) && !longer->start_sorted_array &&
+	!LIST_IS_CONTIGUOUS(longer) && !LIST_IS_COMPRESSED(longer)) {
+	probe+=n*ARRAY_COPY_COST;
+    }
+    return probe<n+m;
+}
+
+static const char *plan_node_name(const ParseTreeNode *node) {
+    if (node->oper==OR && node->number>2) return "or (n-ary)";
+    if (node->oper!=PHRASE) return give_oper_name(node->oper);
+    switch(node->label_left) {
+    case LABEL_CONS:
+	return "constant list";
+    case LABEL_CHARS:
+	return "chars";
+    }
+    return (node->leaf->phrase) ? string_escaped(node->leaf->phrase) : "?";
+}
+
+static void print_plan_node(SgrepData *sgrep, FILE *f, ParseTreeNode *node,
+			    int depth, int round) {
+    static const struct {
+	int flag;
+	const char *text;
+    } notes[]={
+	{ PLAN_RIGHT_FIRST,"right first" },
+	{ PLAN_SHORT_CIRCUIT,"stops at empty operand" },
+	{ PLAN_PROBE_LEFT,"probes left" },
+	{ PLAN_PROBE_RIGHT,"probes right" },
+	{ PLAN_NO_PREPROCESS,"no outer/inner" },
+	{ PLAN_STREAMED,"streamed" },
+	{ PLAN_SKIPPED,"skipped" },
+	{ 0,NULL }
+    };
+    char estimated[32],regions[32];
+    int i,sep;
+
+    if (node==NULL) return;
+    if (node->plan.round==round) {
+	fprintf(f,"%*s%s (shared, see above)\n",depth*2,"",
+		plan_node_name(node));
+	return;
+    }
+    node->plan.round=round;
+    if (node->plan.evaluations==0) {
+	strcpy(estimated,"-");
+	strcpy(regions,"-");
+    } else {
+	if (node->plan.estimated<0) strcpy(estimated,"?");
+	else sprintf(estimated,"%.0f",node->plan.estimated);
+	sprintf(regions,"%.0f",node->plan.regions);
+    }
+    fprintf(f,"%*s%-*s %10s %10s",depth*2,"",
+	    (depth*2<30) ? 30-depth*2 : 0,plan_node_name(node),
+	    estimated,regions);
+    sep=' ';
+    for(i=0;notes[i].text;i++) {
+	if (node->plan.shown&notes[i].flag) {
+	    fprintf(f,"%c %s",sep,notes[i].text);
+	    sep=',';
+	}
+    }
+    fprintf(f,"\n");
+    if (node->oper==OR && node->number>2) {
+	/* The or nodes inside the chain are not evaluated */
+	ParseTreeNode **operands;
+	operands=(ParseTreeNode **)
+	    sgrep_malloc(node->number*sizeof(ParseTreeNode *));
+	or_operands(node,operands);
+	for(i=0;i<node->number;i++) {
+	    print_plan_node(sgrep,f,operands[i],depth+1,round);
+	}
+	sgrep_free(operands);
+    } else if (node->oper!=PHRASE) {
+	print_plan_node(sgrep,f,node->left,depth+1,round);
+	print_plan_node(sgrep,f,node->right,depth+1,round);
+    }
+}
+
+/*
+ * Shows the plan of the tree: for every node the estimated and the
+ * computed number of regions, summed over the evaluated files, and
+ * how the node was evaluated
+ */
+void print_plan(SgrepData *sgrep, FILE *f, ParseTreeNode *root) {
+    fprintf(f,"%-30s %10s %10s\n","Evaluation plan","estimated","regions");
+    print_plan_node(sgrep,f,root,0,root->plan.round+1);
 }
@@ -23,14 +23,15 @@ struct DisplayerStruct {
     int region;
     /* Current file */
     int current_file;
-    int last; /* total length of all files */
+    Offset last; /* total length of all files */
     /* 
      * When not in stream mode, the output won't start at position 0.
      * This points out the start of output
      */
-    int first_ind;
+    Offset first_ind;
     /* Remember last_char in case we need to append newline */
     int last_char;
+    int print_newline;	/* Append the newline if missing */
     int start_warned;	/* Has warnings about too long regions been given ? */
     int end_warned;
     FILE *stream; /* The output stream to which we are printing */
@@ -45,7 +46,7 @@ struct DisplayerStruct {
  * input stream. 
  */
 const char *get_file_region(Displayer *displayer,int file,
-			    unsigned int start, unsigned int len) {
+			    Offset start, Offset len) {
     SGREPDATA(displayer);
 
     if (displayer->current_file!=file) {
@@ -63,7 +64,8 @@ const char *get_file_region(Displayer *displayer,int file,
 				     (void **)&displayer->map);
     }
     if (displayer->map==NULL) return NULL; /* Nothing to do without a map */
-    if (start>=displayer->map_size || start+len>displayer->map_size) {
+    if ((size_t)start>=displayer->map_size ||
+	(size_t)(start+len)>displayer->map_size) {
 	sgrep_error(sgrep,"File '%s' truncated?\n",
 		    flist_name(displayer->files,file));
 	return NULL;
@@ -72,7 +74,7 @@ const char *get_file_region(Displayer *displayer,int file,
 }
 
 void show_file_region(Displayer *displayer,int file,
-		      unsigned int start,unsigned int len) {
+		      Offset start,Offset len) {
     const char *r;
     r=get_file_region(displayer,file,start,len);
     if (r) {
@@ -85,7 +87,7 @@ void show_file_region(Displayer *displayer,int file,
  * By using constant gc lists it's possible to have regions, which
  * exceed input size. So we need to make a check
  */
-void check_region(Displayer *displayer, int *start, int *len)
+void check_region(Displayer *displayer, Offset *start, Offset *len)
 {
     SGREPDATA(displayer);
     if ( *start>=displayer->last && (!displayer->start_warned) )
@@ -107,7 +109,7 @@ void check_region(Displayer *displayer, int *start, int *len)
  * Locates and maps the correct file for given region start point
  * assumes start is correct
  */
-int locate_file_num(Displayer *displayer, int start) {
+int locate_file_num(Displayer *displayer, Offset start) {
     /* Checking the common case: if we already have the right file */
     if (displayer->current_file>=0 && 
 	start>=flist_start(displayer->files,displayer->current_file) &&
@@ -120,9 +122,9 @@ int locate_file_num(Displayer *displayer, int start) {
     }
 }
 
-const char *fetch_region(Displayer *d,Region *region, int *size) {
+const char *fetch_region(Displayer *d,Region *region, Offset *size) {
     int fnum;
-    int start,len;
+    Offset start,len;
     const char *r;
 
     if (!region || region->start==-1) {
@@ -153,7 +155,7 @@ const char *fetch_region(Displayer *d,Region *region, int *size) {
  * Shows a region which might reside in more than one file. This is done
  * by finding out the files, where region is and calling show_file_region
  */
-void show_region(Displayer *displayer,int start,int len)
+void show_region(Displayer *displayer,Offset start,Offset len)
 {
     int fnum;
 
@@ -164,7 +166,7 @@ void show_region(Displayer *displayer,int start,int len)
     assert(fnum>=0 && fnum<flist_files(displayer->files));
     
     while(len>0) {
-	int fstart,flen;	
+	Offset fstart,flen;	
 	fstart=start-flist_start(displayer->files,fnum);
 	flen=flist_length(displayer->files,fnum)-fstart;
 	if (flen>len) flen=len;
@@ -204,31 +206,32 @@ void expand(Displayer *displayer, int ch, Region r)
 	    }
 	} else {
 	    sgrep_error(displayer->sgrep,
-			"Could not find file for region (%d,%d)\n",
+			"Could not find file for region ("OFFSET_FORMAT","
+			OFFSET_FORMAT")\n",
 			r.start,r.end);
 	}
 	break;
     case 's':
-	fprintf(displayer->stream,"%d",r.start+displayer->first_ind);
+	fprintf(displayer->stream,OFFSET_FORMAT,r.start+displayer->first_ind);
 	break;
     case 'e':
-	fprintf(displayer->stream,"%d",r.end+displayer->first_ind);
+	fprintf(displayer->stream,OFFSET_FORMAT,r.end+displayer->first_ind);
 	break;
     case 'l':
-	fprintf(displayer->stream,"%d",r.end-r.start+1);
+	fprintf(displayer->stream,OFFSET_FORMAT,r.end-r.start+1);
 	break;
     case 'i':
 	if (r.start>displayer->last)
 	    i=flist_files(displayer->files)-1;
 	else if (i==-1) i=flist_search(displayer->files,r.start);
-	fprintf(displayer->stream,"%d",
+	fprintf(displayer->stream,OFFSET_FORMAT,
 		r.start-flist_start(displayer->files,i));
 	break;
     case 'j':
 	if (r.end>displayer->last)
 	    i=flist_files(displayer->files)-1;
 	else if (i==-1) i=flist_search(displayer->files,r.end);
-	fprintf(displayer->stream,"%d",
+	fprintf(displayer->stream,OFFSET_FORMAT,
 		r.end-flist_start(displayer->files,i));
 	break;
     case 'r':
@@ -286,19 +289,20 @@ void escape(Displayer *displayer,int ch)
 }
 	
 /*
- * Prints a gc list using output_style and given file list
+ * Prints the regions given by cursor using output_style and given file
+ * list. Nothing is printed for an empty result, unless sgrep is used
+ * as a filter.
  */
-int display_gc_list(Displayer *displayer,RegionList *l)
+int display_regions(Displayer *displayer,RegionCursor *cursor)
 {
-    ListIterator lp;
     Region r,p;
     int i;
     int ch;
     
     struct SgrepStruct *sgrep=displayer->sgrep;
     
-    start_region_search(l,&lp);
-    get_region(&lp,&r);
+    cursor_get_region(cursor,&r);
+    if (r.start==-1 && !sgrep->print_all) return SGREP_OK;
     if (r.start>0 && sgrep->print_all)
     {
 	/* There is text before first region */
@@ -308,6 +312,7 @@ int display_gc_list(Displayer *displayer,RegionList *l)
     if (r.start==-1 && sgrep->print_all) {
 	/* There was no regions, but we are in filter mode */
 	show_region(displayer,0,displayer->last);
+	p.end=displayer->last;
     }
     
     while ( r.start!=-1 && (!ferror(displayer->stream)))
@@ -326,7 +331,7 @@ int display_gc_list(Displayer *displayer,RegionList *l)
 	    }
 	}
 	p=r;
-	get_region(&lp,&r);
+	cursor_get_region(cursor,&r);
 	
 	if (r.start>0 && p.end<r.start-1 && sgrep->print_all)
 	{
@@ -342,7 +347,7 @@ int display_gc_list(Displayer *displayer,RegionList *l)
 	show_region(displayer,p.end+1,displayer->last-p.end-1);
     }
     if ((!ferror(displayer->stream)) &&
-	displayer->last_char!='\n' && sgrep->print_newline ) 
+	displayer->last_char!='\n' && displayer->print_newline ) 
 	fputc('\n',displayer->stream);
     if ((!ferror(displayer->stream))) fflush(displayer->stream);
     if (ferror(displayer->stream)) {
@@ -360,6 +365,7 @@ void init_displayer(Displayer *displayer,SgrepData *sgrep, FileList *files) {
     displayer->last=flist_total(files);
     displayer->first_ind=0;
     displayer->last_char=0;
+    displayer->print_newline=sgrep->print_newline;
     displayer->start_warned=0;
     displayer->end_warned=0;
     displayer->stream=NULL;
@@ -389,12 +395,30 @@ void delete_displayer(Displayer *d) {
 int write_region_list(struct SgrepStruct *sgrep,
 		  FILE *stream, RegionList *list, FileList *files) {
     int r;
+    RegionCursor *cursor;
+
+    cursor=new_list_cursor(list);
+    r=write_region_cursor(sgrep,stream,cursor,files,sgrep->print_newline);
+    delete_region_cursor(cursor);
+    return r;
+}
+
+/*
+ * Writes the regions as they are pulled from cursor. print_newline
+ * tells whether a missing newline is added after them.
+ */
+int write_region_cursor(struct SgrepStruct *sgrep,
+			FILE *stream, RegionCursor *cursor, FileList *files,
+			int print_newline) {
+    int r;
 
     Displayer displayer;
     init_displayer(&displayer,sgrep,files);
 
     displayer.stream=stream;
+    displayer.print_newline=print_newline;
+    r=display_regions(&displayer,cursor);
+    /* Unmaps the last file shown */
     clean_up_displayer(&displayer);
-    r=display_gc_list(&displayer,list);
     return r;
 }
@@ -23,6 +23,16 @@
 #define MAX_R_WORD 20
 #define ELLENGTH 79
 #define SHOWR 5
+/* Maximum digits in a number. Integer arguments are ints, constant
+ * region lists may need more */
+#define MAX_INT_DIGITS 9
+#if LARGE_OFFSETS
+#define MAX_NUMBER_DIGITS 18
+#define string_to_offset(S) strtoll((S),NULL,10)
+#else
+#define MAX_NUMBER_DIGITS MAX_INT_DIGITS
+#define string_to_offset(S) atoi(S)
+#endif
 
 /* 
  * Tokens of sgrep query language
@@ -222,11 +232,23 @@ const char *give_oper_name(int oper)
 	case L_ORDERED:		return "_.";break;
 	case R_ORDERED:		return "._";break;
 	case LR_ORDERED:	return "__";break;
+	case QUOTE:		return "quote";break;
+	case L_QUOTE:		return "_quote";break;
+	case R_QUOTE:		return "quote_";break;
+	case LR_QUOTE:		return "_quote_";break;
 	case EXTRACTING:	return "extracting";break;
+	case PARENTING:		return "parenting";break;
+	case CHILDRENING:	return "childrening";break;
+	case NEAR:		return "near";break;
+	case NEAR_BEFORE:	return "near_before";break;
 	case OUTER:		return "outer";break;
 	case INNER:		return "inner";break;
 	case CONCAT:		return "concat";break;
 	case JOIN:		return "join";break;
+	case FIRST:		return "first";break;
+	case LAST:		return "last";break;
+	case FIRST_BYTES:	return "first_bytes";break;
+	case LAST_BYTES:	return "last_bytes";break;
 	case PHRASE:		return "phrase";break;
 	case INVALID:		return "invalid";break;
 	default:		return "unknown";break;
@@ -476,7 +498,7 @@ enum Token next_token(Parser *parser)
 		*phrase=init_string(sgrep,i,str);
 		return W_NUMBER;
 	    }
-	    if (i==9)
+	    if (i==MAX_NUMBER_DIGITS)
 	    {
 		real_parse_error(parser,"Too big number");
 		return W_PARSE_ERROR;
@@ -554,6 +576,7 @@ ParseTreeNode *create_tree_node(Parser *parser, enum Oper oper)
 	n->label_right=LABEL_NOTKNOWN;
 	n->refcount=0;
 	n->result=NULL;
+	clear_node_plan(n);
 
 	parser->node_array[parser->nodes++]=n;
 	return n;
@@ -630,7 +653,7 @@ ParseTreeNode *parse_phrase(Parser *parser, const char *typestr) {
 /* production basic_expr->constant_list */
 ParseTreeNode *parse_cons_list(Parser *parser)
 {
-    int s,e,ps,pe;
+    Offset s,e,ps,pe;
     char *cons_err="invalid constant region list";
     ParseTreeNode *n;
     RegionList *c_list;
@@ -650,14 +673,14 @@ ParseTreeNode *parse_cons_list(Parser *parser)
 	NEXT_TOKEN;
 	if (token!=W_NUMBER)
 	    parse_error(cons_err);
-	s=atoi(parser->string_token->s);
+	s=string_to_offset(parser->string_token->s);
 	NEXT_TOKEN;
 	if (token!=W_COMMA)
 	    parse_error(cons_err);
 	NEXT_TOKEN;
 	if (token!=W_NUMBER)
 	    parse_error(cons_err);
-	e=atoi((char *)(parser->string_token->s));
+	e=string_to_offset((char *)(parser->string_token->s));
 	NEXT_TOKEN;
 	if (token!=W_RPAREN)
 	    parse_error(cons_err);
@@ -695,6 +718,8 @@ ParseTreeNode *parse_integer_function(Parser *parser,
 	sprintf(buf,"integer expected: %s(integer,expression)",name);
 	parse_error(buf);
     }
+    if (parser->string_token->length>MAX_INT_DIGITS)
+	parse_error("Too big number");
     n->number=atoi((char *)parser->string_token->s);
     delete_string(parser->string_token);
     parser->string_token=NULL;
@@ -731,6 +756,10 @@ ParseTreeNode *parse_int_oper_argument(Parser *parser,
 	parse_error("Expecting integer argument for operator");
 	return NULL;
     }
+    if (parser->string_token->length>MAX_INT_DIGITS) {
+	parse_error("Too big number");
+	return NULL;
+    }
     n->number=atoi(parser->string_token->s);
     if (n->number<0) {
 	parse_error("Expecting integer value >=0");
@@ -845,8 +874,20 @@ ParseTreeNode *parse_basic_expr(Parser *parser) {
 	return parse_phrase(parser,"f");
     case W_STRING: 
 	return parse_phrase(parser,"n");
-    case W_REGEX:
-	return parse_phrase(parser,"r");
+    case W_REGEX: {
+	const char *error;
+	/* The index has no text to match regular expressions against */
+	if (parser->sgrep->index_reader) {
+	    parse_error("regex() can not be used with an index (-x)");
+	}
+	n=parse_phrase(parser,"r");
+	if (!n) return NULL;
+	error=check_regex(parser->sgrep,
+			  (const unsigned char *)n->leaf->phrase->s+1,
+			  n->leaf->phrase->length-1);
+	if (error) parse_error((char *)error);
+	return n;
+    }
     case W_DOCTYPE:
 	return parse_phrase(parser, "dn");
     case W_DOCTYPE_PID: 
@@ -1045,7 +1086,10 @@ ParseTreeNode *parse_string(SgrepData *sgrep,const char *str,
 }
 
 
-void free_parse_tree(SgrepData *sgrep, ParseTreeNode *root) {
+/*
+ * Frees a parse tree or a copy of one made by copy_parse_tree()
+ */
+static void free_tree(SgrepData *sgrep, ParseTreeNode *root) {
     assert(root->oper!=INVALID && root->refcount!=0);
     if (root->refcount==-1) {
 	assert(root->oper==PHRASE && root->leaf && root->leaf->phrase==NULL);
@@ -1055,8 +1099,8 @@ void free_parse_tree(SgrepData *sgrep, ParseTreeNode *root) {
     } else {
 	root->refcount--;
 	if (root->refcount==0) {
-	    if (root->left) free_parse_tree(sgrep,root->left);
-	    if (root->right) free_parse_tree(sgrep,root->right);
+	    if (root->left) free_tree(sgrep,root->left);
+	    if (root->right) free_tree(sgrep,root->right);
 	    if (root->oper==PHRASE) {
 		assert(root->leaf);
 		delete_string(root->leaf->phrase);
@@ -1068,6 +1112,104 @@ void free_parse_tree(SgrepData *sgrep, ParseTreeNode *root) {
 	}
     }
 }
+
+void free_parse_tree(SgrepData *sgrep, ParseTreeNode *root) {
+    free_tree(sgrep,root);
+}
+
+void free_parse_tree_copy(SgrepData *sgrep, ParseTreeNode *root) {
+    free_tree(sgrep,root);
+}
+
+/*
+ * Copies a node of an optimized parse tree with its subtrees. Nodes
+ * shared by several parents are copied once: map holds the pairs of
+ * original and copied nodes made so far. Returns NULL if the tree has
+ * constant lists, which can't be copied.
+ */
+static ParseTreeNode *copy_tree_node(SgrepData *sgrep, ParseTreeNode *node,
+				     ParseTreeNode **map, int *mapped) {
+    ParseTreeNode *c;
+    int i;
+
+    if (node==NULL) return NULL;
+    if (node->refcount==-1) return NULL;
+    for(i=0;i<*mapped;i+=2) {
+	if (map[i]==node) return map[i+1];
+    }
+    c=sgrep_new(ParseTreeNode);
+    *c=*node;
+    c->parent=NULL;
+    c->result=NULL;
+    map[(*mapped)++]=node;
+    map[(*mapped)++]=c;
+    if (node->oper==PHRASE) {
+	c->leaf=sgrep_new(struct PHRASE_NODE);
+	*c->leaf=*node->leaf;
+	/* string_to_char() writes to the string, so each copy has its own */
+	c->leaf->phrase=init_string(sgrep,node->leaf->phrase->length,
+				    node->leaf->phrase->s);
+	c->leaf->next=NULL;
+	c->leaf->regions=NULL;
+	c->leaf->parent=c;
+	return c;
+    }
+    c->left=copy_tree_node(sgrep,node->left,map,mapped);
+    c->right=copy_tree_node(sgrep,node->right,map,mapped);
+    if (c->left==NULL || (node->right && c->right==NULL)) return NULL;
+    return c;
+}
+
+static int count_tree_nodes(const ParseTreeNode *node) {
+    if (node==NULL) return 0;
+    return 1+count_tree_nodes(node->left)+count_tree_nodes(node->right);
+}
+
+/*
+ * Makes a copy of an optimized parse tree and its phrase list, which
+ * can be evaluated independently of the original, also in another
+ * thread. The copy has its own phrase strings and is freed with
+ * free_parse_tree_copy(). Returns NULL if the tree can't be copied.
+ */
+ParseTreeNode *copy_parse_tree(SgrepData *sgrep, ParseTreeNode *root,
+			       struct PHRASE_NODE *phrase_list,
+			       struct PHRASE_NODE **copy_list) {
+    ParseTreeNode **map;
+    ParseTreeNode *copy;
+    struct PHRASE_NODE **tail;
+    int mapped=0;
+    int i;
+
+    map=(ParseTreeNode **)sgrep_malloc(
+	2*count_tree_nodes(root)*sizeof(ParseTreeNode *));
+    copy=copy_tree_node(sgrep,root,map,&mapped);
+    /* Link the phrase nodes of the copy in the order of the original */
+    *copy_list=NULL;
+    tail=copy_list;
+    for(;copy && phrase_list;phrase_list=phrase_list->next) {
+	for(i=0;i<mapped && map[i]!=phrase_list->parent;i+=2);
+	if (i==mapped) {
+	    /* Phrase not in the tree */
+	    copy=NULL;
+	    break;
+	}
+	*tail=map[i+1]->leaf;
+	tail=&(*tail)->next;
+    }
+    if (copy==NULL) {
+	/* Free the nodes made before giving up */
+	for(i=0;i<mapped;i+=2) {
+	    if (map[i+1]->oper==PHRASE) {
+		delete_string(map[i+1]->leaf->phrase);
+		sgrep_free(map[i+1]->leaf);
+	    }
+	    sgrep_free(map[i+1]);
+	}
+	*copy_list=NULL;
+    }
+    sgrep_free(map);
+    return copy;
+}
 	
 	
 #ifdef DEBUG
@@ -10,8 +10,10 @@
 */
 
 /* NOTE: Aho-Corasick automate can only take constant patterns. There is
-         no wild card expansions and it's always case sensitive. Maybe
-         something should be done about this.
+         no wild card expansions. The goto and fail functions are built
+         as a trie, which is then compiled to a dense transition table
+         over byte classes. Case folding (-i) is done by the byte class
+         map, so the scanning loop itself is always the same.
 */
 
 /*
@@ -39,17 +41,18 @@
 struct ScanBuffer {
     SgrepData *sgrep;
     FileList *file_list;
-    int len;
+    Offset len;
     int file_num;
     int old_file_num;
     int last_file;
-    int region_start;
+    Offset region_start;
     const unsigned char *map;
-    int map_size;
+    Offset map_size;
 };
 
 
-/* OutputList, ACState and ACScanner are for Aho-Corasick automate */
+/* OutputList and ACState are for building the Aho-Corasick automate.
+ * ACScanner is the compiled automate */
 struct OutputList {
 	struct PHRASE_NODE *phrase;
 	struct OutputList *next;
@@ -60,17 +63,54 @@ struct ACState {
     struct ACState *fail;
     struct ACState *next; /* queue needed when creating fail function */
     struct OutputList *output_list;
-#ifdef DEBUG
-    int state_num;
-#endif
+    int state_num;        /* Row of this state in the compiled table */
 };
 
+/* Transition tables with no more entries than this use 16 bit entries */
+#define AC_SMALL_TABLE 65536
+
+/* Prefilter is used when phrases can start with at most this many bytes */
+#define AC_PREFILTER_BYTES BYTE_KERNEL_MAX_SET
+/* Prefilter is dropped, if it skips less than this many bytes per
+ * candidate on average. Checked every AC_PREFILTER_CHECK candidates */
+#define AC_PREFILTER_MIN_SKIP 16
+#define AC_PREFILTER_CHECK 1024
+
+struct ACScanner;
+/* Gives the offset of the first byte in buf which can start a phrase,
+ * or len when there is none */
+typedef Offset (*ACPrefilter)(const struct ACScanner *sc,
+			      const unsigned char *buf, Offset len);
+
 struct ACScanner {
     SgrepData *sgrep;
     struct PHRASE_NODE *phrase_list; /* Points to this scanners phrase list */
-    struct ACState *root_state; /* Points to root state */
-    struct ACState *s;          /* Points to current state */
-    int ignore_case;
+    int states;			/* Number of states, root state is 0 */
+    int classes;		/* Number of byte classes */
+    unsigned char byte_class[256]; /* Byte class of every byte */
+    /* A row of classes+1 entries for every state. States are given by
+     * the offset of their row, so the next state is
+     * delta[s+byte_class[ch]]. Last entry of the row is state number+1,
+     * if phrases are found in the state, 0 otherwise. Only one of
+     * these is used depending on the size of the table */
+    unsigned short *delta16;
+    unsigned int *delta32;
+    /* Phrases found in state s are output[outputs[s]..outputs[s+1]-1] */
+    int *outputs;
+    struct PHRASE_NODE **output;
+    unsigned int s;		/* Current state (offset of its row) */
+    /* Prefilter skipping bytes in root state, NULL when not used */
+    ACPrefilter prefilter;
+    const char *prefilter_name;
+    const ByteKernel *byte_kernel;
+    int start_bytes;		/* How many bytes can start a phrase */
+    unsigned char start_byte[AC_PREFILTER_BYTES];
+    Offset candidates;		/* Positions given by the prefilter */
+    Offset skipped;		/* Bytes skipped by the prefilter */
+    int dropped;		/* Prefilter was dropped */
+    /* Phrases found. Added to statistics, when the scanner is deleted,
+     * so that scanners of parallel workers don't need locking */
+    int found;
 } AC_scanner; /* THE AC_scanner, since only one is needed */
 
 
@@ -80,10 +120,13 @@ struct ACScanner {
 void new_output( SgrepData *sgrep, struct ACState *s, 
 			struct PHRASE_NODE *pn);
 void ACsearch(struct ACScanner *scanner, const unsigned char *buf, 
-	      int len, int start);
+	      Offset len, Offset start);
 void enter(SgrepData *sgrep, struct PHRASE_NODE *pn, 
 		  struct ACState *root_state, int ignore_case);
 void create_fail(SgrepData *sgrep, struct ACState *root_state);
+void compile_AC(SgrepData *sgrep, struct ACScanner *sc,
+		struct ACState *root_state, int ignore_case);
+void select_AC_prefilter(SgrepData *sgrep, struct ACScanner *sc);
 void create_goto(SgrepData *sgrep,struct PHRASE_NODE *phrase_list, 
 			struct ACState *root_state,
 			int ignore_case);
@@ -102,6 +145,7 @@ void print_scanner_help() {
     printf("      %-12s%s\n","xml","use XML scanner");
     printf("      %-12s%s\n","sgml-debug","show recognized SGML tokens");
     printf("      %-12s%s\n","include-entities","  automatically include system entities");
+    printf("      %-12s%s\n","no-fast-scan","  scan text one character at a time");
 }
 
 int set_scanner_option(SgrepData *sgrep,const char *a) {
@@ -120,6 +164,8 @@ int set_scanner_option(SgrepData *sgrep,const char *a) {
 	sgrep->sgml_debug=1;
     } else if (strcmp(arg,"include-entities")==0) {
 	sgrep->include_system_entities=1;
+    } else if (strcmp(arg,"no-fast-scan")==0) {
+	sgrep->sgml_no_fast_scan=1;
     } else if (strcmp(arg,"encoding=iso-8859-1")==0) {
 	sgrep->default_encoding=ENCODING_8BIT;
     } else if (strcmp(arg,"encoding=utf8")==0) {
@@ -171,7 +217,8 @@ void delete_scan_buffer(struct ScanBuffer *b) {
 /*
  * Fills the scanner input buffer and sets len and file_num respectively
  * if all files have been processed returns 0
- * otherwise returns number of bytes available in buffer
+ * otherwise returns a positive value (sb->len holds the number of bytes
+ * available in buffer)
  * NEW: uses map_file() instead of read()
  */
 int next_scan_buffer(struct ScanBuffer *sb)
@@ -213,7 +260,7 @@ int next_scan_buffer(struct ScanBuffer *sb)
     }
     sb->region_start+=sb->len;
     sb->len=sb->map_size;
-    return sb->len;
+    return 1;
 }
 		
 /*
@@ -234,6 +281,7 @@ struct ACState *new_state(SgrepData *sgrep)
 	s->output_list=NULL;
 	s->next=NULL;
 	s->fail=NULL;
+	s->state_num=0;
 #ifdef DEBUG
 	snum++;
 	s->state_num=snum;
@@ -320,6 +368,8 @@ void create_goto(SgrepData *sgrep, struct PHRASE_NODE *phrase_list,
 /*
  * The creation of the AC fail function and the final output function 
  * The automate to use is given with root_state
+ * Leaves all the other states chained through next in breadth first
+ * order starting from root_state->next
  */
 void create_fail(SgrepData *sgrep,struct ACState *root_state) 
 {
@@ -343,6 +393,7 @@ void create_fail(SgrepData *sgrep,struct ACState *root_state)
 			s->fail=root_state;
 		}
 	}
+	root_state->next=first;
 #ifdef DEBUG
 	printf(" root done");
 #endif
@@ -373,6 +424,181 @@ void create_fail(SgrepData *sgrep,struct ACState *root_state)
 #endif
 }
 
+/*
+ * Compiles the automate built by create_goto() and create_fail() to
+ * a dense transition table of scanner and frees the trie.
+ * Bytes which no phrase distinguishes from each other share a byte
+ * class, so the table has only one column for each distinct (case folded)
+ * byte of the phrases and one for all other bytes.
+ */
+void compile_AC(SgrepData *sgrep, struct ACScanner *sc,
+		struct ACState *root_state, int ignore_case) {
+    struct ACState **order;
+    struct ACState *s;
+    struct OutputList *op;
+    int folded_class[256];
+    unsigned char class_byte[257];
+    int i,c,n,o;
+    size_t row,prow,width;
+
+    /* Number the states in breadth first order. Fail state is always
+     * closer to root, so its row is ready before the row of the state */
+    n=0;
+    for(s=root_state;s!=NULL;s=s->next) n++;
+    order=(struct ACState **)sgrep_malloc(n*sizeof(struct ACState *));
+    n=0;
+    for(s=root_state;s!=NULL;s=s->next) {
+	s->state_num=n;
+	order[n++]=s;
+    }
+    sc->states=n;
+
+    /* Byte classes. Trie has only case folded bytes when ignoring case */
+    for(i=0;i<256;i++) folded_class[i]=0;
+    for(n=0;n<sc->states;n++) {
+	for(i=0;i<256;i++) {
+	    if (order[n]->gotos[i]!=NULL && order[n]->gotos[i]!=root_state) {
+		folded_class[i]=1;
+	    }
+	}
+    }
+    sc->classes=1;
+    class_byte[0]=0;
+    for(i=0;i<256;i++) {
+	if (folded_class[i]) {
+	    class_byte[sc->classes]=i;
+	    folded_class[i]=sc->classes++;
+	}
+    }
+    for(i=0;i<256;i++) {
+	sc->byte_class[i]=folded_class[ignore_case ? toupper(i) : i];
+    }
+
+    /* Transition table. Class 0 always leads back to root */
+    width=sc->classes+1;
+    sc->delta16=NULL;
+    sc->delta32=NULL;
+    if (sc->states*width<=AC_SMALL_TABLE) {
+	sc->delta16=(unsigned short *)
+	    sgrep_malloc(sizeof(unsigned short)*sc->states*width);
+    } else {
+	sc->delta32=(unsigned int *)
+	    sgrep_malloc(sizeof(unsigned int)*sc->states*width);
+    }
+    for(n=0;n<sc->states;n++) {
+	s=order[n];
+	row=n*width;
+	prow=(n>0) ? s->fail->state_num*width : 0;
+	for(c=0;c<=sc->classes;c++) {
+	    size_t next;
+	    if (c==sc->classes) {
+		next=(s->output_list) ? n+1 : 0;
+	    } else if (c>0 && s->gotos[class_byte[c]]!=NULL) {
+		next=s->gotos[class_byte[c]]->state_num*width;
+	    } else if (n>0) {
+		next=(sc->delta16) ? sc->delta16[prow+c] : sc->delta32[prow+c];
+	    } else {
+		next=0;
+	    }
+	    if (sc->delta16) {
+		sc->delta16[row+c]=next;
+	    } else {
+		sc->delta32[row+c]=next;
+	    }
+	}
+    }
+
+    /* Flat output arrays */
+    sc->outputs=(int *)sgrep_malloc(sizeof(int)*(sc->states+1));
+    o=0;
+    for(n=0;n<sc->states;n++) {
+	sc->outputs[n]=o;
+	for(op=order[n]->output_list;op!=NULL;op=op->next) o++;
+    }
+    sc->outputs[sc->states]=o;
+    sc->output=(struct PHRASE_NODE **)
+	sgrep_malloc(sizeof(struct PHRASE_NODE *)*(o+1));
+    o=0;
+    for(n=0;n<sc->states;n++) {
+	for(op=order[n]->output_list;op!=NULL;op=op->next) {
+	    sc->output[o++]=op->phrase;
+	}
+    }
+
+    /* The trie is not needed anymore */
+    for(n=0;n<sc->states;n++) {
+	while(order[n]->output_list) {
+	    op=order[n]->output_list;
+	    order[n]->output_list=op->next;
+	    sgrep_free(op);
+	}
+	sgrep_free(order[n]);
+    }
+    sgrep_free(order);
+
+    sgrep_lock(sgrep);
+    sgrep->statistics.ac_states=sc->states;
+    sgrep->statistics.ac_classes=sc->classes;
+    sgrep->statistics.ac_table_bytes=sc->states*width*
+	((sc->delta16) ? sizeof(unsigned short) : sizeof(unsigned int));
+    sgrep_unlock(sgrep);
+}
+
+/*
+ * Prefilters. When the automate is in root state, all bytes which can't
+ * start a phrase keep it there, so they can be skipped with a search
+ * for the bytes which can.
+ */
+static Offset prefilter_memchr(const struct ACScanner *sc,
+			       const unsigned char *buf, Offset len) {
+    const unsigned char *p=memchr(buf,sc->start_byte[0],len);
+    return p ? (Offset)(p-buf) : len;
+}
+
+static Offset prefilter_bytes(const struct ACScanner *sc,
+			      const unsigned char *buf, Offset len) {
+    return sc->byte_kernel->find_bytes(buf,len,sc->start_byte,
+				       sc->start_bytes);
+}
+
+/*
+ * Picks the prefilter from the bytes the phrases can start with.
+ * With a single start byte it is memchr(), with a few the bytes are
+ * searched with the byte kernel. With many, or when an empty phrase matches
+ * everywhere, every byte is a candidate and there's no point in it
+ */
+void select_AC_prefilter(SgrepData *sgrep, struct ACScanner *sc) {
+    int i,n;
+
+    sc->prefilter=NULL;
+    sc->prefilter_name="none";
+    sc->candidates=sc->skipped=0;
+    n=0;
+    for(i=0;i<256;i++) {
+	unsigned int next=(sc->delta16) ? sc->delta16[sc->byte_class[i]] :
+	    sc->delta32[sc->byte_class[i]];
+	if (next!=0) {
+	    if (n<AC_PREFILTER_BYTES) sc->start_byte[n]=i;
+	    n++;
+	}
+    }
+    sc->start_bytes=n;
+    if (n==0 || n>AC_PREFILTER_BYTES || sc->outputs[0]!=sc->outputs[1]) {
+	/* No prefilter */
+    } else if (n==1) {
+	sc->prefilter=prefilter_memchr;
+	sc->prefilter_name="memchr";
+    } else {
+	sc->byte_kernel=select_byte_kernel();
+	sc->prefilter=prefilter_bytes;
+	sc->prefilter_name=sc->byte_kernel->name;
+    }
+    sgrep_lock(sgrep);
+    sgrep->statistics.ac_prefilter=sc->prefilter_name;
+    sgrep->statistics.ac_start_bytes=sc->start_bytes;
+    sgrep_unlock(sgrep);
+}
+
 /* Phrases list points to list of phrases to be
  * matched. ifs points to names of input files, and lf is the number of
  * input files.
@@ -381,45 +607,79 @@ struct ACScanner *init_AC_search(SgrepData *sgrep,
 				 struct PHRASE_NODE *phrase_list) {
     int i;
     struct ACScanner *sc;
+    struct ACState *root_state;
 
     sc=sgrep_new(struct ACScanner);
     sc->sgrep=sgrep;
-    sc->root_state=new_state(sgrep);
+    root_state=new_state(sgrep);
     sc->phrase_list=phrase_list;
-    sc->s=sc->root_state;
-    sc->ignore_case=sgrep->ignore_case;
-    create_goto(sgrep,phrase_list,sc->root_state,sc->ignore_case);
+    create_goto(sgrep,phrase_list,root_state,sgrep->ignore_case);
     /* there isn't any fail links from root state */
     for (i=0;i<256;i++) {
-	if (sc->root_state->gotos[i]==NULL) 
-	    sc->root_state->gotos[i]=sc->root_state;
+	if (root_state->gotos[i]==NULL) 
+	    root_state->gotos[i]=root_state;
     }
-    create_fail(sgrep,sc->root_state);
+    create_fail(sgrep,root_state);
+    compile_AC(sgrep,sc,root_state,sgrep->ignore_case);
+    select_AC_prefilter(sgrep,sc);
+    sc->s=0;
+    sc->dropped=0;
+    sc->found=0;
     return sc;
 }
 
-void delete_AC_state(SgrepData *sgrep,struct ACState *as) {
-    int i;
-    for(i=0;i<256;i++) {
-	if (as->gotos[i] && as->gotos[i]!=as) {
-	    delete_AC_state(sgrep,as->gotos[i]);
-	}
-	while(as->output_list) {
-	    struct OutputList *ol=as->output_list;
-	    as->output_list=as->output_list->next;
-	    sgrep_free(ol);
-	}
-    }
-    sgrep_free(as);
-}
-	
 void delete_AC_scanner(struct ACScanner *ac) {
-    /* FIXME: this leaks memory! */
     SGREPDATA(ac);
-    delete_AC_state(sgrep,ac->root_state);
+    sgrep_lock(sgrep);
+    sgrep->statistics.ac_prefilter_skipped+=ac->skipped;
+    if (ac->dropped) sgrep->statistics.ac_prefilter_dropped=1;
+    sgrep->statistics.phrases+=ac->found;
+    sgrep_unlock(sgrep);
+    if (ac->delta16) sgrep_free(ac->delta16);
+    if (ac->delta32) sgrep_free(ac->delta32);
+    sgrep_free(ac->outputs);
+    sgrep_free(ac->output);
     sgrep_free(ac);
 }
 
+/*
+ * Adds the regions of phrases found in state number s ending at
+ * position end
+ */
+static void AC_output(struct ACScanner *scanner, unsigned int s, Offset end)
+{
+    int o;
+    struct PHRASE_NODE *pn;
+
+    for(o=scanner->outputs[s];o<scanner->outputs[s+1];o++) {
+	pn=scanner->output[o];
+	scanner->found++;
+	assert(pn->regions!=NULL);
+	add_region(pn->regions,end-(pn->phrase->length-1)+1,end);
+#ifdef DEBUG
+	printf("Found \"%s\" at %d\n",pn->phrase->s,(int)end);
+#endif
+    }
+}
+
+/*
+ * Runs the prefilter from buf, when the automate is in root state.
+ * Drops the prefilter, if it gives candidates too often to pay off
+ */
+static Offset AC_skip(struct ACScanner *scanner, const unsigned char *buf,
+		      Offset len)
+{
+    Offset skip=scanner->prefilter(scanner,buf,len);
+    
+    scanner->skipped+=skip;
+    if (skip<len && 
+	++scanner->candidates%AC_PREFILTER_CHECK==0 &&
+	scanner->skipped<scanner->candidates*AC_PREFILTER_MIN_SKIP) {
+	scanner->prefilter=NULL;
+	scanner->dropped=1;
+    }
+    return skip;
+}
 
 /* 
  * The AC automate search. 
@@ -427,43 +687,484 @@ void delete_AC_scanner(struct ACScanner *ac) {
  *  ago when it first saw the light of the day.
  *  It seems that i've actually gained some "programming experience"
  *  in these years :) 
+ * Now it is a table lookup per byte, and in root state the bytes which
+ * can't start a phrase are skipped with the prefilter.
  */
 void ACsearch(struct ACScanner *scanner, const unsigned char *buf, 
-	      int len, int start)
+	      Offset len, Offset start)
 {
-    struct OutputList *op;
-    int ch;
-    int i;
-    struct ACState *s;
+    Offset i;
+    unsigned int s;
+    const int classes=scanner->classes;
+    const unsigned char *byte_class=scanner->byte_class;
+
+#define AC_STEP(DELTA) \
+    s=(DELTA)[s+byte_class[buf[i]]]; \
+    if ((DELTA)[s+classes]) AC_output(scanner,(DELTA)[s+classes]-1,i+start)
 
     s=scanner->s;
+    i=0;
+    /* Skip with the prefilter until it is dropped */
+    for(;i<len && scanner->prefilter;i++) {
+	if (s==0) {
+	    i+=AC_skip(scanner,buf+i,len-i);
+	    if (i>=len) break;
+	}
+	if (scanner->delta16) {
+	    AC_STEP(scanner->delta16);
+	} else {
+	    AC_STEP(scanner->delta32);
+	}
+    }
+    /* Plain automate */
+    if (scanner->delta16) {
+	const unsigned short *delta=scanner->delta16;
+	for(;i<len;i++) {
+	    AC_STEP(delta);
+	}
+    } else {
+	const unsigned int *delta=scanner->delta32;
+	for(;i<len;i++) {
+	    AC_STEP(delta);
+	}
+    }
+#undef AC_STEP
+    scanner->s=s;
+}
+
+
+/*
+ * Runs the automate through buf without looking for phrases
+ */
+static void AC_run(struct ACScanner *scanner, const unsigned char *buf,
+		   Offset len)
+{
+    Offset i;
+    unsigned int s=scanner->s;
+
     for(i=0;i<len;i++) {
-	ch=(scanner->ignore_case) ? toupper(buf[i]) : buf[i];
-	while (s->gotos[ch]==NULL) {
-	    assert(s->fail);
-	    s=s->fail;
-	}	
-	s=s->gotos[ch];
-	op=s->output_list;
-	while(op!=NULL) {
-	    scanner->sgrep->statistics.phrases++;
-	    assert(op->phrase->regions!=NULL);
-	    add_region( op->phrase->regions,
-			i-(op->phrase->phrase->length-1)+start+1,
-			i+start);
-#ifdef DEBUG
-	    printf("Found \"%s\" in file %s at %d  gc<-(%d,%d)\n",
-		   op->phrase->phrase->s,
-		   file_list->files[file_num].name,
-		   file_pos-buf_end+buf_pos-(op->phrase->phrase->length),
-		   i- ( op->phrase->phrase->length ) , i-1);
-#endif
-	    op=op->next;
-	} while ( op!=NULL );
+	s=(scanner->delta16) ? 
+	    scanner->delta16[s+scanner->byte_class[buf[i]]] :
+	    scanner->delta32[s+scanner->byte_class[buf[i]]];
     }
     scanner->s=s;
 }
 
+/*
+ * Puts the automate to the state it would have after scanning the
+ * files from f_file up to offset start, so that phrases starting before
+ * start and ending after it are found. Only the need bytes before
+ * start (the length of the longest phrase minus one) are needed for
+ * that.
+ */
+static void AC_warm_up(struct ACScanner *scanner, FileList *files,
+		       int f_file, Offset start, Offset need)
+{
+    SGREPDATA(scanner);
+    Offset from,fstart,len;
+    void *map;
+    int g;
+
+    scanner->s=0;
+    from=start-need;
+    if (from<flist_start(files,f_file)) from=flist_start(files,f_file);
+    if (from>=start) return;
+    for(g=flist_search(files,from);from<start;g++) {
+	fstart=flist_start(files,g);
+	len=flist_length(files,g);
+	if (from>=fstart+len) continue;
+	if (map_file(sgrep,flist_name(files,g),&map)!=(size_t)len || !map) {
+	    if (map) unmap_file(sgrep,map,len);
+	    scanner->s=0;
+	} else {
+	    AC_run(scanner,(const unsigned char *)map+(from-fstart),
+		   ((start<fstart+len) ? start : fstart+len)-from);
+	    unmap_file(sgrep,map,len);
+	}
+	from=fstart+len;
+    }
+}
+
+/*
+ * Gives an empty list for the regions of phrase pn
+ */
+static RegionList *new_phrase_list(SgrepData *sgrep, struct PHRASE_NODE *pn,
+				   int compress) {
+    RegionList *l;
+
+    if (pn->phrase->s[0]=='@' ||
+	pn->phrase->s[0]=='*') {
+	/* Element lists tend to be huge and need sorting, so they
+	 * are stored contiguously */
+	l=new_contiguous_region_list(sgrep);
+	list_set_sorted(l,NOT_SORTED);
+	l->nested=1;
+    } else if (compress) {
+	l=new_compressed_region_list(sgrep);
+    } else {
+	/* Contiguous, so that operators can merge them with
+	 * the merge kernel */
+	l=new_contiguous_region_list(sgrep);
+    }
+    return l;
+}
+
+/*
+ * Scans files from f_file to l_file in this thread
+ */
+static int scan_files(SgrepData *sgrep,struct PHRASE_NODE *phrase_list,
+		      FileList *files, int f_file, int l_file,
+		      int ac_phrases, int sgml_phrases, int regex_phrases) {
+    struct ScanBuffer *sb=NULL;
+    struct ACScanner *acs=NULL;
+    SGMLScanner *sgmls=NULL;
+    RegexScanner *rxs=NULL;
+    int previous_file=-1;
+    int e=SGREP_OK;
+
+    /* Initialization */
+    sb=new_scan_buffer(sgrep,files);
+    reset_scan_buffer(sb,f_file,l_file);
+    if (ac_phrases) {
+	acs=init_AC_search(sgrep,phrase_list);
+    }
+    if (sgml_phrases) {
+	sgmls=new_sgml_phrase_scanner(sgrep,files,phrase_list);
+    }
+    if (regex_phrases) {
+	rxs=new_regex_scanner(sgrep,phrase_list);
+    }
+	
+    /* Main scanning loop, only if there is something to scan */
+    if (acs || sgmls || rxs) while((e=next_scan_buffer(sb))>0) {
+	if (flist_files(files)>1) {
+	    sgrep_progress(sgrep,"Scanning %d/%d files %d/%dK (%d%%)\n",
+			   sb->file_num,flist_files(files),
+			   (int)(sb->region_start/1024),
+			   (int)(flist_total(files)/1024),
+			   (int)(sb->region_start/(flist_total(files)/100+1)));
+	} else {
+	    sgrep_progress(sgrep,"Scanning file '%s' %d/%dK (%d%%)\n",
+			   flist_name(sb->file_list,sb->file_num),
+			   (int)(sb->region_start/1024),
+			   (int)(flist_total(files)/1024),
+			   (int)(sb->region_start/(flist_total(files)/100+1)));
+	}		    
+	if (sgrep->progress_callback) {
+	    sgrep->progress_callback(sgrep->progress_data,
+				     sb->file_num,flist_files(files),
+				     sb->region_start,flist_total(files)); 
+	}			     	    
+	if (ac_phrases) {
+	    ACsearch(acs,sb->map,sb->len,sb->region_start);
+	}
+	if (regex_phrases) {
+	    regex_scan(rxs,sb->map,sb->len,sb->region_start);
+	}
+	if (sgml_phrases) {
+	    if (previous_file!=-1 && sb->file_num!=previous_file) {
+		sgml_flush(sgmls);
+	    }
+	    previous_file=sb->file_num;
+	    sgml_scan(sgmls,sb->map,sb->len,sb->region_start,sb->file_num);
+	}
+    }
+#if 0
+    /* FIXME: think this over */
+    if (sgmls && sgmls->parse_errors>0) {
+	fprintf(stderr,"There was %d SGML parse errors\n",
+		sgmls->parse_errors);
+    }
+#endif
+    /* Clean up scanners */
+    delete_scan_buffer(sb);
+    if (sgmls) {
+	sgml_flush(sgmls);
+	delete_sgml_scanner(sgmls);
+    }	
+    if (acs) delete_AC_scanner(acs);
+    if (rxs) delete_regex_scanner(rxs);
+    return e;
+}
+
+#ifdef USE_THREADS
+/*
+ * Parallel scanning. The input is divided to chunks, which the workers
+ * take one at a time. Every worker has scanners of its own, which add
+ * the regions to a copy of the phrase list. The region lists of the
+ * copy are replaced for every chunk, and the lists of the chunks are
+ * appended to the phrase lists in input order, so they stay sorted.
+ * SGML scanner and regex phrases need whole files, so with them chunks
+ * are consecutive files. Otherwise the chunks may split files, and one
+ * large file is scanned by all the workers.
+ */
+struct ParallelScan {
+    SgrepData *sgrep;
+    FileList *files;
+    int phrases;	     /* Length of the phrase list */
+    int chunks;
+    Offset *chunk_start;     /* Chunk c is from chunk_start[c] ... */
+    Offset *chunk_end;	     /* ... to chunk_end[c]-1 */
+    /* Regions of phrase k found in chunk c */
+    RegionList **lists;	     /* lists[c*phrases+k] */
+    Offset warm_up;	     /* Longest AC phrase minus one */
+    int ac_phrases;
+    int whole_files;	     /* Chunks are whole files */
+    int first_file;
+    /* Shared by the workers, protected with sgrep_lock() */
+    int next;		     /* Next chunk to scan */
+    int error;		     /* A file could not be scanned */
+    int files_done;
+    Offset bytes_done;
+    int reporting;	     /* A worker is reporting progress */
+};
+
+struct ScanWorker {
+    struct ParallelScan *scan;
+    struct PHRASE_NODE *phrases; /* Copy of the phrase list */
+    struct ACScanner *acs;
+    SGMLScanner *sgmls;
+    RegexScanner *rxs;
+};
+
+/*
+ * Tells how the scanning proceeds, summing the work of all workers. 
+ * Called and returns with sgrep_lock() held, but reports unlocked. 
+ * Only one worker reports at a time, the others leave it to that one
+ */
+static void report_scan_progress(struct ParallelScan *scan) {
+    SgrepData *sgrep=scan->sgrep;
+    int files_done;
+    Offset bytes_done;
+
+    if (scan->reporting) return;
+    scan->reporting=1;
+    files_done=scan->files_done;
+    bytes_done=scan->bytes_done;
+    sgrep_unlock(sgrep);
+    sgrep_progress(sgrep,"Scanning %d/%d files %d/%dK (%d%%)\n",
+		   files_done,flist_files(scan->files),
+		   (int)(bytes_done/1024),
+		   (int)(flist_total(scan->files)/1024),
+		   (int)(bytes_done/(flist_total(scan->files)/100+1)));
+    if (sgrep->progress_callback) {
+	sgrep->progress_callback(sgrep->progress_data,
+				 files_done,flist_files(scan->files),
+				 bytes_done,flist_total(scan->files));
+    }
+    sgrep_lock(sgrep);
+    scan->reporting=0;
+}
+
+static void *scan_worker(void *arg) {
+    struct ScanWorker *w=(struct ScanWorker *)arg;
+    struct ParallelScan *scan=w->scan;
+    SgrepData *sgrep=scan->sgrep;
+    struct ScanBuffer *sb;
+    struct PHRASE_NODE *pn;
+    int c,k,e;
+    int previous_file;
+    Offset cstart,cend,from,to;
+
+    sb=new_scan_buffer(sgrep,scan->files);
+    for(;;) {
+	sgrep_lock(sgrep);
+	c=scan->error ? scan->chunks : scan->next++;
+	sgrep_unlock(sgrep);
+	if (c>=scan->chunks) break;
+
+	for(pn=w->phrases,k=0;pn!=NULL;pn=pn->next,k++) {
+	    pn->regions=scan->lists[c*scan->phrases+k];
+	}
+	cstart=scan->chunk_start[c];
+	cend=scan->chunk_end[c];
+	/* Only empty files */
+	if (cstart>=cend) continue;
+	sb->len=0;
+	sb->map=NULL;
+	sb->old_file_num=-1;
+	reset_scan_buffer(sb,flist_search(scan->files,cstart),
+			  flist_search(scan->files,cend-1));
+	if (w->acs) {
+	    AC_warm_up(w->acs,scan->files,scan->first_file,cstart,
+		       scan->warm_up);
+	}
+	previous_file=-1;
+	while((e=next_scan_buffer(sb))>0) {
+	    /* The part of the file in this chunk */
+	    from=(cstart>sb->region_start) ? cstart-sb->region_start : 0;
+	    to=(cend<sb->region_start+sb->len) ? 
+		cend-sb->region_start : sb->len;
+	    if (w->acs) {
+		ACsearch(w->acs,sb->map+from,to-from,sb->region_start+from);
+	    }
+	    if (w->rxs) {
+		regex_scan(w->rxs,sb->map,sb->len,sb->region_start);
+	    }
+	    if (w->sgmls) {
+		if (previous_file!=-1 && sb->file_num!=previous_file) {
+		    sgml_flush(w->sgmls);
+		}
+		previous_file=sb->file_num;
+		sgml_scan(w->sgmls,sb->map,sb->len,sb->region_start,
+			  sb->file_num);
+	    }
+	    sgrep_lock(sgrep);
+	    if (to==sb->len) scan->files_done++;
+	    scan->bytes_done+=to-from;
+	    report_scan_progress(scan);
+	    sgrep_unlock(sgrep);
+	}
+	if (w->sgmls) sgml_flush(w->sgmls);
+	if (e<0) {
+	    sgrep_lock(sgrep);
+	    scan->error=1;
+	    sgrep_unlock(sgrep);
+	}
+    }
+    delete_scan_buffer(sb);
+    return NULL;
+}
+
+/*
+ * Scans files from f_file to l_file with the threads to spare.
+ * Returns 0 without doing anything, if there is not enough to do
+ * for them. Otherwise *e gets the result of the scan.
+ */
+static int parallel_scan(SgrepData *sgrep,struct PHRASE_NODE *phrase_list,
+			 FileList *files, int f_file, int l_file,
+			 int ac_phrases, int sgml_phrases, int regex_phrases,
+			 int *e) {
+    struct ScanWorker workers[MAX_THREADS];
+    struct ParallelScan scan;
+    struct PHRASE_NODE *pn,*copy,**tail;
+    Offset total,chunk_size,size;
+    int n,i,c,k,f;
+    int whole_files=(sgml_phrases || regex_phrases);
+
+    total=flist_start(files,l_file)+flist_length(files,l_file)-
+	flist_start(files,f_file);
+    if (total<PARALLEL_SCAN_LIMIT || (whole_files && l_file<=f_file)) {
+	return 0;
+    }
+    sgrep_lock(sgrep);
+    n=sgrep->threads-sgrep->busy_threads;
+    if (whole_files && n>l_file-f_file+1) n=l_file-f_file+1;
+    if (n>1) sgrep->busy_threads+=n-1;
+    sgrep_unlock(sgrep);
+    if (n<=1) return 0;
+
+    /* Chunks of about the same size, a couple for every worker so that
+     * they finish at about the same time */
+    scan.sgrep=sgrep;
+    scan.files=files;
+    scan.first_file=f_file;
+    scan.ac_phrases=ac_phrases;
+    scan.whole_files=whole_files;
+    chunk_size=total/(2*n)+1;
+    i=(whole_files) ? l_file-f_file+1 : 2*n;
+    scan.chunk_start=(Offset *)sgrep_malloc(sizeof(Offset)*i);
+    scan.chunk_end=(Offset *)sgrep_malloc(sizeof(Offset)*i);
+    scan.chunks=0;
+    if (whole_files) {
+	size=0;
+	for(f=f_file;f<=l_file;f++) {
+	    if (size==0) scan.chunk_start[scan.chunks]=flist_start(files,f);
+	    size+=flist_length(files,f);
+	    if (size>=chunk_size || f==l_file) {
+		scan.chunk_end[scan.chunks++]=
+		    flist_start(files,f)+flist_length(files,f);
+		size=0;
+	    }
+	}
+    } else {
+	/* Files are split at any offset */
+	size=flist_start(files,f_file);
+	while(size<total+flist_start(files,f_file)) {
+	    scan.chunk_start[scan.chunks]=size;
+	    size+=chunk_size;
+	    if (size>total+flist_start(files,f_file)) {
+		size=total+flist_start(files,f_file);
+	    }
+	    scan.chunk_end[scan.chunks++]=size;
+	}
+    }
+
+    scan.phrases=0;
+    scan.warm_up=0;
+    for(pn=phrase_list;pn!=NULL;pn=pn->next) {
+	scan.phrases++;
+	if (pn->phrase->s[0]=='n' && pn->phrase->length-2>scan.warm_up) {
+	    scan.warm_up=pn->phrase->length-2;
+	}
+    }
+    scan.lists=(RegionList **)sgrep_malloc(
+	sizeof(RegionList *)*scan.chunks*scan.phrases);
+    for(c=0;c<scan.chunks;c++) {
+	for(pn=phrase_list,k=0;pn!=NULL;pn=pn->next,k++) {
+	    /* Compressing is done when the chunks are put together */
+	    scan.lists[c*scan.phrases+k]=new_phrase_list(sgrep,pn,0);
+	}
+    }
+    scan.next=0;
+    scan.error=0;
+    scan.files_done=0;
+    scan.bytes_done=0;
+    scan.reporting=0;
+
+    /* The scanners are made here, so that the workers don't race for
+     * the statistics */
+    for(i=0;i<n;i++) {
+	workers[i].scan=&scan;
+	workers[i].phrases=NULL;
+	tail=&workers[i].phrases;
+	for(pn=phrase_list;pn!=NULL;pn=pn->next) {
+	    copy=sgrep_new(struct PHRASE_NODE);
+	    *copy=*pn;
+	    copy->regions=NULL;
+	    copy->next=NULL;
+	    *tail=copy;
+	    tail=&copy->next;
+	}
+	workers[i].acs=(ac_phrases) ? 
+	    init_AC_search(sgrep,workers[i].phrases) : NULL;
+	workers[i].sgmls=(sgml_phrases) ? 
+	    new_sgml_phrase_scanner(sgrep,files,workers[i].phrases) : NULL;
+	workers[i].rxs=(regex_phrases) ?
+	    new_regex_scanner(sgrep,workers[i].phrases) : NULL;
+    }
+    STATS_ADD(parallel_scans,1);
+    run_in_threads(scan_worker,workers,sizeof(struct ScanWorker),n);
+    sgrep_lock(sgrep);
+    sgrep->busy_threads-=n-1;
+    sgrep_unlock(sgrep);
+
+    for(i=0;i<n;i++) {
+	if (workers[i].acs) delete_AC_scanner(workers[i].acs);
+	if (workers[i].sgmls) delete_sgml_scanner(workers[i].sgmls);
+	if (workers[i].rxs) delete_regex_scanner(workers[i].rxs);
+	while(workers[i].phrases) {
+	    copy=workers[i].phrases;
+	    workers[i].phrases=copy->next;
+	    sgrep_free(copy);
+	}
+    }
+    /* Append the regions of the chunks in file order */
+    for(pn=phrase_list,k=0;pn!=NULL;pn=pn->next,k++) {
+	for(c=0;c<scan.chunks;c++) {
+	    RegionList *l=scan.lists[c*scan.phrases+k];
+	    add_region_array(pn->regions,l->array.starts,l->array.ends,
+			     l->length);
+	    delete_region_list(l);
+	}
+    }
+    sgrep_free(scan.lists);
+    sgrep_free(scan.chunk_start);
+    sgrep_free(scan.chunk_end);
+    *e=(scan.error) ? SGREP_ERROR : SGREP_OK;
+    return 1;
+}
+#endif
 
 int search(SgrepData *sgrep,struct PHRASE_NODE *phrase_list, FileList *files, 
 	   int f_file, int l_file) {
@@ -472,7 +1173,6 @@ int search(SgrepData *sgrep,struct PHRASE_NODE *phrase_list, FileList *files,
     int ac_phrases;
     int file_phrases;
     int e=SGREP_OK;
-    int previous_file=-1;
 
     /* If there is no phrases, there is no point to do searching */
     if (phrase_list==NULL) {
@@ -480,9 +1180,6 @@ int search(SgrepData *sgrep,struct PHRASE_NODE *phrase_list, FileList *files,
 	return SGREP_OK;
     }
     if (sgrep->index_file==NULL) {
-	struct ScanBuffer *sb=NULL;
-	struct ACScanner *acs=NULL;
-	SGMLScanner *sgmls=NULL;
 	struct PHRASE_NODE *j=NULL;
 
 	file_phrases=ac_phrases=sgml_phrases=regex_phrases=0;
@@ -491,12 +1188,7 @@ int search(SgrepData *sgrep,struct PHRASE_NODE *phrase_list, FileList *files,
 	for (j=phrase_list;j!=NULL;j=j->next)
 	{
 	    assert(j->regions==NULL);
-	    j->regions=new_region_list(sgrep);
-	    if (j->phrase->s[0]=='@' ||
-		j->phrase->s[0]=='*') {
-		list_set_sorted(j->regions,NOT_SORTED);
-		j->regions->nested=1;
-	    }
+	    j->regions=new_phrase_list(sgrep,j,sgrep->compress_lists);
 	    
 	    switch (j->phrase->s[0]) {
 	    case 'n':
@@ -516,59 +1208,14 @@ int search(SgrepData *sgrep,struct PHRASE_NODE *phrase_list, FileList *files,
 	    }	
 	}
 
-	/* Initialization */
-	sb=new_scan_buffer(sgrep,files);
-	reset_scan_buffer(sb,f_file,l_file);
-	if (ac_phrases) {
-	    acs=init_AC_search(sgrep,phrase_list);
-	}
-	if (sgml_phrases) {
-	    sgmls=new_sgml_phrase_scanner(sgrep,files,phrase_list);
-	}
-	
-	/* Main scanning loop, only if there is something to scan */
-	if (acs || sgmls) while((e=next_scan_buffer(sb))>0) {
-	    if (flist_files(files)>1) {
-		sgrep_progress(sgrep,"Scanning %d/%d files %d/%dK (%d%%)\n",
-			       sb->file_num,flist_files(files),
-			       sb->region_start/1024,flist_total(files)/1024,
-			       sb->region_start/(flist_total(files)/100+1));
-	    } else {
-		sgrep_progress(sgrep,"Scanning file '%s' %d/%dK (%d%%)\n",
-			       flist_name(sb->file_list,sb->file_num),
-			       sb->region_start/1024,flist_total(files)/1024,
-			       sb->region_start/(flist_total(files)/100+1));
-	    }		    
-	    if (sgrep->progress_callback) {
-		sgrep->progress_callback(sgrep->progress_data,
-					 sb->file_num,flist_files(files),
-					 sb->region_start,flist_total(files)); 
-	    }			     	    
-	    if (ac_phrases) {
-		ACsearch(acs,sb->map,sb->len,sb->region_start);
-	    }
-	    if (sgml_phrases) {
-		if (previous_file!=-1 && sb->file_num!=previous_file) {
-		    sgml_flush(sgmls);
-		}
-		previous_file=sb->file_num;
-		sgml_scan(sgmls,sb->map,sb->len,sb->region_start,sb->file_num);
-	    }
-	}
-#if 0
-	/* FIXME: think this over */
-	if (sgmls && sgmls->parse_errors>0) {
-	    fprintf(stderr,"There was %d SGML parse errors\n",
-		    sgmls->parse_errors);
-	}
+	if (ac_phrases || sgml_phrases || regex_phrases) {
+#ifdef USE_THREADS
+	    if (!parallel_scan(sgrep,phrase_list,files,f_file,l_file,
+			       ac_phrases,sgml_phrases,regex_phrases,&e))
 #endif
-	/* Clean up scanners */
-	delete_scan_buffer(sb);
-	if (sgmls) {
-	    sgml_flush(sgmls);
-	    delete_sgml_scanner(sgmls);
-	}	
-	if (acs) delete_AC_scanner(acs);
+		e=scan_files(sgrep,phrase_list,files,f_file,l_file,
+			     ac_phrases,sgml_phrases,regex_phrases);
+	}
 
 	/* Now handle the phrases, whose contents we know only after
 	 * scanning or which are independent of scanning */
@@ -579,10 +1226,10 @@ int search(SgrepData *sgrep,struct PHRASE_NODE *phrase_list, FileList *files,
 
 	    case '#':
 		if (strcmp(j->phrase->s,"#start")==0) {
-		    int start=flist_start(files,f_file);
+		    Offset start=flist_start(files,f_file);
 		    add_region(j->regions,start,start);
 		} else if (strcmp(j->phrase->s,"#end")==0) {
-		    int last=flist_start(files,l_file)+
+		    Offset last=flist_start(files,l_file)+
 			flist_length(files,l_file)-1;
 		    add_region(j->regions,last,last);
 		} else {
@@ -617,6 +1264,11 @@ int search(SgrepData *sgrep,struct PHRASE_NODE *phrase_list, FileList *files,
 	    }
 	    break;
 	    }
+	    /* Element lists could not be compressed while scanning,
+	     * because they are not sorted */
+	    if (sgrep->compress_lists) {
+		compress_region_list(j->regions);
+	    }
 	}
     } else {
 	sgrep_progress(sgrep,"Using lazy index file mode\n"); 
@@ -642,8 +1294,9 @@ int index_search(SgrepData *sgrep,struct IndexWriterStruct *writer,
 	sgrep_progress(sgrep,"Indexing file %d/%d '%s' %d/%dK (%d%%)\n",
 		      sb->file_num+1,flist_files(files),
 		       flist_name(files,sb->file_num),
-		      sb->region_start/1024,flist_total(files)/1024,
-		      sb->region_start/(flist_total(files)/100+1));	
+		      (int)(sb->region_start/1024),
+		      (int)(flist_total(files)/1024),
+		      (int)(sb->region_start/(flist_total(files)/100+1)));
 	if (sgrep->progress_callback) {
 	    sgrep->progress_callback(sgrep->progress_data,
 				     sb->file_num,flist_files(files),
@@ -0,0 +1,1217 @@
+/*
+	System: Structured text retrieval tool sgrep.
+	Module: regex.c
+	Description: Regular expression phrases, regex("..."). The
+		     expressions are scanned with a lazily built DFA,
+		     and the places where it finds matches are matched
+		     exactly with a Thompson NFA simulation.
+	Copyright: University of Helsinki, Dept. of Computer Science
+		   Distributed under GNU General Public Lisence
+		   See file COPYING for details
+*/
+
+/*
+ * The syntax is that of POSIX extended regular expressions without
+ * back references: . [] [^] [:class:] * + ? {m,n} | () ^ $ and the
+ * escapes \d \w \s \D \W \S \n \t \r \f \v \xHH. '.' does not match a
+ * newline. '^' and '$' match at the start and at the end of lines.
+ *
+ * A regex phrase gives the leftmost longest non-empty matches, which
+ * do not overlap (like grep -o). Matches do not continue from one file
+ * to the next.
+ *
+ * The expression is compiled to a program for a Thompson NFA. While
+ * scanning, a DFA for finding the expression anywhere in the input is
+ * built from the program, one transition at a time. A DFA state is the
+ * set of NFA threads in progress, not counting the ones which would
+ * start at the next byte. When the set is empty the DFA is idle and
+ * no match can continue over that point, so those points divide the
+ * input to segments. The DFA tells which segments have a match in
+ * them, but not where it starts, so only those segments are run
+ * through the NFA simulation which finds the exact matches. The DFA
+ * takes '^' and '$' to be always true: it may find a segment too many,
+ * but never misses one.
+ *
+ * While the DFA is idle, the bytes no match starts with are skipped.
+ * If every match contains some literal string, the rest of the file
+ * is skipped when it does not occur any more, and when matches can't
+ * be longer than some length, the input is skipped to the first place
+ * a match containing the next occurrence could start from.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define SGREP_LIBRARY
+#include "sgrep.h"
+
+#define RX_MAX_INSTS 20000	/* Instructions in a compiled expression */
+#define RX_MAX_REPEAT 1000	/* Largest count in {m,n} */
+#define RX_MAX_LITERAL 64	/* Longest literal prefilter */
+/* DFA states kept for an expression. When there would be more, all of
+ * them are thrown away and building starts again */
+#define RX_DFA_STATES 4096
+
+typedef struct {
+    unsigned char bits[32];
+} ByteSet;
+#define IN_SET(S,B) ((S).bits[(B)>>3]&(1<<((B)&7)))
+#define ADD_TO_SET(S,B) ((S).bits[(B)>>3]|=(1<<((B)&7)))
+
+/* Instructions of the NFA program */
+enum { RX_SET, RX_SPLIT, RX_JUMP, RX_BOL, RX_EOL, RX_MATCH };
+
+struct RxInst {
+    int op;
+    int x,y;		/* Where RX_SPLIT and RX_JUMP continue */
+    ByteSet set;	/* The bytes RX_SET accepts */
+};
+
+/* Parse tree of an expression */
+enum { RXN_EMPTY, RXN_SET, RXN_CAT, RXN_ALT, RXN_REPEAT, RXN_BOL, RXN_EOL };
+
+struct RxNode {
+    int type;
+    int left,right;	/* Operands (indexes to nodes) */
+    int min,max;	/* Counts of RXN_REPEAT, max -1 for no limit */
+    ByteSet set;
+};
+
+struct RxParser {
+    SgrepData *sgrep;
+    const unsigned char *p;
+    const unsigned char *end;
+    int ignore_case;
+    const char *error;
+    struct RxNode *nodes;
+    int n_nodes;
+    int max_nodes;
+    struct RxInst *prog;
+    int insts;
+    int prog_size;
+};
+
+/* List of NFA threads for the simulation, in the order of start */
+struct RxThreads {
+    int n;
+    int *pc;
+    Offset *start;
+    unsigned int *mark;	/* mark[pc]==gen when pc is on the list */
+    unsigned int gen;
+};
+
+/* DFA state flags */
+#define RX_MATCHED 1	/* A match ended at the byte leading here */
+#define RX_IDLE 2	/* No threads in progress */
+
+struct Regex {
+    SgrepData *sgrep;
+    struct PHRASE_NODE *phrase;
+    struct RxInst *prog;
+    int insts;
+    /* Lazily built DFA */
+    int classes;
+    unsigned char byte_class[256];
+    unsigned char class_byte[256];  /* A byte of each class */
+    int states;
+    int max_states;	/* Space allocated for */
+    int *delta;		/* delta[s*classes+c], -1 if not built yet */
+    unsigned char *flags;
+    int *set_start;	/* NFA state set of DFA state s is */
+    int *set_len;	/* pool[set_start[s]...set_start[s]+set_len[s]-1] */
+    int *pool;
+    int pool_used;
+    int pool_size;
+    int *hash;		/* DFA states by their sets */
+    int *start_set;	/* Where threads starting at any byte are */
+    int start_len;
+    /* Work space */
+    int *work;
+    int *stack;
+    unsigned int *mark;
+    unsigned int gen;
+    struct RxThreads threads[2];
+    /* Prefilters */
+    unsigned char first[256];	/* Bytes a match can start with */
+    int first_bytes;
+    unsigned char start_byte[BYTE_KERNEL_MAX_SET];
+    int candidates;
+    int skip_bytes;		/* Skip bytes no match starts with */
+    unsigned char literal[RX_MAX_LITERAL];
+    int literal_len;		/* Every match contains literal */
+    unsigned char literal_first[2];
+    int literal_firsts;
+    Offset literal_at;		/* Next occurrence of literal */
+    Offset max_length;		/* Longest match, -1 if no limit */
+    /* Statistics */
+    int built;
+    int flushes;
+    Offset skipped;
+    Offset verified;
+    int found;
+};
+
+struct RegexScannerStruct {
+    SgrepData *sgrep;
+    const ByteKernel *byte_kernel;
+    int ignore_case;
+    int n;
+    struct Regex *rx;
+};
+
+/*
+ * Parsing
+ */
+
+static int rx_parse_alt(struct RxParser *ps);
+
+static int rx_node(struct RxParser *ps, int type, int left, int right) {
+    struct RxNode *n;
+    if (ps->n_nodes==ps->max_nodes) {
+	ps->error="Regex too complex";
+	return -1;
+    }
+    n=&ps->nodes[ps->n_nodes];
+    n->type=type;
+    n->left=left;
+    n->right=right;
+    n->min=n->max=0;
+    memset(&n->set,0,sizeof(n->set));
+    return ps->n_nodes++;
+}
+
+/*
+ * With -i, a set has both cases of letters
+ */
+static void rx_fold_case(struct RxParser *ps, ByteSet *set) {
+    int b;
+    if (!ps->ignore_case) return;
+    for(b=0;b<256;b++) {
+	if (IN_SET(*set,b)) {
+	    ADD_TO_SET(*set,toupper(b));
+	    ADD_TO_SET(*set,tolower(b));
+	}
+    }
+}
+
+static int rx_ctype(int class, int b) {
+    switch(class) {
+    case 0: return isalpha(b);
+    case 1: return isdigit(b);
+    case 2: return isalnum(b);
+    case 3: return isspace(b);
+    case 4: return isupper(b);
+    case 5: return islower(b);
+    case 6: return ispunct(b);
+    case 7: return isxdigit(b);
+    case 8: return iscntrl(b);
+    case 9: return isprint(b);
+    case 10: return isgraph(b);
+    case 11: return b==' ' || b=='\t';
+    case 12: return isalnum(b) || b=='_';
+    }
+    return 0;
+}
+
+static void rx_add_ctype(ByteSet *set, int class, int negate) {
+    int b;
+    for(b=0;b<256;b++) {
+	if ((rx_ctype(class,b)!=0)!=negate) ADD_TO_SET(*set,b);
+    }
+}
+
+/*
+ * Reads an escape after a backslash and adds the bytes it stands for
+ * to set. Gives the byte, -2 if it was a class like \d or -1 on error
+ */
+static int rx_parse_escape(struct RxParser *ps, ByteSet *set) {
+    int c,v,i;
+
+    if (ps->p>=ps->end) {
+	ps->error="Backslash at end of regex";
+	return -1;
+    }
+    c=*ps->p++;
+    switch(c) {
+    case 'n': c='\n'; break;
+    case 't': c='\t'; break;
+    case 'r': c='\r'; break;
+    case 'f': c='\f'; break;
+    case 'v': c='\v'; break;
+    case 'd': rx_add_ctype(set,1,0); return -2;
+    case 'D': rx_add_ctype(set,1,1); return -2;
+    case 's': rx_add_ctype(set,3,0); return -2;
+    case 'S': rx_add_ctype(set,3,1); return -2;
+    case 'w': rx_add_ctype(set,12,0); return -2;
+    case 'W': rx_add_ctype(set,12,1); return -2;
+    case 'x':
+	v=0;
+	for(i=0;i<2 && ps->p<ps->end && isxdigit(*ps->p);i++) {
+	    v=v*16+(isdigit(*ps->p) ? *ps->p-'0' : toupper(*ps->p)-'A'+10);
+	    ps->p++;
+	}
+	if (i==0) {
+	    ps->error="Invalid \\x escape in regex";
+	    return -1;
+	}
+	c=v;
+	break;
+    default:
+	/* Letters and digits are kept for escapes to come */
+	if (isalnum(c)) {
+	    ps->error="Unknown backslash escape in regex";
+	    return -1;
+	}
+    }
+    ADD_TO_SET(*set,c);
+    return c;
+}
+
+/*
+ * Reads [:name:] in a bracket expression
+ */
+static int rx_parse_named_class(struct RxParser *ps, ByteSet *set) {
+    static const char *names[]={
+	"alpha","digit","alnum","space","upper","lower","punct",
+	"xdigit","cntrl","print","graph","blank",NULL };
+    const unsigned char *e;
+    int i;
+
+    for(e=ps->p+2;e+1<ps->end && !(e[0]==':' && e[1]==']');e++);
+    if (e+1>=ps->end) {
+	ps->error="Unterminated [: in regex";
+	return 0;
+    }
+    for(i=0;names[i];i++) {
+	if (strlen(names[i])==(size_t)(e-ps->p-2) &&
+	    strncmp(names[i],(const char *)ps->p+2,e-ps->p-2)==0) {
+	    rx_add_ctype(set,i,0);
+	    ps->p=e+2;
+	    return 1;
+	}
+    }
+    ps->error="Unknown character class in regex";
+    return 0;
+}
+
+/*
+ * Reads a bracket expression after the '['
+ */
+static int rx_parse_class(struct RxParser *ps, ByteSet *set) {
+    int negate=0,first=1;
+    int lo,hi,b;
+
+    if (ps->p<ps->end && *ps->p=='^') {
+	negate=1;
+	ps->p++;
+    }
+    for(;;) {
+	if (ps->p>=ps->end) {
+	    ps->error="Missing ']' in regex";
+	    return 0;
+	}
+	if (*ps->p==']' && !first) {
+	    ps->p++;
+	    break;
+	}
+	first=0;
+	if (*ps->p=='[' && ps->p+1<ps->end && ps->p[1]==':') {
+	    if (!rx_parse_named_class(ps,set)) return 0;
+	    continue;
+	}
+	if (*ps->p=='\\') {
+	    ps->p++;
+	    lo=rx_parse_escape(ps,set);
+	    if (lo==-1) return 0;
+	    if (lo==-2) continue;
+	} else {
+	    lo=*ps->p++;
+	}
+	hi=lo;
+	if (ps->p+1<ps->end && *ps->p=='-' && ps->p[1]!=']') {
+	    ps->p++;
+	    if (*ps->p=='\\') {
+		ps->p++;
+		hi=rx_parse_escape(ps,set);
+		if (hi==-1) return 0;
+	    } else {
+		hi=*ps->p++;
+	    }
+	    if (hi<lo) {
+		ps->error="Invalid range in regex";
+		return 0;
+	    }
+	}
+	for(b=lo;b<=hi;b++) ADD_TO_SET(*set,b);
+    }
+    rx_fold_case(ps,set);
+    if (negate) {
+	for(b=0;b<32;b++) set->bits[b]=~set->bits[b];
+    }
+    return 1;
+}
+
+static int rx_parse_atom(struct RxParser *ps) {
+    int n,c;
+
+    c=*ps->p++;
+    switch(c) {
+    case '(':
+	n=rx_parse_alt(ps);
+	if (n<0) return -1;
+	if (ps->p>=ps->end || *ps->p!=')') {
+	    ps->error="Missing ')' in regex";
+	    return -1;
+	}
+	ps->p++;
+	return n;
+    case '*':
+    case '+':
+    case '?':
+	ps->error="Nothing to repeat in regex";
+	return -1;
+    case '^':
+	return rx_node(ps,RXN_BOL,-1,-1);
+    case '$':
+	return rx_node(ps,RXN_EOL,-1,-1);
+    }
+    n=rx_node(ps,RXN_SET,-1,-1);
+    if (n<0) return -1;
+    switch(c) {
+    case '.':
+	memset(&ps->nodes[n].set,0xff,sizeof(ByteSet));
+	ps->nodes[n].set.bits['\n'>>3]&=~(1<<('\n'&7));
+	return n;
+    case '[':
+	if (!rx_parse_class(ps,&ps->nodes[n].set)) return -1;
+	return n;
+    case '\\':
+	if (rx_parse_escape(ps,&ps->nodes[n].set)==-1) return -1;
+	break;
+    default:
+	ADD_TO_SET(ps->nodes[n].set,c);
+    }
+    rx_fold_case(ps,&ps->nodes[n].set);
+    return n;
+}
+
+static int rx_parse_number(struct RxParser *ps) {
+    int v=0;
+    while(ps->p<ps->end && isdigit(*ps->p)) {
+	if (v<=RX_MAX_REPEAT) v=v*10+*ps->p-'0';
+	ps->p++;
+    }
+    return v;
+}
+
+static int rx_parse_repeat(struct RxParser *ps) {
+    int n,min,max;
+
+    n=rx_parse_atom(ps);
+    while(n>=0 && ps->p<ps->end) {
+	switch(*ps->p) {
+	case '*': min=0; max=-1; ps->p++; break;
+	case '+': min=1; max=-1; ps->p++; break;
+	case '?': min=0; max=1; ps->p++; break;
+	case '{':
+	    /* '{' not followed by a count is an ordinary character */
+	    if (ps->p+1>=ps->end || !isdigit(ps->p[1])) return n;
+	    ps->p++;
+	    min=max=rx_parse_number(ps);
+	    if (ps->p<ps->end && *ps->p==',') {
+		ps->p++;
+		max=(ps->p<ps->end && isdigit(*ps->p)) ?
+		    rx_parse_number(ps) : -1;
+	    }
+	    if (ps->p>=ps->end || *ps->p!='}') {
+		ps->error="Invalid {m,n} in regex";
+		return -1;
+	    }
+	    ps->p++;
+	    if (min>RX_MAX_REPEAT || max>RX_MAX_REPEAT) {
+		ps->error="Too large repeat count in regex";
+		return -1;
+	    }
+	    if (max>=0 && max<min) {
+		ps->error="Invalid {m,n} in regex";
+		return -1;
+	    }
+	    break;
+	default:
+	    return n;
+	}
+	n=rx_node(ps,RXN_REPEAT,n,-1);
+	if (n<0) return -1;
+	ps->nodes[n].min=min;
+	ps->nodes[n].max=max;
+    }
+    return n;
+}
+
+static int rx_parse_cat(struct RxParser *ps) {
+    int left=-1,right;
+
+    while(ps->p<ps->end && *ps->p!='|' && *ps->p!=')') {
+	right=rx_parse_repeat(ps);
+	if (right<0) return -1;
+	left=(left<0) ? right : rx_node(ps,RXN_CAT,left,right);
+	if (left<0) return -1;
+    }
+    return (left<0) ? rx_node(ps,RXN_EMPTY,-1,-1) : left;
+}
+
+static int rx_parse_alt(struct RxParser *ps) {
+    int left,right;
+
+    left=rx_parse_cat(ps);
+    while(left>=0 && ps->p<ps->end && *ps->p=='|') {
+	ps->p++;
+	right=rx_parse_cat(ps);
+	if (right<0) return -1;
+	left=rx_node(ps,RXN_ALT,left,right);
+    }
+    return left;
+}
+
+/*
+ * Compiling to NFA program
+ */
+
+static int rx_emit(struct RxParser *ps, int op) {
+    SgrepData *sgrep=ps->sgrep;
+    struct RxInst *i;
+
+    if (ps->insts==RX_MAX_INSTS) {
+	ps->error="Regex too large";
+	return -1;
+    }
+    if (ps->insts==ps->prog_size) {
+	ps->prog_size=ps->prog_size*2+16;
+	ps->prog=(struct RxInst *)sgrep_realloc(
+	    ps->prog,sizeof(struct RxInst)*ps->prog_size);
+    }
+    i=&ps->prog[ps->insts];
+    i->op=op;
+    i->x=i->y=0;
+    memset(&i->set,0,sizeof(i->set));
+    return ps->insts++;
+}
+
+static int rx_compile_node(struct RxParser *ps, int node) {
+    struct RxNode *n=&ps->nodes[node];
+    int i,j,k;
+
+    switch(n->type) {
+    case RXN_EMPTY:
+	return 1;
+    case RXN_SET:
+	if ((i=rx_emit(ps,RX_SET))<0) return 0;
+	ps->prog[i].set=n->set;
+	return 1;
+    case RXN_BOL:
+	return rx_emit(ps,RX_BOL)>=0;
+    case RXN_EOL:
+	return rx_emit(ps,RX_EOL)>=0;
+    case RXN_CAT:
+	return rx_compile_node(ps,n->left) && rx_compile_node(ps,n->right);
+    case RXN_ALT:
+	if ((i=rx_emit(ps,RX_SPLIT))<0) return 0;
+	ps->prog[i].x=i+1;
+	if (!rx_compile_node(ps,n->left)) return 0;
+	if ((j=rx_emit(ps,RX_JUMP))<0) return 0;
+	ps->prog[i].y=ps->insts;
+	if (!rx_compile_node(ps,n->right)) return 0;
+	ps->prog[j].x=ps->insts;
+	return 1;
+    case RXN_REPEAT:
+	for(k=0;k<n->min;k++) {
+	    if (!rx_compile_node(ps,n->left)) return 0;
+	}
+	if (n->max<0) {
+	    if ((i=rx_emit(ps,RX_SPLIT))<0) return 0;
+	    ps->prog[i].x=i+1;
+	    if (!rx_compile_node(ps,n->left)) return 0;
+	    if ((j=rx_emit(ps,RX_JUMP))<0) return 0;
+	    ps->prog[j].x=i;
+	    ps->prog[i].y=ps->insts;
+	} else {
+	    /* Each optional copy can be skipped on its own */
+	    for(k=n->min;k<n->max;k++) {
+		if ((i=rx_emit(ps,RX_SPLIT))<0) return 0;
+		ps->prog[i].x=i+1;
+		if (!rx_compile_node(ps,n->left)) return 0;
+		ps->prog[i].y=ps->insts;
+	    }
+	}
+	return 1;
+    }
+    return 0;
+}
+
+/*
+ * Gives the byte of a set having a single byte, or both cases of
+ * a letter with -i. Otherwise -1
+ */
+static int rx_single_byte(struct RxParser *ps, const ByteSet *set) {
+    int b,n=0,c=-1;
+    for(b=0;b<256;b++) {
+	if (IN_SET(*set,b)) {
+	    n++;
+	    if (c<0) c=b;
+	}
+    }
+    if (n==1) return c;
+    if (n==2 && ps->ignore_case) {
+	b=(tolower(c)!=c) ? tolower(c) : toupper(c);
+	if (b!=c && (b&~0xff)==0 && IN_SET(*set,b)) return tolower(c);
+    }
+    return -1;
+}
+
+static void rx_end_literal(unsigned char *run, int *run_len,
+			   unsigned char *best, int *best_len) {
+    if (*run_len>*best_len) {
+	memcpy(best,run,*run_len);
+	*best_len=*run_len;
+    }
+    *run_len=0;
+}
+
+/*
+ * Finds the longest literal string every match of the node contains.
+ * Single byte sets following each other in concatenations make the
+ * literals.
+ */
+static void rx_literal(struct RxParser *ps, int node,
+		       unsigned char *run, int *run_len,
+		       unsigned char *best, int *best_len) {
+    struct RxNode *n=&ps->nodes[node];
+    unsigned char sub[RX_MAX_LITERAL];
+    int sub_len,c;
+
+    switch(n->type) {
+    case RXN_CAT:
+	rx_literal(ps,n->left,run,run_len,best,best_len);
+	rx_literal(ps,n->right,run,run_len,best,best_len);
+	break;
+    case RXN_SET:
+	c=rx_single_byte(ps,&n->set);
+	if (c<0 || *run_len==RX_MAX_LITERAL) {
+	    rx_end_literal(run,run_len,best,best_len);
+	}
+	if (c>=0) run[(*run_len)++]=c;
+	break;
+    case RXN_REPEAT:
+	rx_end_literal(run,run_len,best,best_len);
+	if (n->min>0) {
+	    sub_len=0;
+	    rx_literal(ps,n->left,sub,&sub_len,best,best_len);
+	    rx_end_literal(sub,&sub_len,best,best_len);
+	}
+	break;
+    case RXN_ALT:
+	rx_end_literal(run,run_len,best,best_len);
+	break;
+    default:
+	/* Empty and assertions match no bytes */
+	break;
+    }
+}
+
+/*
+ * Longest match of the node, or -1 if there is no limit
+ */
+static Offset rx_max_length(struct RxParser *ps, int node) {
+    struct RxNode *n=&ps->nodes[node];
+    Offset l,r;
+
+    switch(n->type) {
+    case RXN_SET:
+	return 1;
+    case RXN_CAT:
+    case RXN_ALT:
+	l=rx_max_length(ps,n->left);
+	r=rx_max_length(ps,n->right);
+	if (l<0 || r<0) return -1;
+	if (n->type==RXN_CAT) return l+r;
+	return (l>r) ? l : r;
+    case RXN_REPEAT:
+	l=rx_max_length(ps,n->left);
+	if (l==0 || n->max==0) return 0;
+	if (l<0 || n->max<0) return -1;
+	return l*n->max;
+    }
+    return 0;
+}
+
+/*
+ * Compiles pattern[0...len-1] to rx. Gives an error message, or NULL
+ * when all is well
+ */
+static const char *rx_compile(SgrepData *sgrep, struct Regex *rx,
+			      const unsigned char *pattern, int len,
+			      int ignore_case) {
+    struct RxParser ps;
+    unsigned char run[RX_MAX_LITERAL];
+    int root,run_len;
+
+    ps.sgrep=sgrep;
+    ps.p=pattern;
+    ps.end=pattern+len;
+    ps.ignore_case=ignore_case;
+    ps.error=NULL;
+    ps.max_nodes=4*len+8;
+    ps.nodes=(struct RxNode *)sgrep_malloc(sizeof(struct RxNode)*ps.max_nodes);
+    ps.n_nodes=0;
+    ps.prog=NULL;
+    ps.insts=0;
+    ps.prog_size=0;
+
+    root=rx_parse_alt(&ps);
+    if (root>=0 && ps.p<ps.end) {
+	ps.error="Unmatched ')' in regex";
+    }
+    if (!ps.error && rx_compile_node(&ps,root)) {
+	rx_emit(&ps,RX_MATCH);
+    }
+    if (!ps.error) {
+	run_len=0;
+	rx->literal_len=0;
+	rx_literal(&ps,root,run,&run_len,rx->literal,&rx->literal_len);
+	rx_end_literal(run,&run_len,rx->literal,&rx->literal_len);
+	rx->max_length=rx_max_length(&ps,root);
+	rx->prog=ps.prog;
+	rx->insts=ps.insts;
+    } else if (ps.prog) {
+	sgrep_free(ps.prog);
+    }
+    sgrep_free(ps.nodes);
+    return ps.error;
+}
+
+/*
+ * Checks the syntax of an expression. Gives an error message or NULL
+ */
+const char *check_regex(SgrepData *sgrep, const unsigned char *pattern,
+			int len) {
+    struct Regex rx;
+    const char *error;
+
+    error=rx_compile(sgrep,&rx,pattern,len,0);
+    if (!error) sgrep_free(rx.prog);
+    return error;
+}
+
+/*
+ * The lazy DFA
+ */
+
+static void rx_next_gen(unsigned int *mark, int n, unsigned int *gen) {
+    if (++(*gen)==0) {
+	memset(mark,0,sizeof(unsigned int)*n);
+	*gen=1;
+    }
+}
+
+/*
+ * Adds the RX_SET instructions reachable from pc to rx->work
+ */
+static void rx_closure(struct Regex *rx, int pc, int *n, int *matched) {
+    int sp=0;
+
+    rx->stack[sp++]=pc;
+    while(sp>0) {
+	pc=rx->stack[--sp];
+	if (rx->mark[pc]==rx->gen) continue;
+	rx->mark[pc]=rx->gen;
+	switch(rx->prog[pc].op) {
+	case RX_SET:
+	    rx->work[(*n)++]=pc;
+	    break;
+	case RX_MATCH:
+	    *matched=1;
+	    break;
+	case RX_SPLIT:
+	    rx->stack[sp++]=rx->prog[pc].y;
+	    rx->stack[sp++]=rx->prog[pc].x;
+	    break;
+	case RX_JUMP:
+	    rx->stack[sp++]=rx->prog[pc].x;
+	    break;
+	default:
+	    /* Assertions are taken to be true */
+	    rx->stack[sp++]=pc+1;
+	}
+    }
+}
+
+static int compare_ints(const void *a, const void *b) {
+    return *(const int *)a-*(const int *)b;
+}
+
+static void rx_flush_dfa(struct Regex *rx);
+
+/*
+ * Gives the DFA state of the set of n threads in rx->work, making
+ * it if there isn't one yet
+ */
+static int rx_dfa_state(struct Regex *rx, int n, int matched) {
+    SgrepData *sgrep=rx->sgrep;
+    unsigned int h;
+    int i,s,slot;
+
+    h=matched;
+    for(i=0;i<n;i++) h=h*31+rx->work[i];
+    slot=h&(2*RX_DFA_STATES-1);
+    while((s=rx->hash[slot])>=0) {
+	if (rx->set_len[s]==n &&
+	    (rx->flags[s]&RX_MATCHED)==(matched ? RX_MATCHED : 0) &&
+	    memcmp(rx->pool+rx->set_start[s],rx->work,sizeof(int)*n)==0) {
+	    return s;
+	}
+	slot=(slot+1)&(2*RX_DFA_STATES-1);
+    }
+    if (rx->states==RX_DFA_STATES) {
+	rx_flush_dfa(rx);
+	return rx_dfa_state(rx,n,matched);
+    }
+    if (rx->states==rx->max_states) {
+	rx->max_states*=2;
+	rx->delta=(int *)sgrep_realloc(
+	    rx->delta,sizeof(int)*rx->max_states*rx->classes);
+	rx->flags=(unsigned char *)sgrep_realloc(rx->flags,rx->max_states);
+	rx->set_start=(int *)sgrep_realloc(rx->set_start,
+					   sizeof(int)*rx->max_states);
+	rx->set_len=(int *)sgrep_realloc(rx->set_len,
+					 sizeof(int)*rx->max_states);
+    }
+    if (rx->pool_used+n>rx->pool_size) {
+	rx->pool_size=rx->pool_size*2+n;
+	rx->pool=(int *)sgrep_realloc(rx->pool,sizeof(int)*rx->pool_size);
+    }
+    s=rx->states++;
+    rx->built++;
+    for(i=0;i<rx->classes;i++) rx->delta[s*rx->classes+i]=-1;
+    rx->flags[s]=(matched ? RX_MATCHED : 0) | (n==0 ? RX_IDLE : 0);
+    rx->set_start[s]=rx->pool_used;
+    rx->set_len[s]=n;
+    memcpy(rx->pool+rx->pool_used,rx->work,sizeof(int)*n);
+    rx->pool_used+=n;
+    rx->hash[slot]=s;
+    return s;
+}
+
+/*
+ * Throws away all DFA states. State 0, the idle state, is made again
+ */
+static void rx_flush_dfa(struct Regex *rx) {
+    int i;
+    for(i=0;i<2*RX_DFA_STATES;i++) rx->hash[i]=-1;
+    rx->states=0;
+    rx->pool_used=0;
+    rx->flushes++;
+    rx_dfa_state(rx,0,0);
+}
+
+/*
+ * Builds the transition from state s with byte class c
+ */
+static int rx_transition(struct Regex *rx, int s, int c) {
+    int b=rx->class_byte[c];
+    int i,n,pc,matched,t,flushes;
+    const int *set;
+
+    rx_next_gen(rx->mark,rx->insts,&rx->gen);
+    n=matched=0;
+    set=rx->pool+rx->set_start[s];
+    for(i=0;i<rx->set_len[s];i++) {
+	pc=set[i];
+	if (IN_SET(rx->prog[pc].set,b)) rx_closure(rx,pc+1,&n,&matched);
+    }
+    /* The threads starting at this byte */
+    for(i=0;i<rx->start_len;i++) {
+	pc=rx->start_set[i];
+	if (IN_SET(rx->prog[pc].set,b)) rx_closure(rx,pc+1,&n,&matched);
+    }
+    qsort(rx->work,n,sizeof(int),compare_ints);
+    flushes=rx->flushes;
+    t=rx_dfa_state(rx,n,matched);
+    /* Unless the states were flushed, s is still there */
+    if (rx->flushes==flushes) rx->delta[s*rx->classes+c]=t;
+    return t;
+}
+
+/*
+ * The NFA simulation
+ */
+
+static void rx_clear_threads(struct Regex *rx, struct RxThreads *l) {
+    l->n=0;
+    rx_next_gen(l->mark,rx->insts,&l->gen);
+}
+
+/*
+ * Adds a thread at pc and the threads reachable from it at position
+ * pos of buf[0...len-1]
+ */
+static void rx_add_thread(struct Regex *rx, struct RxThreads *l, int pc,
+			  Offset start, const unsigned char *buf,
+			  Offset len, Offset pos) {
+    int sp=0;
+
+    rx->stack[sp++]=pc;
+    while(sp>0) {
+	pc=rx->stack[--sp];
+	if (l->mark[pc]==l->gen) continue;
+	l->mark[pc]=l->gen;
+	switch(rx->prog[pc].op) {
+	case RX_SET:
+	case RX_MATCH:
+	    l->pc[l->n]=pc;
+	    l->start[l->n++]=start;
+	    break;
+	case RX_SPLIT:
+	    rx->stack[sp++]=rx->prog[pc].y;
+	    rx->stack[sp++]=rx->prog[pc].x;
+	    break;
+	case RX_JUMP:
+	    rx->stack[sp++]=rx->prog[pc].x;
+	    break;
+	case RX_BOL:
+	    if (pos==0 || buf[pos-1]=='\n') rx->stack[sp++]=pc+1;
+	    break;
+	case RX_EOL:
+	    if (pos==len || buf[pos]=='\n') rx->stack[sp++]=pc+1;
+	    break;
+	}
+    }
+}
+
+/*
+ * Adds the leftmost longest matches starting from buf[from...to],
+ * a segment of the file buf[0...len-1] starting at offset base
+ */
+static void rx_verify(struct Regex *rx, const unsigned char *buf, Offset len,
+		      Offset from, Offset to, Offset base) {
+    struct RxThreads *cl,*nl,*tmp;
+    Offset i,best_start,best_end;
+    int k,pc;
+
+    rx->verified+=to-from+1;
+    while(from<=to) {
+	best_start=best_end=-1;
+	cl=&rx->threads[0];
+	nl=&rx->threads[1];
+	rx_clear_threads(rx,cl);
+	for(i=from;;i++) {
+	    /* New threads are started until a match is found. They
+	     * come last, so the list stays in the order of start */
+	    if (best_start<0 && i<=to) {
+		rx_add_thread(rx,cl,0,i,buf,len,i);
+	    }
+	    if (cl->n==0) break;
+	    rx_clear_threads(rx,nl);
+	    for(k=0;k<cl->n;k++) {
+		/* Threads starting after the best match can't beat it */
+		if (best_start>=0 && cl->start[k]>best_start) break;
+		pc=cl->pc[k];
+		if (rx->prog[pc].op==RX_MATCH) {
+		    if (i>cl->start[k] &&
+			(best_start<0 || cl->start[k]<=best_start)) {
+			best_start=cl->start[k];
+			best_end=i-1;
+		    }
+		} else if (i<len && IN_SET(rx->prog[pc].set,buf[i])) {
+		    rx_add_thread(rx,nl,pc+1,cl->start[k],buf,len,i+1);
+		}
+	    }
+	    tmp=cl;
+	    cl=nl;
+	    nl=tmp;
+	}
+	if (best_start<0) break;
+	add_region(rx->phrase->regions,base+best_start,base+best_end);
+	rx->found++;
+	from=best_end+1;
+    }
+}
+
+/*
+ * Prefilters
+ */
+
+/*
+ * Gives the next occurrence of the literal in buf[from...len-1], or
+ * len if there is none
+ */
+static Offset rx_find_literal(RegexScanner *scanner, struct Regex *rx,
+			      const unsigned char *buf, Offset from,
+			      Offset len) {
+    const unsigned char *p;
+    Offset last=len-rx->literal_len;
+    int i;
+
+    while(from<=last) {
+	if (rx->literal_firsts==1) {
+	    p=memchr(buf+from,rx->literal_first[0],last-from+1);
+	    if (!p) return len;
+	    from=p-buf;
+	} else {
+	    from+=scanner->byte_kernel->find_bytes(
+		buf+from,last-from+1,rx->literal_first,2);
+	    if (from>last) return len;
+	}
+	if (scanner->ignore_case) {
+	    for(i=1;i<rx->literal_len &&
+		    tolower(buf[from+i])==rx->literal[i];i++);
+	} else {
+	    for(i=1;i<rx->literal_len && buf[from+i]==rx->literal[i];i++);
+	}
+	if (i==rx->literal_len) return from;
+	from++;
+    }
+    return len;
+}
+
+/*
+ * Skips from i to where the next match could start, while the DFA is
+ * idle. Gives len, if there are no matches in the rest of the buffer
+ */
+static Offset rx_skip(RegexScanner *scanner, struct Regex *rx,
+		      const unsigned char *buf, Offset i, Offset len) {
+    Offset from=i;
+
+    if (rx->literal_len) {
+	if (rx->literal_at<i) {
+	    rx->literal_at=rx_find_literal(scanner,rx,buf,i,len);
+	}
+	if (rx->literal_at>=len) return len;
+	if (rx->max_length>=0 &&
+	    rx->literal_at-(rx->max_length-rx->literal_len)>i) {
+	    i=rx->literal_at-(rx->max_length-rx->literal_len);
+	}
+    }
+    if (rx->skip_bytes) {
+	if (rx->first_bytes==1) {
+	    const unsigned char *p=memchr(buf+i,rx->start_byte[0],len-i);
+	    i=(p) ? (Offset)(p-buf) : len;
+	} else if (rx->first_bytes<=BYTE_KERNEL_MAX_SET) {
+	    i+=scanner->byte_kernel->find_bytes(buf+i,len-i,rx->start_byte,
+						rx->first_bytes);
+	} else {
+	    while(i<len && !rx->first[buf[i]]) i++;
+	}
+	/* Give up skipping, if it does not skip enough */
+	rx->candidates++;
+	if ((rx->candidates&1023)==0 &&
+	    rx->skipped+i-from<(Offset)rx->candidates*16) {
+	    rx->skip_bytes=0;
+	}
+    }
+    rx->skipped+=i-from;
+    return i;
+}
+
+static void rx_scan(RegexScanner *scanner, struct Regex *rx,
+		    const unsigned char *buf, Offset len, Offset start) {
+    Offset i=0,segment=0;
+    int s=0,t;
+    int matched=0;
+
+    rx->literal_at=-1;
+    while(i<len) {
+	if (s==0) {
+	    i=rx_skip(scanner,rx,buf,i,len);
+	    if (i>=len) break;
+	    segment=i;
+	}
+	t=rx->delta[s*rx->classes+rx->byte_class[buf[i]]];
+	if (t<0) t=rx_transition(rx,s,rx->byte_class[buf[i]]);
+	s=t;
+	i++;
+	if (rx->flags[s]) {
+	    if (rx->flags[s]&RX_MATCHED) matched=1;
+	    if (rx->flags[s]&RX_IDLE) {
+		if (matched) rx_verify(rx,buf,len,segment,i-1,start);
+		matched=0;
+		s=0;
+	    }
+	}
+    }
+    if (matched) rx_verify(rx,buf,len,segment,len-1,start);
+}
+
+/*
+ * Builds the parts of the DFA needed before scanning
+ */
+static void rx_init_dfa(SgrepData *sgrep, struct Regex *rx) {
+    int map[512];
+    unsigned char new_class[256];
+    int pc,b,n,k,matched;
+
+    /* Bytes are in the same class, when all sets have both or neither */
+    memset(rx->byte_class,0,sizeof(rx->byte_class));
+    rx->classes=1;
+    for(pc=0;pc<rx->insts && rx->classes<256;pc++) {
+	if (rx->prog[pc].op!=RX_SET) continue;
+	for(k=0;k<512;k++) map[k]=-1;
+	n=0;
+	for(b=0;b<256;b++) {
+	    k=rx->byte_class[b]*2+(IN_SET(rx->prog[pc].set,b) ? 1 : 0);
+	    if (map[k]<0) map[k]=n++;
+	    new_class[b]=map[k];
+	}
+	memcpy(rx->byte_class,new_class,sizeof(new_class));
+	rx->classes=n;
+    }
+    for(b=255;b>=0;b--) rx->class_byte[rx->byte_class[b]]=b;
+
+    rx->work=(int *)sgrep_malloc(sizeof(int)*rx->insts);
+    rx->stack=(int *)sgrep_malloc(sizeof(int)*(2*rx->insts+2));
+    rx->mark=(unsigned int *)sgrep_malloc(sizeof(unsigned int)*rx->insts);
+    memset(rx->mark,0,sizeof(unsigned int)*rx->insts);
+    rx->gen=0;
+    for(k=0;k<2;k++) {
+	rx->threads[k].pc=(int *)sgrep_malloc(sizeof(int)*rx->insts);
+	rx->threads[k].start=(Offset *)sgrep_malloc(sizeof(Offset)*rx->insts);
+	rx->threads[k].mark=(unsigned int *)
+	    sgrep_malloc(sizeof(unsigned int)*rx->insts);
+	memset(rx->threads[k].mark,0,sizeof(unsigned int)*rx->insts);
+	rx->threads[k].gen=0;
+	rx->threads[k].n=0;
+    }
+
+    /* Where the threads starting at every byte are */
+    rx_next_gen(rx->mark,rx->insts,&rx->gen);
+    n=matched=0;
+    rx_closure(rx,0,&n,&matched);
+    rx->start_set=(int *)sgrep_malloc(sizeof(int)*(n+1));
+    memcpy(rx->start_set,rx->work,sizeof(int)*n);
+    rx->start_len=n;
+
+    /* Bytes matches can start with */
+    memset(rx->first,0,sizeof(rx->first));
+    rx->first_bytes=0;
+    for(b=0;b<256;b++) {
+	for(k=0;k<rx->start_len;k++) {
+	    if (IN_SET(rx->prog[rx->start_set[k]].set,b)) {
+		rx->first[b]=1;
+		if (rx->first_bytes<BYTE_KERNEL_MAX_SET) {
+		    rx->start_byte[rx->first_bytes]=b;
+		}
+		rx->first_bytes++;
+		break;
+	    }
+	}
+    }
+    rx->skip_bytes=(rx->first_bytes<128);
+    rx->candidates=0;
+    if (rx->literal_len<2) rx->literal_len=0;
+    if (rx->literal_len) {
+	rx->literal_first[0]=rx->literal[0];
+	rx->literal_first[1]=(sgrep->ignore_case) ?
+	    toupper(rx->literal[0]) : rx->literal[0];
+	rx->literal_firsts=(rx->literal_first[0]==rx->literal_first[1]) ?
+	    1 : 2;
+    }
+
+    rx->max_states=64;
+    rx->delta=(int *)sgrep_malloc(sizeof(int)*rx->max_states*rx->classes);
+    rx->flags=(unsigned char *)sgrep_malloc(rx->max_states);
+    rx->set_start=(int *)sgrep_malloc(sizeof(int)*rx->max_states);
+    rx->set_len=(int *)sgrep_malloc(sizeof(int)*rx->max_states);
+    rx->pool_size=256;
+    rx->pool=(int *)sgrep_malloc(sizeof(int)*rx->pool_size);
+    rx->hash=(int *)sgrep_malloc(sizeof(int)*2*RX_DFA_STATES);
+    rx->built=rx->flushes=0;
+    rx->skipped=rx->verified=0;
+    rx->found=0;
+    rx_flush_dfa(rx);
+    rx->flushes=0;
+}
+
+/*
+ * Makes a scanner for the regex phrases of phrase_list
+ */
+RegexScanner *new_regex_scanner(SgrepData *sgrep,
+				struct PHRASE_NODE *phrase_list) {
+    RegexScanner *scanner;
+    struct PHRASE_NODE *pn;
+    const char *error;
+    int n;
+
+    scanner=sgrep_new(RegexScanner);
+    scanner->sgrep=sgrep;
+    scanner->byte_kernel=select_byte_kernel();
+    scanner->ignore_case=sgrep->ignore_case;
+    n=0;
+    for(pn=phrase_list;pn!=NULL;pn=pn->next) {
+	if (pn->phrase->s[0]=='r') n++;
+    }
+    scanner->rx=(struct Regex *)sgrep_malloc(sizeof(struct Regex)*(n+1));
+    scanner->n=0;
+    for(pn=phrase_list;pn!=NULL;pn=pn->next) {
+	struct Regex *rx=&scanner->rx[scanner->n];
+	if (pn->phrase->s[0]!='r') continue;
+	error=rx_compile(sgrep,rx,(const unsigned char *)pn->phrase->s+1,
+			 pn->phrase->length-1,sgrep->ignore_case);
+	if (error) {
+	    /* The parser has checked them already */
+	    sgrep_error(sgrep,"%s: %s\n",error,pn->phrase->s+1);
+	    continue;
+	}
+	rx->sgrep=sgrep;
+	rx->phrase=pn;
+	rx_init_dfa(sgrep,rx);
+	scanner->n++;
+    }
+    return scanner;
+}
+
+/*
+ * Scans buf[0...len-1], which is a whole file starting at offset start
+ */
+void regex_scan(RegexScanner *scanner, const unsigned char *buf, Offset len,
+		Offset start) {
+    int i;
+    for(i=0;i<scanner->n;i++) {
+	rx_scan(scanner,&scanner->rx[i],buf,len,start);
+    }
+}
+
+void delete_regex_scanner(RegexScanner *scanner) {
+    SGREPDATA(scanner);
+    struct Regex *rx;
+    int i,k;
+
+    for(i=0;i<scanner->n;i++) {
+	rx=&scanner->rx[i];
+	sgrep_lock(sgrep);
+	stats.regex_dfa_states+=rx->built;
+	stats.regex_dfa_flushes+=rx->flushes;
+	stats.regex_skipped+=rx->skipped;
+	stats.regex_verified+=rx->verified;
+	stats.phrases+=rx->found;
+	sgrep_unlock(sgrep);
+	sgrep_free(rx->prog);
+	sgrep_free(rx->work);
+	sgrep_free(rx->stack);
+	sgrep_free(rx->mark);
+	for(k=0;k<2;k++) {
+	    sgrep_free(rx->threads[k].pc);
+	    sgrep_free(rx->threads[k].start);
+	    sgrep_free(rx->threads[k].mark);
+	}
+	sgrep_free(rx->start_set);
+	sgrep_free(rx->delta);
+	sgrep_free(rx->flags);
+	sgrep_free(rx->set_start);
+	sgrep_free(rx->set_len);
+	sgrep_free(rx->pool);
+	sgrep_free(rx->hash);
+    }
+    sgrep_free(scanner->rx);
+    sgrep_free(scanner);
+}
@@ -97,15 +97,20 @@ enum SGMLState { SGML_PCDATA, SGML_WORD,
 		 SGML_ATTLIST_DECLARATION,
 		 SGML_NOTATION_DECLARATION,
 		 SGML_DOCTYPE_END,
-		 SGML_RESERVED_WORD
+		 SGML_RESERVED_WORD,
+		 SGML_N_STATES	/* Not a state, the number of them */
                 };
+/* States whose runs of ASCII sgml_scan() skips, see make_run_classes() */
+#define SGML_RUN_STATES 9
 
-typedef struct ElementStackStruct {
-    char *gi;
-    int start;
-    int end;
-    struct ElementStackStruct *prev;
-} ElementStack;
+/*
+ * An element on the element stack. The name is interned, see intern_gi()
+ */
+typedef struct {
+    int gi;
+    Offset start;
+    Offset end;
+} OpenElement;
 
 enum EncoderState { 
     EIGHT_BIT, 
@@ -119,9 +124,39 @@ typedef struct EncoderStruct {
     enum EncoderState estate;
     int char1;
     int char2;
-    int prev;
+    Offset prev;
 } Encoder;
 
+/*
+ * Dictionary of the phrases for the phrase scanner. Exact phrases are
+ * in a hash table. Wildcard phrases (ending with '*') are in a trie
+ * of their prefixes, whose edges are found from a hash table too. So
+ * finding the phrases matching a token costs the length of the token,
+ * however many phrases there are
+ */
+struct PhraseEntry {
+    const char *s;
+    unsigned int hash;
+    struct PHRASE_NODE *phrase;
+    int next;		/* Next in the same bucket or trie node, or -1 */
+};
+
+struct PrefixNode {
+    int parent;
+    int ch;
+    int phrases;	/* Wildcard phrases having this prefix, or -1 */
+};
+
+typedef struct PhraseDictStruct {
+    struct PhraseEntry *entries;
+    int *buckets;	/* First exact entry with the hash */
+    unsigned int bucket_mask;
+    struct PrefixNode *nodes; /* Node 0 is the empty prefix */
+    int n_nodes;
+    int *edges;		/* Child nodes hashed by parent and byte */
+    unsigned int edge_mask;
+} PhraseDict;
+
 
 struct SGMLScannerStruct {
     SgrepData *sgrep;
@@ -140,50 +175,72 @@ struct SGMLScannerStruct {
     int ignore_case;
     int include_system_entities;
 
+    /* Token types wanted by entry(), by the first byte of their key */
+    unsigned char wanted[256];
+
+    /* Skipping runs of ASCII text, see sgml_scan() */
+    const ClassKernel *class_kernel;
+    ByteClass run_classes[SGML_RUN_STATES];
+    ByteClass *run_end[SGML_N_STATES];	/* Bytes ending a run, or NULL */
+    SgrepString *run_term[SGML_N_STATES]; /* Where the run goes, or NULL */
+    Offset skipped;
+
     /* Maintaining the element stack */
     int maintain_element_stack;
-    ElementStack *top;
+    OpenElement *elements;	/* Innermost element last */
+    int depth;
+    int max_depth;
     RegionList *element_list;
+
+    /* Interned element names */
+    char **gi_names;		/* Names by id */
+    unsigned int *gi_hashes;	/* Their hashes by id */
+    int n_gis;
+    int *gi_buckets;		/* Ids by hash, -1 for none */
+    unsigned int gi_mask;
     
     /* Scanner state */
     int parse_errors;
     struct PHRASE_NODE *phrase_list;
-    int words;
-    int word_end;
+    PhraseDict *dict;
+    Offset words;
+    Offset word_end;
     SgrepString *word;
+    const unsigned char *word_text; /* Word still in the input buffer
+				     * or NULL, see sgml_scan() */
 
     /* Start and end tag */
-    int tags;
+    Offset tags;
     SgrepString *gi;
 
     /* Attributes */
-    int anames;
+    Offset anames;
     SgrepString *aname;
-    int avals;
+    Offset avals;
     SgrepString *aval;
 
     /* Comments */
-    int comments;
-    int comment_words;
+    Offset comments;
+    Offset comment_words;
     SgrepString *comment_word;
 
-    int markeds;
+    Offset markeds;
     
-    int doctypes;
-    int doctype_declarations;
-    int internal_declarations;
+    Offset doctypes;
+    Offset doctype_declarations;
+    Offset internal_declarations;
 
     int entity_has_systemid;
     int entity_is_ndata;
-    int entitys; /* Start of entity reference */
+    Offset entitys; /* Start of entity reference */
     int character_reference;
 
     SgrepString *name;
 
-    int name2s;
+    Offset name2s;
     SgrepString *name2;
     
-    int literals;
+    Offset literals;
     SgrepString *literal;
 
     int publici;
@@ -200,7 +257,12 @@ struct SGMLScannerStruct {
     int state_stack_ptr;
 
     void (*entry)(struct SGMLScannerStruct *state,
-		  const char *str, int start, int end);
+		  const char *str, Offset start, Offset end);
+    /* Takes the words which are plain ASCII in the input buffer
+     * without making a key of them, or NULL */
+    void (*word_entry)(struct SGMLScannerStruct *state,
+		       const unsigned char *text, int len,
+		       Offset start, Offset end);
     void *data;
 
     int failed;
@@ -375,30 +437,173 @@ void character_list_add(CharacterList *a,const char *l) {
     }
 }
 
-void pop_elements_to(SGMLScanner *state,
-			    struct ElementStackStruct *p);
+void pop_elements_to(SGMLScanner *state, int depth);
 
 
-/* FIXME: needs hashing for speed */
-void sgml_add_entry_to_gclist(SGMLScanner *state,
-			      const char *phrase,int start, int end) {
-    struct PHRASE_NODE *n;
-    for(n=state->phrase_list;n!=NULL;n=n->next) {
-	if (n->phrase->s[n->phrase->length-1]=='*') {
-	    /* Wildcard */
-	    if (strncmp(n->phrase->s,phrase,n->phrase->length-1)==0) {
-		add_region(n->regions,start,end);
-	    
+#define PHRASE_HASH_START 2166136261U
+#define PHRASE_HASH(H,CH) (((H)^(CH))*16777619U)
+#define PREFIX_EDGE_HASH(PARENT,CH) ((unsigned int)(PARENT)*257U+(CH))
+
+static int prefix_child(PhraseDict *d, int parent, int ch) {
+    unsigned int h=PREFIX_EDGE_HASH(parent,ch)&d->edge_mask;
+    int c;
+    while((c=d->edges[h])>=0) {
+	if (d->nodes[c].parent==parent && d->nodes[c].ch==ch) return c;
+	h=(h+1)&d->edge_mask;
+    }
+    return -1;
+}
+
+static unsigned int table_size(int n) {
+    unsigned int size=16;
+    while(size<2*(unsigned int)n) size*=2;
+    return size;
+}
+
+PhraseDict *new_phrase_dict(SgrepData *sgrep, struct PHRASE_NODE *list) {
+    PhraseDict *d;
+    struct PHRASE_NODE *pn;
+    const unsigned char *p;
+    int n_phrases,max_nodes,e,node,c;
+    unsigned int h,size;
+
+    n_phrases=0;
+    max_nodes=1;
+    for(pn=list;pn!=NULL;pn=pn->next) {
+	n_phrases++;
+	if (pn->phrase->s[pn->phrase->length-1]=='*') {
+	    max_nodes+=pn->phrase->length-1;
+	}
+    }
+    d=sgrep_new(PhraseDict);
+    d->entries=(struct PhraseEntry *)
+	sgrep_malloc(sizeof(struct PhraseEntry)*(n_phrases+1));
+    size=table_size(n_phrases);
+    d->buckets=(int *)sgrep_malloc(sizeof(int)*size);
+    d->bucket_mask=size-1;
+    for(h=0;h<size;h++) d->buckets[h]=-1;
+    d->nodes=(struct PrefixNode *)
+	sgrep_malloc(sizeof(struct PrefixNode)*max_nodes);
+    size=table_size(max_nodes);
+    d->edges=(int *)sgrep_malloc(sizeof(int)*size);
+    d->edge_mask=size-1;
+    for(h=0;h<size;h++) d->edges[h]=-1;
+    d->nodes[0].parent=-1;
+    d->nodes[0].ch=-1;
+    d->nodes[0].phrases=-1;
+    d->n_nodes=1;
+
+    for(pn=list,e=0;pn!=NULL;pn=pn->next,e++) {
+	d->entries[e].s=pn->phrase->s;
+	d->entries[e].phrase=pn;
+	if (pn->phrase->s[pn->phrase->length-1]=='*') {
+	    /* Wildcard: the prefix before '*' into the trie */
+	    node=0;
+	    for(p=(const unsigned char *)pn->phrase->s;
+		p<(const unsigned char *)pn->phrase->s+pn->phrase->length-1;
+		p++) {
+		c=prefix_child(d,node,*p);
+		if (c<0) {
+		    c=d->n_nodes++;
+		    d->nodes[c].parent=node;
+		    d->nodes[c].ch=*p;
+		    d->nodes[c].phrases=-1;
+		    h=PREFIX_EDGE_HASH(node,*p)&d->edge_mask;
+		    while(d->edges[h]>=0) h=(h+1)&d->edge_mask;
+		    d->edges[h]=c;
+		}
+		node=c;
+	    }
+	    d->entries[e].hash=0;
+	    d->entries[e].next=d->nodes[node].phrases;
+	    d->nodes[node].phrases=e;
+	} else {
+	    h=PHRASE_HASH_START;
+	    for(p=(const unsigned char *)pn->phrase->s;*p;p++) {
+		h=PHRASE_HASH(h,*p);
+	    }
+	    d->entries[e].hash=h;
+	    d->entries[e].next=d->buckets[h&d->bucket_mask];
+	    d->buckets[h&d->bucket_mask]=e;
+	}
+    }
+    return d;
+}
+
+void delete_phrase_dict(SgrepData *sgrep, PhraseDict *d) {
+    sgrep_free(d->entries);
+    sgrep_free(d->buckets);
+    sgrep_free(d->nodes);
+    sgrep_free(d->edges);
+    sgrep_free(d);
+}
+
+/*
+ * Adds the region to the phrases matching the token whose key is the
+ * type character followed by text[0..len-1], lowercased if fold is
+ * set. The key is hashed and walked down the prefix trie at the same
+ * time, and compared to the phrases without making it
+ */
+static void add_token_to_gclist(SGMLScanner *state, int type,
+				const unsigned char *text, int len, int fold,
+				Offset start, Offset end) {
+    PhraseDict *d=state->dict;
+    const unsigned char *s;
+    unsigned int h=PHRASE_HASH(PHRASE_HASH_START,type);
+    int node=0,e,k,ch;
+
+    if (d->n_nodes==1 && d->nodes[0].phrases<0) {
+	/* No wildcard phrases */
+	node=-1;
+    } else {
+	for(e=d->nodes[0].phrases;e>=0;e=d->entries[e].next) {
+	    add_region(d->entries[e].phrase->regions,start,end);
+	}
+	node=prefix_child(d,0,type);
+	if (node>=0) {
+	    for(e=d->nodes[node].phrases;e>=0;e=d->entries[e].next) {
+		add_region(d->entries[e].phrase->regions,start,end);
+	    }
+	}
+    }
+    for(k=0;k<len;k++) {
+	ch=fold ? tolower(text[k]) : text[k];
+	h=PHRASE_HASH(h,ch);
+	if (node>=0 && (node=prefix_child(d,node,ch))>=0) {
+	    for(e=d->nodes[node].phrases;e>=0;e=d->entries[e].next) {
+		add_region(d->entries[e].phrase->regions,start,end);
 	    }
-	} else if (strcmp(n->phrase->s,phrase)==0) {
-	    add_region(n->regions,start,end);
 	}
     }
+    for(e=d->buckets[h&d->bucket_mask];e>=0;e=d->entries[e].next) {
+	if (d->entries[e].hash!=h) continue;
+	s=(const unsigned char *)d->entries[e].s;
+	if (s[0]!=type) continue;
+	for(k=0;k<len;k++) {
+	    if (s[k+1]!=(fold ? tolower(text[k]) : text[k])) break;
+	}
+	if (k==len && s[len+1]==0) {
+	    add_region(d->entries[e].phrase->regions,start,end);
+	}
+    }
+}
+
+void sgml_add_entry_to_gclist(SGMLScanner *state,
+			      const char *phrase,Offset start, Offset end) {
+    add_token_to_gclist(state,(unsigned char)phrase[0],
+			(const unsigned char *)phrase+1,strlen(phrase+1),0,
+			start,end);
+}
+
+void sgml_add_word_to_gclist(SGMLScanner *state,
+			     const unsigned char *text, int len,
+			     Offset start, Offset end) {
+    add_token_to_gclist(state,'w',text,len,state->ignore_case,start,end);
 }
 
 void sgml_add_entry_to_index(SGMLScanner *state,
 			     const char *phrase,
-			     int start, int end) {
+			     Offset start, Offset end) {
     if (phrase[0]=='@') {
 	add_region(state->element_list,start,end);
     } else {
@@ -439,8 +644,104 @@ void reset_encoder(SGMLScanner *sgmls, Encoder *encoder) {
     encoder->prev=-1;
 }
 
+/*
+ * Builds the classes of bytes which end the runs of ASCII sgml_scan()
+ * can skip. In text, comments and CDATA sections only the markup and
+ * word characters do something, and the word characters only when
+ * words are wanted. Inside words, attribute values and processing
+ * instructions every byte but the ending ones is just added to a term.
+ */
+static void make_run_classes(SGMLScanner *scanner) {
+    SGREPDATA(scanner);
+    static const enum SGMLState run_states[SGML_RUN_STATES]={
+	SGML_PCDATA, SGML_WORD,
+	SGML_COMMENT, SGML_COMMENT_WORD,
+	SGML_CDATA_MARKED_SECTION, SGML_CDATA_MARKED_SECTION_WORD,
+	SGML_ATTVALUE_DQUOTED, SGML_ATTVALUE_SQUOTED,
+	SGML_PI };
+    unsigned char member[256];
+    int b,k,word;
+
+    scanner->skipped=0;
+    for(k=0;k<SGML_N_STATES;k++) {
+	scanner->run_end[k]=NULL;
+	scanner->run_term[k]=NULL;
+    }
+    if (sgrep->sgml_no_fast_scan) {
+	scanner->class_kernel=NULL;
+	return;
+    }
+    scanner->class_kernel=select_class_kernel();
+    for(k=0;k<SGML_RUN_STATES;k++) {
+	for(b=0;b<256;b++) {
+	    word=IN_CLIST(scanner->word_chars,b);
+	    switch(run_states[k]) {
+	    case SGML_PCDATA:
+		member[b]=(b=='<' || b=='&' || (word && scanner->wanted['w']));
+		break;
+	    case SGML_WORD:
+		member[b]=(b=='<' || !word);
+		break;
+	    case SGML_COMMENT:
+		member[b]=(b=='-' || (word && scanner->wanted['c']));
+		break;
+	    case SGML_COMMENT_WORD:
+		member[b]=(b=='-' || !word);
+		break;
+	    case SGML_CDATA_MARKED_SECTION:
+		member[b]=(b==']' || (word && scanner->wanted['w']));
+		break;
+	    case SGML_CDATA_MARKED_SECTION_WORD:
+		member[b]=(b==']' || !word);
+		break;
+	    case SGML_ATTVALUE_DQUOTED:
+		member[b]=(b=='\"');
+		break;
+	    case SGML_ATTVALUE_SQUOTED:
+		member[b]=(b=='\'');
+		break;
+	    case SGML_PI:
+		member[b]=(b==(scanner->type==XML_SCANNER ? '?' : '>'));
+		break;
+	    default:
+		assert(0);
+	    }
+	}
+	make_byte_class(&scanner->run_classes[k],member);
+	scanner->run_end[run_states[k]]=&scanner->run_classes[k];
+    }
+    scanner->run_term[SGML_WORD]=scanner->word;
+    scanner->run_term[SGML_COMMENT_WORD]=scanner->comment_word;
+    scanner->run_term[SGML_CDATA_MARKED_SECTION_WORD]=scanner->word;
+    scanner->run_term[SGML_ATTVALUE_DQUOTED]=scanner->aval;
+    scanner->run_term[SGML_ATTVALUE_SQUOTED]=scanner->aval;
+    scanner->run_term[SGML_PI]=scanner->pi;
+}
+
+/*
+ * Looks at the first bytes of the phrase keys to see which token types
+ * the query can use, so that the scanner can skip the rest: words,
+ * comment words and the element stack cost the most when not needed.
+ * A raw("*") phrase matches every token.
+ */
+static void set_wanted_tokens(SGMLScanner *scanner, struct PHRASE_NODE *list) {
+    int b;
+    const unsigned char *key;
+
+    for(b=0;b<256;b++) scanner->wanted[b]=0;
+    for(;list;list=list->next) {
+	key=(const unsigned char *)string_to_char(list->phrase);
+	if (list->phrase->length==1 && key[0]=='*') {
+	    for(b=0;b<256;b++) scanner->wanted[b]=1;
+	    break;
+	}
+	scanner->wanted[key[0]]=1;
+    }
+}
+
 SGMLScanner *new_sgml_scanner_common(SgrepData *sgrep, FileList *file_list) {
     SGMLScanner *scanner;
+    int i;
     scanner=sgrep_new(SGMLScanner);
     scanner->sgrep=sgrep;
     scanner->file_list=file_list;
@@ -448,8 +749,22 @@ SGMLScanner *new_sgml_scanner_common(SgrepData *sgrep, FileList *file_list) {
     scanner->state_stack_ptr=0;
 
     scanner->maintain_element_stack=1;
-    scanner->top=NULL;
+    scanner->max_depth=64;
+    scanner->elements=(OpenElement *)
+	sgrep_malloc(sizeof(OpenElement)*scanner->max_depth);
+    scanner->depth=0;
     scanner->element_list=NULL;
+    scanner->gi_mask=63;
+    scanner->gi_buckets=(int *)sgrep_malloc(sizeof(int)*(scanner->gi_mask+1));
+    for(i=0;i<=(int)scanner->gi_mask;i++) scanner->gi_buckets[i]=-1;
+    scanner->gi_names=(char **)
+	sgrep_malloc(sizeof(char *)*(scanner->gi_mask+1)/2);
+    scanner->gi_hashes=(unsigned int *)
+	sgrep_malloc(sizeof(unsigned int)*(scanner->gi_mask+1)/2);
+    scanner->n_gis=0;
+    scanner->dict=NULL;
+    scanner->word_text=NULL;
+    scanner->word_entry=NULL;
 
     scanner->word_chars=new_character_list(sgrep);
     switch(sgrep->scanner_type) {
@@ -483,6 +798,7 @@ SGMLScanner *new_sgml_scanner_common(SgrepData *sgrep, FileList *file_list) {
 	character_list_add(scanner->word_chars,XML_Ideographic);
     }
     scanner->parse_errors=0;
+    for(i=0;i<256;i++) scanner->wanted[i]=1;
 
     scanner->type=sgrep->scanner_type;
     scanner->ignore_case=sgrep->ignore_case;
@@ -505,6 +821,7 @@ SGMLScanner *new_sgml_scanner_common(SgrepData *sgrep, FileList *file_list) {
     scanner->pi=new_string(sgrep,MAX_TERM_SIZE);
     TERM_PUSH(scanner->pi,'?');
     scanner->failed=0;
+    make_run_classes(scanner);
 
     reset_encoder(scanner,&scanner->encoder);
     return scanner;
@@ -516,7 +833,14 @@ SGMLScanner *new_sgml_phrase_scanner(SgrepData *sgrep,
     SGMLScanner *scanner;
     scanner=new_sgml_scanner_common(sgrep,file_list);
     scanner->phrase_list=list;
+    scanner->dict=new_phrase_dict(sgrep,list);
     scanner->entry=sgml_add_entry_to_gclist;
+    if (!sgrep->sgml_debug) {
+	scanner->word_entry=sgml_add_word_to_gclist;
+	set_wanted_tokens(scanner,list);
+	scanner->maintain_element_stack=scanner->wanted['@'];
+	make_run_classes(scanner);
+    }
     scanner->data=NULL;
     return scanner;
 }
@@ -528,7 +852,7 @@ SGMLScanner *new_sgml_index_scanner(SgrepData *sgrep,
     SGMLScanner *scanner;
     scanner=new_sgml_scanner_common(sgrep,file_list);
     scanner->phrase_list=NULL;
-    scanner->element_list=new_region_list(sgrep);
+    scanner->element_list=new_contiguous_region_list(sgrep);
     list_set_sorted(scanner->element_list,NOT_SORTED);
     scanner->element_list->nested=1;
     scanner->entry=sgml_add_entry_to_index;
@@ -538,8 +862,21 @@ SGMLScanner *new_sgml_index_scanner(SgrepData *sgrep,
 
 void delete_sgml_scanner(SGMLScanner *s) {
     SgrepData *sgrep=s->sgrep;
+    int i;
     /* Empty the element stack if there is one */
-    pop_elements_to(s,NULL);
+    pop_elements_to(s,0);
+    sgrep_free(s->elements);
+    for(i=0;i<s->n_gis;i++) sgrep_free(s->gi_names[i]);
+    sgrep_free(s->gi_names);
+    sgrep_free(s->gi_hashes);
+    sgrep_free(s->gi_buckets);
+    if (s->class_kernel) {
+	sgrep_lock(sgrep);
+	stats.sgml_kernel=s->class_kernel->name;
+	stats.sgml_skipped+=s->skipped;
+	sgrep_unlock(sgrep);
+    }
+    if (s->dict) delete_phrase_dict(sgrep,s->dict);
     if (s->element_list) {
 	delete_region_list(s->element_list);
     }
@@ -572,25 +909,65 @@ enum SGMLState pop_state(SGMLScanner *scanner) {
 
 
 #define SGML_ENTRY(QUERY,NAME,RAW_NAME,START,END) \
-do { if (sgrep->sgml_debug) sgrep_error(sgrep,"%s(\"%s\"):%s:(%d,%d)\n",(QUERY),(NAME),(RAW_NAME),(START),(END)); \
-if ((START)<=(END)) state->entry(state,(char *)(RAW_NAME),(START),(END)); } while (0)
+do { if (sgrep->sgml_debug) sgrep_error(sgrep,"%s(\"%s\"):%s:("OFFSET_FORMAT","OFFSET_FORMAT")\n",(QUERY),(NAME),(RAW_NAME),(START),(END)); \
+if ((START)<=(END) && state->wanted[((const unsigned char *)(RAW_NAME))[0]]) \
+    state->entry(state,(char *)(RAW_NAME),(START),(END)); } while (0)
 
-void pop_elements_to(SGMLScanner *state,ElementStack *p) {
-    ElementStack *q;
+void pop_elements_to(SGMLScanner *state, int depth) {
+    OpenElement *q;
     SGREPDATA(state);
-    assert(p==NULL || state->top);
-    /* Element is in the stack */
-    q=state->top;
-    while(p!=q) {
+    assert(depth<=state->depth);
+    while(state->depth>depth) {
 	/* All elements in the stack not having an end tag
 	 * are considered as empty. Sad but true */
-	state->top=q->prev;
+	q=&state->elements[--state->depth];
 	SGML_ENTRY("elements","","@elements",q->start,q->end);
-	/* fprintf(stderr,"<%s/>\n",q->gi); */
-	sgrep_free(q->gi);
-	sgrep_free(q);
-	q=state->top;
+	/* fprintf(stderr,"<%s/>\n",state->gi_names[q->gi]); */
+    }
+}
+
+/*
+ * Gives the id of an element name, or -1 if the name has not been seen
+ * and add is not set. Start tags add their names, so an end tag whose
+ * name has no id cannot close anything
+ */
+static int intern_gi(SGMLScanner *state, const char *name, int add) {
+    SGREPDATA(state);
+    const unsigned char *p;
+    unsigned int h=PHRASE_HASH_START;
+    unsigned int b;
+    int id;
+
+    for(p=(const unsigned char *)name;*p;p++) h=PHRASE_HASH(h,*p);
+    for(b=h&state->gi_mask;(id=state->gi_buckets[b])>=0;
+	b=(b+1)&state->gi_mask) {
+	if (state->gi_hashes[id]==h && strcmp(state->gi_names[id],name)==0) {
+	    return id;
+	}
+    }
+    if (!add) return -1;
+    id=state->n_gis++;
+    state->gi_names[id]=sgrep_strdup(name);
+    state->gi_hashes[id]=h;
+    state->gi_buckets[b]=id;
+    if (2*(unsigned int)state->n_gis>state->gi_mask) {
+	/* Table gets full, double it */
+	int i;
+	state->gi_mask=2*state->gi_mask+1;
+	state->gi_names=(char **)sgrep_realloc(
+	    state->gi_names,sizeof(char *)*(state->gi_mask+1)/2);
+	state->gi_hashes=(unsigned int *)sgrep_realloc(
+	    state->gi_hashes,sizeof(unsigned int)*(state->gi_mask+1)/2);
+	sgrep_free(state->gi_buckets);
+	state->gi_buckets=(int *)sgrep_malloc(sizeof(int)*(state->gi_mask+1));
+	for(b=0;b<=state->gi_mask;b++) state->gi_buckets[b]=-1;
+	for(i=0;i<state->n_gis;i++) {
+	    b=state->gi_hashes[i]&state->gi_mask;
+	    while(state->gi_buckets[b]>=0) b=(b+1)&state->gi_mask;
+	    state->gi_buckets[b]=i;
+	}
     }
+    return id;
 }
 
 /*
@@ -700,7 +1077,7 @@ void parse_xml_declaration(SGMLScanner *scanner) {
 		flist_name(scanner->file_list,scanner->file_num));    
 }
 
-void sgml_found(SGMLScanner *state,enum SGMLState s,int end_index) {
+void sgml_found(SGMLScanner *state,enum SGMLState s,Offset end_index) {
     SGREPDATA(state);
     end_index--;
 
@@ -708,6 +1085,17 @@ void sgml_found(SGMLScanner *state,enum SGMLState s,int end_index) {
     case SGML_WORD:
     case SGML_WORD_ENTITY:
     case SGML_CDATA_MARKED_SECTION_WORD:
+	if (state->word_text) {
+	    /* Plain word, see sgml_scan() */
+	    if (state->words<=end_index) {
+		state->word_entry(state,state->word_text,
+				  (end_index+1-state->words<MAX_TERM_SIZE) ?
+				  end_index+1-state->words : MAX_TERM_SIZE-1,
+				  state->words,end_index);
+	    }
+	    state->word_text=NULL;
+	    break;
+	}
 	assert(string_to_char(state->word)[0]=='w');
 	if (state->ignore_case) {
 	    string_tolower(state->word,1);
@@ -736,12 +1124,16 @@ void sgml_found(SGMLScanner *state,enum SGMLState s,int end_index) {
 		   state->tags,end_index);
 	if (state->maintain_element_stack) {
 	    /* Push to element stack */
-	    ElementStack *e=sgrep_new(ElementStack);
-	    e->gi=sgrep_strdup(string_to_char(state->gi)+1);
+	    OpenElement *e;
+	    if (state->depth==state->max_depth) {
+		state->max_depth*=2;
+		state->elements=(OpenElement *)sgrep_realloc(
+		    state->elements,sizeof(OpenElement)*state->max_depth);
+	    }
+	    e=&state->elements[state->depth++];
+	    e->gi=intern_gi(state,string_to_char(state->gi)+1,1);
 	    e->start=state->tags;
 	    e->end=end_index;
-	    e->prev=state->top;
-	    state->top=e;
 	}
 	break;
 
@@ -774,19 +1166,17 @@ void sgml_found(SGMLScanner *state,enum SGMLState s,int end_index) {
 		   state->tags,end_index);
 	if (state->maintain_element_stack) {
 	    /* First check that the element is on the stack */
-	    ElementStack *p=state->top;
-	    while(p && strcmp(string_to_char(state->gi)+1,p->gi)!=0) {
-		p=p->prev;
-	    }
-	    if (p) {
-		/* Take elements until p is in top */
-		pop_elements_to(state,p);
-		/* Pop p */
-		state->top=p->prev;
-		SGML_ENTRY("elements","","@elements",p->start,end_index);
-		/* fprintf(stderr,"<%s>..</%s>\n",p->gi,p->gi);*/
-		sgrep_free(p->gi);
-		sgrep_free(p);
+	    int gi=intern_gi(state,string_to_char(state->gi)+1,0);
+	    int k=state->depth-1;
+	    while(k>=0 && state->elements[k].gi!=gi) k--;
+	    if (gi>=0 && k>=0) {
+		/* Take elements until k is in top */
+		pop_elements_to(state,k+1);
+		/* Pop k */
+		state->depth=k;
+		SGML_ENTRY("elements","","@elements",
+			   state->elements[k].start,end_index);
+		/* fprintf(stderr,"<%s>..</>\n",state->gi_names[gi]);*/
 	    }
 	}
 	break;
@@ -838,7 +1228,7 @@ void sgml_found(SGMLScanner *state,enum SGMLState s,int end_index) {
 		   string_to_char(state->name),
 		   state->doctypes, end_index);
 	/* Empty the element stack */
-	pop_elements_to(state,NULL);
+	pop_elements_to(state,0);
 	break;
 
     case SGML_DOCTYPE_PUBLIC_ID:
@@ -955,7 +1345,7 @@ void sgml_flush(SGMLScanner *sgmls) {
     SGREPDATA(sgmls);
 
     /* sgrep_progress(sgrep,"sgml_flush()\n"); */
-    pop_elements_to(sgmls,NULL);
+    pop_elements_to(sgmls,0);
     if (sgmls->element_list && sgmls->entry==sgml_add_entry_to_index) {
 	ListIterator l;
 	Region r;
@@ -970,28 +1360,63 @@ void sgml_flush(SGMLScanner *sgmls) {
 	    get_region(&l,&r);
 	}
 	delete_region_list(sgmls->element_list);
-	sgmls->element_list=new_region_list(sgrep);
+	sgmls->element_list=new_contiguous_region_list(sgrep);
 	list_set_sorted(sgmls->element_list,NOT_SORTED);
 	sgmls->element_list->nested=1;
     }
     reset_encoder(sgmls,&sgmls->encoder);
     sgmls->state=SGML_PCDATA;
+    sgmls->word_text=NULL;
 }
     
+/*
+ * Adds n ASCII characters to a term like TERM_PUSH() does. They are
+ * every width'th byte from buf on
+ */
+static void term_push_run(SgrepString *term, const unsigned char *buf,
+			  Offset n, int width) {
+    Offset i;
+
+    if (string_len(term)+n>MAX_TERM_SIZE) n=MAX_TERM_SIZE-string_len(term);
+    if (n<=0) return;
+    if (width==1) {
+	memcpy(term->s+term->length,buf,n);
+    } else {
+	for(i=0;i<n;i++) term->s[term->length+i]=buf[i*width];
+    }
+    term->length+=n;
+}
+
+/*
+ * Copies the word still in the input buffer up to end to scanner->word
+ */
+static void sgml_word_to_string(SGMLScanner *scanner, Offset end) {
+    string_clear(scanner->word);
+    TERM_PUSH(scanner->word,'w');
+    term_push_run(scanner->word,scanner->word_text,end-scanner->words,1);
+    scanner->word_text=NULL;
+}
+
 /*
  * This could be made faster with macro magics like in James Clarks expat.
- * I hope that no one notices.
+ * I hope that no one notices. Some of it is: plain ASCII text and words
+ * are skipped a run at a time, also in UTF-16, and whole UTF-8 sequences
+ * are decoded at once. Words of ASCII are left in the buffer
+ * (scanner->word_text) and given to scanner->word_entry from there, as
+ * long as they are plain and the buffer does not end.
  */
 int sgml_scan(SGMLScanner *scanner,
 	      const unsigned char *buf, 
-	      int len,
-	      int start,int file_num) {
+	      Offset len,
+	      Offset start,int file_num) {
 #define POS (start+i)
 #define NEXT_CH do { encoder->prev=POS; ch=-1; } while(0)
+/* ch was the byte before POS, right after the previous character */
+#define CH_IN_BUFFER (encoder->prev==POS-1 && ch<0x80 && buf[i-1]==ch)
 #define SGML_FOUND(SCANNER,END) do { \
     sgml_found((SCANNER),state,(END)); if ((SCANNER)->failed) return SGREP_ERROR; \
 } while(0)
-    int i;
+    Offset i;
     int ch=-1;
     Encoder *encoder=&scanner->encoder;
     enum SGMLState state=scanner->state;
@@ -1006,6 +1431,59 @@ int sgml_scan(SGMLScanner *scanner,
 	if (ch==-1) {
 	    /* If no more bytes, break out */
 	    if (i>=len) break;
+
+	    /* Skip a run of text, of a word or of some other term.
+	     * Runs are mostly short, so the kernel is called only
+	     * after the first 16 characters. The first byte tells when
+	     * there is no run: it is in the class also when it starts
+	     * a non-ASCII character or UTF-16 code unit */
+	    if (scanner->run_end[state] &&
+		!scanner->run_end[state]->member[buf[i]]) {
+		const ByteClass *c=scanner->run_end[state];
+		Offset end=i;
+		int width=1;
+		int big_endian=0;
+		switch(encoder->estate) {
+		case EIGHT_BIT:
+		case UTF8_1:
+		    while(end<len && !c->member[buf[end]]) {
+			if (++end-i==16 && end<len) {
+			    end+=scanner->class_kernel->find_class(buf+end,
+								   len-end,c);
+			    break;
+			}
+		    }
+		    break;
+		case UTF16_BIG:
+		    big_endian=1;
+		    /* Fall through */
+		case UTF16_SMALL:
+		    width=2;
+		    while(end+1<len && !buf[end+1-big_endian] &&
+			  !c->member[buf[end+big_endian]]) {
+			end+=2;
+			if (end-i==32 && end+1<len) {
+			    end+=2*scanner->class_kernel->find_class16(
+				buf+end,(len-end)/2,c,big_endian);
+			    break;
+			}
+		    }
+		    break;
+		default:
+		    break;
+		}
+		if (end>i) {
+		    SgrepString *term=scanner->run_term[state];
+		    if (term && !(term==scanner->word && scanner->word_text)) {
+			term_push_run(term,buf+i+big_endian,
+				      (end-i)/width,width);
+		    }
+		    scanner->skipped+=end-i;
+		    i=end;
+		    encoder->prev=POS;
+		    if (i>=len) break;
+		}
+	    }
 	    
 	    switch (encoder->estate) {
 	    case EIGHT_BIT:
@@ -1020,11 +1498,25 @@ int sgml_scan(SGMLScanner *scanner,
 		    scanner->parse_errors++;
 		    i++;
 		} else if (buf[i]<0xe0) {
+		    /* Sequences inside the buffer are decoded at once,
+		     * errors and the rest by the states below */
+		    if (i+1<len && (buf[i+1]&0xc0)==0x80) {
+			ch=((buf[i]&0x1f)<<6) | (buf[i+1]&0x3f);
+			i+=2;
+			break;
+		    }
 		    encoder->estate=UTF8_2;
 		    encoder->char1=buf[i];
 		    i++;
 		    continue;
 		} else if (buf[i]<0xf0) {
+		    if (i+2<len && (buf[i+1]&0xc0)==0x80 &&
+			(buf[i+2]&0xc0)==0x80) {
+			ch=((buf[i]&0x0f)<<12) |
+			    ((buf[i+1]&0x3f)<<6) | (buf[i+2]&0x3f);
+			i+=3;
+			break;
+		    }
 		    encoder->estate=UTF8_3_1;
 		    encoder->char1=buf[i];
 		    i++;
@@ -1152,12 +1644,16 @@ int sgml_scan(SGMLScanner *scanner,
 		NEXT_CH;
 		break;
 	    default:
-		if (IN_CLIST(scanner->word_chars,ch)) {
+		if (scanner->wanted['w'] && IN_CLIST(scanner->word_chars,ch)) {
 		    state=SGML_WORD;
 		    scanner->words=encoder->prev;
-		    string_clear(scanner->word);
-		    TERM_PUSH(scanner->word,'w');
-		    TERM_PUSH(scanner->word,ch);
+		    if (scanner->word_entry && CH_IN_BUFFER) {
+			scanner->word_text=buf+i-1;
+		    } else {
+			string_clear(scanner->word);
+			TERM_PUSH(scanner->word,'w');
+			TERM_PUSH(scanner->word,ch);
+		    }
 		} else if (ch=='&') {
 		    scanner->entitys=encoder->prev;
 		    push_state(scanner,SGML_PCDATA_ENTITY);
@@ -1303,9 +1799,15 @@ int sgml_scan(SGMLScanner *scanner,
 	    
 	case SGML_WORD:
 	    if (IN_CLIST(scanner->word_chars,ch) && ch!='<') {
-		TERM_PUSH(scanner->word,ch);
+		if (scanner->word_text && !CH_IN_BUFFER) {
+		    sgml_word_to_string(scanner,encoder->prev);
+		}
+		if (!scanner->word_text) TERM_PUSH(scanner->word,ch);
 		NEXT_CH;
 	    } else if (ch=='&') {
+		if (scanner->word_text) {
+		    sgml_word_to_string(scanner,encoder->prev);
+		}
 		scanner->word_end=encoder->prev;
 		scanner->entitys=encoder->prev;
 		push_state(scanner,SGML_WORD_ENTITY);
@@ -1552,7 +2054,8 @@ int sgml_scan(SGMLScanner *scanner,
 	case SGML_COMMENT:
 	    if (ch=='-') {
 		state=SGML_COMMENT_END1;
-	    } else if (IN_CLIST(scanner->word_chars,ch)) {
+	    } else if (scanner->wanted['c'] &&
+		       IN_CLIST(scanner->word_chars,ch)) {
 		    state=SGML_COMMENT_WORD;
 		    string_clear(scanner->comment_word);
 		    TERM_PUSH(scanner->comment_word,'c');
@@ -1667,7 +2170,8 @@ int sgml_scan(SGMLScanner *scanner,
 	case SGML_CDATA_MARKED_SECTION:
 	    if (ch==']') {
 		state=SGML_CDATA_MARKED_SECTION_END1;
-	    } else if (IN_CLIST(scanner->word_chars,ch)) {
+	    } else if (scanner->wanted['w'] &&
+		       IN_CLIST(scanner->word_chars,ch)) {
 		string_clear(scanner->word);
 		TERM_PUSH(scanner->word,'w');
 		TERM_PUSH(scanner->word,ch);
@@ -2256,7 +2760,10 @@ int sgml_scan(SGMLScanner *scanner,
 	
 
     }
+    /* The buffer goes away */
+    if (scanner->word_text) sgml_word_to_string(scanner,encoder->prev);
     scanner->state=state;
     return SGREP_OK;
 #undef NEXT_CH
+#undef CH_IN_BUFFER
 }
@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "sysdeps.h"
 
@@ -88,6 +89,10 @@ extern "C" {
  */
 #define LIST_NODE_SIZE ( 1 << LIST_NODE_BITS )
 
+/* Regions in one delta encoded block of a compressed list. Must divide
+ * LIST_NODE_SIZE */
+#define REGION_BLOCK_SIZE 32
+
 /*
  * All operators. These are used in the parse tree 
  */
@@ -120,12 +125,27 @@ typedef struct SgrepStringStruct {
     struct SgrepStringStruct *escaped;
 } SgrepString;
     
+/*
+ * Offsets to the input. When compiled with LARGE_OFFSETS (configure
+ * --enable-large-offsets) these are 64 bits wide, so that the input
+ * can be larger than 2GB.
+ */
+#if LARGE_OFFSETS
+typedef long long Offset;
+# define OFFSET_MAX LLONG_MAX
+# define OFFSET_FORMAT "%lld"
+#else
+typedef int Offset;
+# define OFFSET_MAX INT_MAX
+# define OFFSET_FORMAT "%d"
+#endif
+
 /*
  * One region has a start point and a end point 
  */
 typedef struct RegionStruct {
-	int start;
-	int end;
+	Offset start;
+	Offset end;
 } Region;
 
 /* 
@@ -138,6 +158,64 @@ typedef struct ListNodeStruct {
 	struct ListNodeStruct *prev;
 } ListNode;
 
+/*
+ * Contiguous region storage: start and end points are kept in two
+ * separate growable arrays, so that the regions can be accessed by
+ * index without pointer chasing.
+ */
+typedef struct {
+	Offset *starts;
+	Offset *ends;
+} RegionArray;
+
+/*
+ * Merge kernel: count_below(a,n,key) gives the number of elements in
+ * the sorted array a[0..n-1] smaller than key. There is a plain C
+ * version and vectorized ones, see select_merge_kernel() in sysdeps.c
+ */
+typedef struct {
+	const char *name;
+	int (*count_below)(const Offset *a, int n, Offset key);
+} MergeKernel;
+
+/*
+ * Byte kernel: find_bytes(buf,len,set,n) gives the offset of the first
+ * byte in buf[0..len-1] which is one of set[0..n-1], or len if there is
+ * none. n is at most BYTE_KERNEL_MAX_SET. See select_byte_kernel()
+ */
+#define BYTE_KERNEL_MAX_SET 8
+typedef struct {
+	const char *name;
+	Offset (*find_bytes)(const unsigned char *buf, Offset len,
+			     const unsigned char *set, int n);
+} ByteKernel;
+
+/*
+ * Class kernel: find_class(buf,len,c) gives the offset of the first
+ * byte in buf[0..len-1] which is in the byte class c, or len if there
+ * is none. Bytes 0x80-0xff always belong to the class, so that only
+ * ASCII is skipped. find_class16(buf,n,c,big_endian) does the same for
+ * n UTF-16 code units, units above 0x7f belonging to the class. See
+ * make_byte_class() and select_class_kernel()
+ */
+typedef struct {
+	unsigned char member[256];
+	unsigned char nibble[16]; /* Bit h of nibble[l] is set when the
+				   * byte h*16+l is in the class */
+} ByteClass;
+typedef struct {
+	const char *name;
+	Offset (*find_class)(const unsigned char *buf, Offset len,
+			     const ByteClass *c);
+	Offset (*find_class16)(const unsigned char *buf, Offset n,
+			       const ByteClass *c, int big_endian);
+} ClassKernel;
+
+/*
+ * Delta encoded blocks of a compressed list. Defined in common.c
+ */
+struct RegionBlocksStruct;
+
 /*
  * A pointer to a GC_NODE in a gc list. Used for scanning gc lists.
  */
@@ -146,6 +224,15 @@ typedef struct {
 	const struct RegionListStruct *list;	
 	ListNode *node;	                /* Points out the node */
 	int ind;		        /* Index into a node */
+	RegionArray array;              /* Arrays scanned, if the list is
+					 * contiguous. Otherwise NULLs */
+	/* When scanning a compressed list, blocks is not NULL, ind
+	 * is the index into whole list and block contains the decoded
+	 * regions from block_start to block_start+block_len-1 */
+	const struct RegionBlocksStruct *blocks;
+	int block_start;
+	int block_len;
+	Region block[REGION_BLOCK_SIZE];
 } ListIterator;
 
 /*
@@ -156,7 +243,7 @@ typedef struct RegionListStruct {
     struct SgrepStruct *sgrep;
     int nodes;			/* how many nodes there are */
     int length;			/* How many regions in last node */
-    int chars;			/* When we have chars list, this
+    Offset chars;		/* When we have chars list, this
 				   tells from how many characters
 				   it is created */
     int refcount;		/* How many times this list is referenced */
@@ -176,7 +263,19 @@ typedef struct RegionListStruct {
     struct  RegionListStruct *next; /* We may need to make lists out of gc lists */
     ListNode **start_sorted_array; /* If this region list needs to an
 				    * array as well as list*/
-
+    RegionArray array;          /* Contiguous backend. When array.starts
+				 * is not NULL, regions are stored here
+				 * instead of ListNodes: first and last
+				 * are NULL, nodes is 1 and length
+				 * is the number of regions */
+    RegionArray end_sorted_array; /* End sorted copy of a contiguous list */
+    int allocated;              /* Size of the contiguous arrays */
+    struct RegionBlocksStruct *blocks; /* Compressed backend. When not
+				 * NULL, all full nodes have been delta
+				 * encoded to blocks and first==last is
+				 * the node being filled. nodes and length
+				 * are counted as if the encoded nodes
+				 * were still there */
 } RegionList;
 
 /*
@@ -194,6 +293,29 @@ typedef struct PHRASE_NODE {
 /*
  * Node of a parse tree 
  */
+/*
+ * Evaluation plan of a parse tree node. plan_tree() in optimize.c
+ * estimates the lists from the leaf lists and chooses how the node is
+ * evaluated, the evaluator adds what it did. Shown with -E.
+ */
+#define PLAN_RIGHT_FIRST	1  /* Right subtree is evaluated first */
+#define PLAN_SHORT_CIRCUIT	2  /* Empty first subtree gives empty result */
+#define PLAN_PROBE_LEFT		4  /* Left list was probed, not merged */
+#define PLAN_PROBE_RIGHT	8  /* Right list was probed, not merged */
+#define PLAN_NO_PREPROCESS	16 /* outer() or inner() was not needed */
+#define PLAN_STREAMED		32 /* Evaluated through a cursor */
+#define PLAN_SKIPPED		64 /* Not evaluated, other operand was empty */
+
+typedef struct {
+    double estimate;		/* Estimated regions, -1 when not known */
+    int round;			/* plan_tree() call which set estimate */
+    int flags;			/* PLAN_* flags of this evaluation */
+    int shown;			/* PLAN_* flags of all evaluations */
+    int evaluations;		/* Lists computed for this node */
+    double estimated;		/* Sum of their estimates, -1 if unknown */
+    double regions;		/* Sum of their sizes */
+} NodePlan;
+
 typedef struct ParseTreeNodeStruct {
     enum Oper oper;             /* operand */
     
@@ -211,6 +333,7 @@ typedef struct ParseTreeNodeStruct {
     
     int number;			/* Functions may have int parameters */
     ParseTreeLeaf *leaf;        /* Points to Leaf if this is */
+    NodePlan plan;		/* How the node is evaluated */
 } ParseTreeNode;
 
 /* Opaque FileListStruct for managing lists of sgrep input files
@@ -221,11 +344,30 @@ typedef struct FileListStruct FileList;
 /* Opaque struct for managing temporary files */
 typedef struct TempFileStruct TempFile;
 
+/* Opaque struct for the subexpression cache, defined in cache.c */
+typedef struct SubexprCacheStruct SubexprCache;
+
+/* Opaque struct for scanning regex phrases, defined in regex.c */
+typedef struct RegexScannerStruct RegexScanner;
+
 /*
  * Struct for gathering statistical information 
  */
 struct Statistics {
     int phrases;	      /* How many phrases found */
+    int ac_states;	      /* States in the compiled AC automate */
+    int ac_classes;	      /* Byte classes of the AC automate */
+    size_t ac_table_bytes;    /* Size of the AC transition table */
+    const char *ac_prefilter; /* Prefilter in front of the AC automate */
+    int ac_start_bytes;	      /* Bytes phrases of the automate start with */
+    int ac_prefilter_dropped; /* Prefilter gave too many candidates */
+    Offset ac_prefilter_skipped; /* Bytes skipped by the prefilter */
+    int regex_dfa_states;     /* DFA states built for regex phrases */
+    int regex_dfa_flushes;    /* Times the regex DFA states were dropped */
+    Offset regex_skipped;     /* Bytes skipped by the regex prefilters */
+    Offset regex_verified;    /* Bytes matched with the regex NFA */
+    const char *sgml_kernel;  /* Kernel skipping text runs in SGML scanner */
+    Offset sgml_skipped;      /* Bytes of text runs skipped by it */
 
     /* Evaluation statistics */
     int operators_evaluated;  /* Total number of operators evaluated */
@@ -257,19 +399,34 @@ struct Statistics {
     int output;		    /* Size of output list */
     int scans;		    /* Number of started scans */
     int scanned_files;      /* Number of scanned files */
-    int scanned_bytes;      /* Scanned bytes total */
+    Offset scanned_bytes;   /* Scanned bytes total */
     int sorts_by_start;	    /* Number of sorts by start points */
     int sorts_by_end;	    /* Number of sorts by end points */
+    int parallel_sorts;	    /* How many of the sorts were parallel */
+    int parallel_subtrees;  /* Subtree pairs evaluated in parallel */
+    int parallel_scans;     /* Searches scanning files in parallel */
 #ifdef OPTIMIZE_SORTS
     int sorts_optimized;	  /* How many sorts we could optimize away */
 #endif
     int remove_duplicates;	  /* Number of remove_duplicates operations */
+    int seeking_operations;	  /* Operations skipping with seek_region() */
+    int early_stops;		  /* Evaluations stopped after enough regions */
+    int kernel_merges;		  /* Operations merging with the merge kernel */
+    int short_circuits;		  /* Subtrees skipped as the other was empty */
+    int cache_hits;		  /* Subtrees read from the cache (-k) */
+    int cache_misses;		  /* Subtrees not found from the cache */
+    int cache_stores;		  /* Subtrees written to the cache */
+    int cache_evictions;	  /* Cache entries removed to stay in budget */
+    int compressed_lists;	  /* Number of compressed lists created */
+    size_t compressed_regions;    /* Regions delta encoded */
+    size_t compressed_bytes;      /* Bytes used by encoded regions */
     /* Statistics about the query and it's optimization */
     int parse_tree_size;	  /* Parse tree size */
     int optimized_phrases;        /* How many times we had same phrase */
+    int flattened_ors;		  /* Chains of or made n-ary */
     int optimized_nodes;	  /* How many parse tree nodes optimized */
 
-    int input_size;		  /* Size of given input in bytes */
+    Offset input_size;		  /* Size of given input in bytes */
     
     /* The memory debugging information is only available if sgrep was
      * compiled with memory-debugging enabled */
@@ -290,9 +447,26 @@ struct Statistics {
  */
 #define LIST_SIZE(LIST)	(((LIST)->nodes-1)*LIST_NODE_SIZE+(LIST)->length)
 /*
- * Macto for last node in list
+ * Tells whether list uses the contiguous backend
  */
-#define LAST_NODE(LIST) ((LIST)->last->list[(LIST)->length-1])
+#define LIST_IS_CONTIGUOUS(LIST) ((LIST)->array.starts!=NULL)
+/*
+ * Tells whether list uses the compressed backend
+ */
+#define LIST_IS_COMPRESSED(LIST) ((LIST)->blocks!=NULL)
+/*
+ * Tells whether list is an optimized chars list
+ */
+#define LIST_IS_CHARS(LIST) ((LIST)->first==NULL && !LIST_IS_CONTIGUOUS(LIST))
+/*
+ * Macros for start and end point of the last region in list
+ */
+#define LAST_START(LIST) (LIST_IS_CONTIGUOUS(LIST) ? \
+    (LIST)->array.starts[(LIST)->length-1] : \
+    (LIST)->last->list[(LIST)->length-1].start)
+#define LAST_END(LIST) (LIST_IS_CONTIGUOUS(LIST) ? \
+    (LIST)->array.ends[(LIST)->length-1] : \
+    (LIST)->last->list[(LIST)->length-1].end)
 
 /* 
  * These are for speeding up list scanning and creation.
@@ -319,19 +493,28 @@ struct Statistics {
 #define region_at(list,ind,region) \
  do { check_region_at((list),(ind)); assert((region)!=NULL); \
  REGION_AT_MACRO((list),(ind),(region)); } while (0)
-#define region_lvalue_at(LIST,IND) \
-  ( ((LIST)->start_sorted_array)[ \
-    (check_region_at((LIST),(IND)))>>LIST_NODE_BITS ]-> \
-    list[ (IND)& ((1<<LIST_NODE_BITS)-1) ] )
 #endif
 
 #define REGION_AT_MACRO(list,ind,region) \
-     do { (*region)=LIST_RNUM((list)->start_sorted_array,(ind)); } while(0)
-
-#define REGION_LVALUE_AT_MACRO(list,ind) \
-     (LIST_RNUM((list)->start_sorted_array,(ind)))
+do { \
+	if (LIST_IS_CONTIGUOUS(list)) { \
+		(region)->start=(list)->array.starts[(ind)]; \
+		(region)->end=(list)->array.ends[(ind)]; \
+	} else if (LIST_IS_COMPRESSED(list)) { \
+		compressed_region_at((list),(ind),(region)); \
+	} else { \
+		(*region)=LIST_RNUM((list)->start_sorted_array,(ind)); \
+	} \
+} while(0)
 
 #define ADD_REGION_MACRO(L,S,E)	do { \
+    if (LIST_IS_CONTIGUOUS(L)) { \
+	if ( (L)->length==(L)->allocated ) grow_region_array(L); \
+	(L)->array.starts[(L)->length]=(S); \
+	(L)->array.ends[(L)->length]=(E); \
+	(L)->length++; \
+	break; \
+    } \
     if ( (L)->length==LIST_NODE_SIZE ) insert_list_node(L); \
     (L)->last->list[(L)->length].start=(S); \
     (L)->last->list[(L)->length].end=(E); \
@@ -342,12 +525,33 @@ struct Statistics {
 do { \
 	if ( (handle)->node==NULL || (handle)->node->next== NULL ) \
 	{ \
+		if ((handle)->blocks!=NULL) /* compressed list */ \
+		{ \
+			if ((unsigned)((handle)->ind-(handle)->block_start)>= \
+			    (unsigned)(handle)->block_len && \
+			    !decode_region_block(handle)) \
+			{ \
+				(reg)->start=-1; \
+				(reg)->end=-1; \
+				break; \
+			} \
+			*(reg)=(handle)->block[(handle)->ind-(handle)->block_start]; \
+			(handle)->ind++; \
+			break; \
+		} \
 		if ((handle)->ind==(handle)->list->length) \
 		{ \
 			(reg)->start=-1; \
 			(reg)->end=-1; \
 			break; \
 		} \
+		if ((handle)->array.starts!=NULL) /* contiguous list */ \
+		{ \
+			(reg)->start=(handle)->array.starts[(handle)->ind]; \
+			(reg)->end=(handle)->array.ends[(handle)->ind]; \
+			(handle)->ind++; \
+			break; \
+		} \
 	 	if ((handle)->list->last==NULL) /* chars list */ \
 		{ \
 			(reg)->start=(handle)->ind; \
@@ -374,6 +578,22 @@ do { \
 			(reg)->end=-1; \
 			break; \
 		} \
+		if ((handle)->array.starts!=NULL) /* contiguous list */ \
+		{ \
+			(handle)->ind--; \
+			(reg)->start=(handle)->array.starts[(handle)->ind]; \
+			(reg)->end=(handle)->array.ends[(handle)->ind]; \
+			break; \
+		} \
+		if ((handle)->blocks!=NULL) /* compressed list */ \
+		{ \
+			(handle)->ind--; \
+			if ((unsigned)((handle)->ind-(handle)->block_start)>= \
+			    (unsigned)(handle)->block_len) \
+				decode_region_block(handle); \
+			*(reg)=(handle)->block[(handle)->ind-(handle)->block_start]; \
+			break; \
+		} \
 		if ((handle)->list->first==NULL) \
 		{ \
 			(handle)->ind--; \
@@ -393,6 +613,13 @@ do { \
 
 /* Backward compatibility hack */
 #define stats (sgrep->statistics)
+/*
+ * Adds to a counter in stats. Operators and scanners may run in several
+ * threads, so this takes sgrep_lock(). Don't use it with the lock held.
+ */
+#define STATS_ADD(COUNTER,N) do { \
+    sgrep_lock(sgrep); stats.COUNTER+=(N); sgrep_unlock(sgrep); \
+} while(0)
 
 typedef enum { SGML_SCANNER, XML_SCANNER, TEXT_SCANNER } ScannerType;
 
@@ -418,7 +645,7 @@ typedef struct SgrepStruct {
     struct IndexReaderStruct *index_reader;
     void (*progress_callback)(void *data,
 			    int files_processed, int total_files,
-			    int bytes_processed, int total_bytes);   
+			    Offset bytes_processed, Offset total_bytes);   
     void *progress_data;
     FILE *progress_stream; /* stream to write progress reports */
     int progress_output;   /* Should we write progress output */
@@ -435,6 +662,14 @@ typedef struct SgrepStruct {
     int print_newline;		/* Shall we print newline at the end of output */
     int print_all;		/* If sgrep is used as a filter */
     int stream_mode; 	        /* Input files considered a stream (-S) */
+    int threads;                /* How many threads we may use */
+    int busy_threads;           /* Extra threads evaluating subtrees now */
+    int file_jobs;              /* Files evaluated at the same time (-j) */
+    int compress_lists;         /* Keep large region lists compressed (-z) */
+    const MergeKernel *merge_kernel; /* Selected at startup */
+    SubexprCache *subexpr_cache; /* Cache of evaluated subtrees (-k) */
+    struct EvalArenaStruct *arena; /* Recycled ListNodes and stacks, see
+				    * open_eval_arena() */
     
     /* Pmatch.c stuff */
     ScannerType scanner_type;
@@ -446,6 +681,7 @@ typedef struct SgrepStruct {
     /* SGML-stuff */
     int sgml_debug;              /* Enables SGML-scanner debugging */
     int include_system_entities; /* Should scanner include system entities */
+    int sgml_no_fast_scan;       /* Scan text one character at a time */
 
 /* The historical remain, chars list */
     RegionList *chars_list; 
@@ -513,17 +749,17 @@ FileList *new_flist(SgrepData *);
 int flist_add(FileList *ifs, const char *name);
 int flist_add_relative(FileList *ifs, int relative_to, const char *name);
 int flist_exists(FileList *ifs, const char *name);
-void flist_add_known(FileList *ifs, const char *name, int len);    
+void flist_add_known(FileList *ifs, const char *name, Offset len);    
 FileList *flist_duplicate(FileList *list);
 void flist_cat(FileList *to, FileList *from);
 void delete_flist(FileList *list);
 void flist_ready(FileList *ifs);
 const char *flist_name(const FileList *list, int n);
-int flist_length(const FileList *list, int n);
-int flist_start(const FileList *list, int n);
-int flist_total(const FileList *list);
+Offset flist_length(const FileList *list, int n);
+Offset flist_start(const FileList *list, int n);
+Offset flist_total(const FileList *list);
 int flist_files(const FileList *);
-int flist_search(const FileList *, int s);
+int flist_search(const FileList *, Offset s);
 int flist_add_one_file_list_file(FileList *ifs, const char *filename);
 int flist_add_file_list_files(FileList *ifs, FileList *file_lists);
 int flist_last_errno(const FileList *list);
@@ -565,11 +801,21 @@ ParseTreeNode *parse_string(SgrepData *sgrep,
 			    const char *,struct PHRASE_NODE **);
 const char* give_oper_name(int oper);
 void free_parse_tree(SgrepData *sgrep,ParseTreeNode *root);
+ParseTreeNode *copy_parse_tree(SgrepData *sgrep, ParseTreeNode *root,
+			       struct PHRASE_NODE *phrase_list,
+			       struct PHRASE_NODE **copy_list);
+void free_parse_tree_copy(SgrepData *sgrep, ParseTreeNode *root);
 
 /* Interface to parse tree optimizer */
 void optimize_tree(struct SgrepStruct *sgrep,
 		   ParseTreeNode **, struct PHRASE_NODE **);
 
+int or_operands(const ParseTreeNode *node, ParseTreeNode **operands);
+void clear_node_plan(ParseTreeNode *node);
+void plan_tree(SgrepData *sgrep, ParseTreeNode *root);
+int plan_probe(const RegionList *longer, const RegionList *shorter);
+void print_plan(SgrepData *sgrep, FILE *f, ParseTreeNode *root);
+
 /* This lies in main.c, but since it does both parsing and optimizing */
 ParseTreeNode *parse_and_optimize(SgrepData *sgrep,const char *query,
 				  struct PHRASE_NODE **phrases);
@@ -615,7 +861,7 @@ typedef struct {
 void set_default_index_options(SgrepData *sgrep,IndexOptions *o);
 int create_index(const IndexOptions *options);
 int add_region_to_index(struct IndexWriterStruct *writer,
-		      const char *str, int start, int end);
+		      const char *str, Offset start, Offset end);
 /* More functions to handle IndexEntries might be added later */
 
 
@@ -638,8 +884,8 @@ SGMLScanner *new_sgml_index_scanner(SgrepData *sgrep,
 				    struct IndexWriterStruct *writer); 
 int sgml_scan(SGMLScanner *scanner,
 	      const unsigned char *buf, 
-	      int len, 
-	      int start,
+	      Offset len, 
+	      Offset start,
 	      int file_num);
 void sgml_flush(SGMLScanner *sgmls);
 void delete_sgml_scanner(SGMLScanner *s);
@@ -675,6 +921,9 @@ if ((STR)->length<(STR)->size && (CHAR)<255) { \
 /* Manipulation of region lists */
 RegionList *new_gclist();
 RegionList *new_region_list(SgrepData *sgrep);
+RegionList *new_contiguous_region_list(SgrepData *sgrep);
+RegionList *new_compressed_region_list(SgrepData *sgrep);
+void compress_region_list(RegionList *l);
 void delete_region_list(RegionList *l);
 #define free_gclist(LIST) delete_region_list(LIST)
 void list_require_start_sorted_array(RegionList *l);
@@ -683,18 +932,27 @@ RegionList *merge_region_lists(RegionList *list1, RegionList *list2);
 /* Region adding and scanning */
 
 void insert_list_node(RegionList *l);
+void grow_region_array(RegionList *l);
+void reserve_region_array(RegionList *l, int n);
+void add_region_array(RegionList *l, const Offset *starts, const Offset *ends,
+		      int n);
+int merge_count_below(SgrepData *sgrep, const Offset *a, int n, Offset key);
+int decode_region_block(ListIterator *handle);
+void compressed_region_at(const RegionList *l, int ind, Region *region);
+int compressed_find_first_start(const RegionList *l, int start, Offset index);
 void start_region_search(RegionList *, ListIterator *);
 void start_region_search_from(RegionList *, int index, ListIterator *);
+void seek_region(ListIterator *, Offset start, Region *);
 void start_end_sorted_search(RegionList *,ListIterator *);
 void list_set_sorted(RegionList *l, enum RegionListSorted);
 enum RegionListSorted list_get_sorted(const RegionList *l);
 void remove_duplicates(RegionList *);
-void to_chars(RegionList *,int chars, int end);
+void to_chars(RegionList *,Offset chars, Offset end);
 
 /* These functions perform sanity checks, and are not even compiled in,
  * if NDEBUG is defined */
 #ifndef NDEBUG
-void check_add_region(const RegionList *, int start, int end);
+void check_add_region(const RegionList *, Offset start, Offset end);
 void check_get_region(const ListIterator *, const Region *);
 void check_prev_region(const ListIterator *, const Region *);
 int check_region_at(const RegionList *, int);
@@ -703,19 +961,67 @@ int check_region_at(const RegionList *, int);
 /* Interface to evaluator module */
 RegionList *eval(struct SgrepStruct *, const FileList *,ParseTreeNode *);
 
+/* Streaming evaluation through cursors */
+typedef struct RegionCursorStruct RegionCursor;
+RegionCursor *eval_cursor(struct SgrepStruct *, const FileList *,
+			  ParseTreeNode *);
+RegionCursor *new_list_cursor(RegionList *);
+void cursor_get_region(RegionCursor *, Region *);
+int cursor_count_regions(RegionCursor *, int limit);
+void delete_region_cursor(RegionCursor *);
+
+/* Evaluation arena */
+struct EvalArenaStruct;
+void open_eval_arena(struct SgrepStruct *);
+Region *arena_take_stack(struct SgrepStruct *, int *size);
+void arena_return_stack(struct SgrepStruct *, Region *stack, int size);
+void delete_eval_arena(struct SgrepStruct *);
+
 /* Interface to output module */
 typedef struct DisplayerStruct Displayer;
 Displayer *new_displayer(SgrepData *sgrep, FileList *files);
 void delete_displayer(Displayer *displayer);
-const char *fetch_region(Displayer *d,Region *, int *len);
+const char *fetch_region(Displayer *d,Region *, Offset *len);
 
 int write_region_list(struct SgrepStruct *sgrep,FILE *, 
 		  RegionList *, FileList *);
+int write_region_cursor(struct SgrepStruct *sgrep,FILE *,
+			RegionCursor *, FileList *, int print_newline);
     
 
+/* Interface to cache module */
+SubexprCache *open_subexpr_cache(SgrepData *sgrep, const char *dir,
+				 const char *index_file);
+int cache_has_entry(SubexprCache *cache, const ParseTreeNode *node);
+RegionList *cache_lookup(SubexprCache *cache, const ParseTreeNode *node);
+void cache_store(SubexprCache *cache, const ParseTreeNode *node,
+		 RegionList *list);
+void close_subexpr_cache(SubexprCache *cache);
+
+/* Interface to regex module */
+const char *check_regex(SgrepData *sgrep, const unsigned char *pattern,
+			int len);
+RegexScanner *new_regex_scanner(SgrepData *sgrep,
+				struct PHRASE_NODE *phrase_list);
+void regex_scan(RegexScanner *scanner, const unsigned char *buf, Offset len,
+		Offset start);
+void delete_regex_scanner(RegexScanner *scanner);
+
 /* Interface to sysdeps module */
 size_t map_file(SgrepData *sgrep, const char *filename,void **map);
 int unmap_file(SgrepData *sgrep, void *map, size_t size);
+int online_cpus(void);
+const MergeKernel *select_merge_kernel(void);
+const ByteKernel *select_byte_kernel(void);
+const ClassKernel *select_class_kernel(void);
+void make_byte_class(ByteClass *c, const unsigned char *member);
+void sgrep_lock(SgrepData *);
+void sgrep_unlock(SgrepData *);
+#if HAVE_OPEN_MEMSTREAM
+void free_memstream_buffer(char *buf);
+#endif
+void run_in_threads(void *(*worker)(void *), void *args, size_t arg_size,
+		    int n);
 
 
 
@@ -31,6 +31,10 @@
 # include <sys/mman.h>
 #endif
 
+#ifdef USE_THREADS
+# include <pthread.h>
+#endif
+
 
 /* It is possible (and in fact quite easy) to implement
  * index lookups without memory mapping. However every
@@ -41,7 +45,7 @@
 size_t map_file(SgrepData *sgrep,const char *filename,void **map) {
 #if HAVE_MMAP
     int fd;
-    int len;
+    off_t len;
     fd=open(filename,O_RDONLY);
     if (fd<0) {
 	sgrep_error(sgrep,"Failed to open file '%s':%s\n",
@@ -139,6 +143,74 @@ int unmap_file(SgrepData *sgrep,void *map, size_t size) {
 #endif
 }
 
+/*
+ * Returns the number of online processors, or 1 if it can't be found out
+ */
+int online_cpus(void) {
+#if HAVE_UNIX && defined(_SC_NPROCESSORS_ONLN)
+    long n=sysconf(_SC_NPROCESSORS_ONLN);
+    if (n>0) return (int)n;
+#endif
+    return 1;
+}
+
+#ifdef USE_THREADS
+static pthread_mutex_t sgrep_mutex=PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Locks the bookkeeping shared by threads: memory blocks, region list
+ * counters and the evaluation arena. Sections between sgrep_lock()
+ * and sgrep_unlock() must be short and must not lock again.
+ */
+void sgrep_lock(SgrepData *sgrep) {
+#ifdef USE_THREADS
+    pthread_mutex_lock(&sgrep_mutex);
+#endif
+}
+
+void sgrep_unlock(SgrepData *sgrep) {
+#ifdef USE_THREADS
+    pthread_mutex_unlock(&sgrep_mutex);
+#endif
+}
+
+/*
+ * Runs worker for each of the n arguments in table args, every one
+ * in its own thread, and waits for all of them to finish. The sgrep
+ * memory allocation functions may be used by the workers. Without
+ * thread support the workers are run one after another.
+ */
+void run_in_threads(void *(*worker)(void *), void *args, size_t arg_size,
+		    int n) {
+    int i;
+#ifdef USE_THREADS
+    pthread_t tids[MAX_THREADS];
+    int started=0;
+
+    assert(n<=MAX_THREADS);
+    for(i=1;i<n;i++) {
+	if (pthread_create(&tids[i],NULL,worker,
+			   (char *)args+i*arg_size)!=0) {
+	    /* Do the rest ourselves */
+	    break;
+	}
+	started=i;
+    }
+    worker(args);
+    for(i=started+1;i<n;i++) {
+	worker((char *)args+i*arg_size);
+    }
+    for(i=1;i<=started;i++) {
+	pthread_join(tids[i],NULL);
+    }
+#else
+    for(i=0;i<n;i++) {
+	worker((char *)args+i*arg_size);
+    }
+#endif
+}
+
 /*
  * Temporary file handling. These functions might seem to be overkill,
  * but i wanted to have portable and reliable temp file handling..
@@ -366,6 +438,7 @@ void *sgrep_debug_malloc(SgrepData *sgrep,size_t size,
 
     block->size=sizeof(MemoryBlock)+size;
 
+    sgrep_lock(sgrep);
     block->next=sgrep->m_blocks;
     block->prev=NULL;    
     if (sgrep->m_blocks) sgrep->m_blocks->prev=block;
@@ -376,6 +449,7 @@ void *sgrep_debug_malloc(SgrepData *sgrep,size_t size,
     if (stats.memory_allocated>stats.peak_memory_usage) {
 	stats.peak_memory_usage=stats.memory_allocated;
     }
+    sgrep_unlock(sgrep);
     return block+1;
 }
 
@@ -395,6 +469,7 @@ void sgrep_debug_free(SgrepData *sgrep, void *ptr) {
     }
     block=((MemoryBlock *)ptr)-1;
     assert(block->magic==91172);
+    sgrep_lock(sgrep);
     if (block->next) {
 	block->next->prev=block->prev;
     }
@@ -408,6 +483,7 @@ void sgrep_debug_free(SgrepData *sgrep, void *ptr) {
     }
     stats.memory_blocks--;
     stats.memory_allocated-=block->size;
+    sgrep_unlock(sgrep);
     block->magic=0;
     block->file=NULL;
     block->line=0;
@@ -445,15 +521,18 @@ void *sgrep_debug_realloc(SgrepData *sgrep,void *ptr,size_t size)
     }
     old_block=((MemoryBlock *)ptr)-1;
     assert(old_block->magic==91172);
+    /* The neighbours in the block list may be changed while the block
+     * is moved, so the list is kept locked */
+    sgrep_lock(sgrep);
 	old_block->magic=0;
     new_block=(MemoryBlock *)realloc(old_block,size+sizeof(MemoryBlock));
-	new_block->magic=91172;
 
     if (new_block==NULL)
     {
 	perror("realloc");
 	abort();
     }
+	new_block->magic=91172;
     if (new_block!=old_block) {
 	if (new_block->next) new_block->next->prev=new_block;
 	if (new_block->prev) new_block->prev->next=new_block;
@@ -467,6 +546,7 @@ void *sgrep_debug_realloc(SgrepData *sgrep,void *ptr,size_t size)
     if (stats.memory_allocated>stats.peak_memory_usage) {
 	stats.peak_memory_usage=stats.memory_allocated;
     }
+    sgrep_unlock(sgrep);
     return new_block+1;
 }
 
@@ -506,3 +586,304 @@ void check_memory_leaks(SgrepData *sgrep) {
 }
 
 #endif /* MEMORY_DEBUG */
+
+#if HAVE_OPEN_MEMSTREAM
+/*
+ * Frees the buffer of a stream opened with open_memstream(). It is
+ * allocated by the C library, so it isn't in the memory bookkeeping.
+ */
+void free_memstream_buffer(char *buf) {
+    free(buf);
+}
+#endif
+
+/*
+ * Merge kernels. count_below() gives the number of elements in the
+ * sorted array a[0..n-1] which are smaller than key. It is the inner
+ * loop of or(), equal() and eval_near() on contiguous lists, which
+ * copy or skip whole runs of regions with it.
+ */
+static int count_below_scalar(const Offset *a, int n, Offset key) {
+    int i=0;
+    while(i<n && a[i]<key) i++;
+    return i;
+}
+
+static const MergeKernel scalar_kernel={ "scalar", count_below_scalar };
+
+#ifdef USE_AVX2_KERNELS
+#include <immintrin.h>
+
+/*
+ * Compares a block of offsets at once against the key. Because the
+ * array is sorted, the first lane not smaller than key ends the run
+ */
+__attribute__((target("avx2")))
+static int count_below_avx2(const Offset *a, int n, Offset key) {
+    int i=0;
+    int mask;
+#if LARGE_OFFSETS
+    __m256i k=_mm256_set1_epi64x(key);
+
+    for(;i+4<=n;i+=4) {
+	__m256i v=_mm256_loadu_si256((const __m256i *)(a+i));
+	mask=_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k,v)));
+	if (mask!=0xf) return i+__builtin_ctz(~mask);
+    }
+#else
+    __m256i k=_mm256_set1_epi32(key);
+
+    for(;i+8<=n;i+=8) {
+	__m256i v=_mm256_loadu_si256((const __m256i *)(a+i));
+	mask=_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k,v)));
+	if (mask!=0xff) return i+__builtin_ctz(~mask);
+    }
+#endif
+    while(i<n && a[i]<key) i++;
+    return i;
+}
+
+static const MergeKernel avx2_kernel={ "avx2", count_below_avx2 };
+#endif
+
+/*
+ * Byte kernels. find_bytes() searches for the first of a small set of
+ * bytes. It is the prefilter of the phrase scanner in pmatch.c, which
+ * skips with it the bytes no phrase can start with.
+ */
+static Offset find_bytes_scalar(const unsigned char *buf, Offset len,
+				const unsigned char *set, int n) {
+    Offset i;
+    int k;
+
+    for(i=0;i<len;i++) {
+	for(k=0;k<n;k++) if (buf[i]==set[k]) return i;
+    }
+    return len;
+}
+
+#ifndef __SSE2__
+static const ByteKernel scalar_byte_kernel={ "scalar", find_bytes_scalar };
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/*
+ * Compares 16 bytes at once against every byte of the set
+ */
+static Offset find_bytes_sse2(const unsigned char *buf, Offset len,
+			      const unsigned char *set, int n) {
+    __m128i s[BYTE_KERNEL_MAX_SET];
+    Offset i;
+    int k,mask;
+
+    for(k=0;k<n;k++) s[k]=_mm_set1_epi8(set[k]);
+    for(i=0;i+16<=len;i+=16) {
+	__m128i v=_mm_loadu_si128((const __m128i *)(buf+i));
+	__m128i m=_mm_cmpeq_epi8(v,s[0]);
+	for(k=1;k<n;k++) m=_mm_or_si128(m,_mm_cmpeq_epi8(v,s[k]));
+	mask=_mm_movemask_epi8(m);
+	if (mask) return i+__builtin_ctz(mask);
+    }
+    return i+find_bytes_scalar(buf+i,len-i,set,n);
+}
+
+static const ByteKernel sse2_byte_kernel={ "sse2", find_bytes_sse2 };
+#endif
+
+#ifdef USE_AVX2_KERNELS
+__attribute__((target("avx2")))
+static Offset find_bytes_avx2(const unsigned char *buf, Offset len,
+			      const unsigned char *set, int n) {
+    __m256i s[BYTE_KERNEL_MAX_SET];
+    Offset i;
+    int k;
+    unsigned int mask;
+
+    for(k=0;k<n;k++) s[k]=_mm256_set1_epi8(set[k]);
+    for(i=0;i+32<=len;i+=32) {
+	__m256i v=_mm256_loadu_si256((const __m256i *)(buf+i));
+	__m256i m=_mm256_cmpeq_epi8(v,s[0]);
+	for(k=1;k<n;k++) m=_mm256_or_si256(m,_mm256_cmpeq_epi8(v,s[k]));
+	mask=(unsigned int)_mm256_movemask_epi8(m);
+	if (mask) return i+__builtin_ctz(mask);
+    }
+    return i+find_bytes_scalar(buf+i,len-i,set,n);
+}
+
+static const ByteKernel avx2_byte_kernel={ "avx2", find_bytes_avx2 };
+#endif
+
+/*
+ * Class kernels. find_class() searches for the first byte of a class,
+ * which is any set of ASCII bytes plus all the bytes 0x80-0xff. The SGML
+ * scanner skips with it runs of plain text and of word characters.
+ * find_class16() is the same for UTF-16 code units.
+ */
+void make_byte_class(ByteClass *c, const unsigned char *member) {
+    int b;
+
+    memset(c->nibble,0,sizeof(c->nibble));
+    for(b=0;b<256;b++) {
+	c->member[b]=(b>=0x80 || member[b]);
+	if (b<0x80 && member[b]) c->nibble[b&15]|=1<<(b>>4);
+    }
+}
+
+static Offset find_class_scalar(const unsigned char *buf, Offset len,
+				const ByteClass *c) {
+    Offset i;
+
+    for(i=0;i<len;i++) if (c->member[buf[i]]) return i;
+    return len;
+}
+
+static Offset find_class16_scalar(const unsigned char *buf, Offset n,
+				  const ByteClass *c, int big_endian) {
+    const unsigned char *low=buf+(big_endian ? 1 : 0);
+    const unsigned char *high=buf+(big_endian ? 0 : 1);
+    Offset i;
+
+    for(i=0;i<n;i++) {
+	if (high[2*i] || c->member[low[2*i]]) return i;
+    }
+    return n;
+}
+
+static const ClassKernel scalar_class_kernel={
+    "scalar", find_class_scalar, find_class16_scalar };
+
+#ifdef USE_AVX2_KERNELS
+#include <tmmintrin.h>
+
+/*
+ * Looks up the low and the high nibble of 16 bytes at once with pshufb.
+ * A byte is in the class when the two lookups share a bit. The high
+ * nibble table only has bits for ASCII, the sign bit catches the rest.
+ * Gives the mask of the bytes in the class
+ */
+__attribute__((target("ssse3")))
+static int class_mask_ssse3(__m128i v, __m128i lo) {
+    __m128i hi=_mm_setr_epi8(1,2,4,8,16,32,64,-128,0,0,0,0,0,0,0,0);
+    __m128i low4=_mm_set1_epi8(0x0f);
+    __m128i l=_mm_shuffle_epi8(lo,_mm_and_si128(v,low4));
+    __m128i h=_mm_shuffle_epi8(hi,_mm_and_si128(_mm_srli_epi16(v,4),low4));
+    __m128i out=_mm_cmpeq_epi8(_mm_and_si128(l,h),_mm_setzero_si128());
+
+    return (~_mm_movemask_epi8(out) | _mm_movemask_epi8(v)) & 0xffff;
+}
+
+__attribute__((target("ssse3")))
+static Offset find_class_ssse3(const unsigned char *buf, Offset len,
+			       const ByteClass *c) {
+    __m128i lo=_mm_loadu_si128((const __m128i *)c->nibble);
+    Offset i;
+    int mask;
+
+    for(i=0;i+16<=len;i+=16) {
+	mask=class_mask_ssse3(_mm_loadu_si128((const __m128i *)(buf+i)),lo);
+	if (mask) return i+__builtin_ctz(mask);
+    }
+    return i+find_class_scalar(buf+i,len-i,c);
+}
+
+/*
+ * Packs the low and the high bytes of 16 code units to vectors of
+ * their own. The unit is in the class when its low byte is or its high
+ * byte is not zero
+ */
+__attribute__((target("ssse3")))
+static Offset find_class16_ssse3(const unsigned char *buf, Offset n,
+				 const ByteClass *c, int big_endian) {
+    __m128i lo=_mm_loadu_si128((const __m128i *)c->nibble);
+    __m128i low8=_mm_set1_epi16(0xff);
+    Offset i;
+    int mask;
+
+    for(i=0;i+16<=n;i+=16) {
+	__m128i v0=_mm_loadu_si128((const __m128i *)(buf+2*i));
+	__m128i v1=_mm_loadu_si128((const __m128i *)(buf+2*i+16));
+	__m128i even=_mm_packus_epi16(_mm_and_si128(v0,low8),
+				      _mm_and_si128(v1,low8));
+	__m128i odd=_mm_packus_epi16(_mm_srli_epi16(v0,8),
+				     _mm_srli_epi16(v1,8));
+	__m128i low=big_endian ? odd : even;
+	__m128i high=big_endian ? even : odd;
+	mask=class_mask_ssse3(low,lo) |
+	    (~_mm_movemask_epi8(_mm_cmpeq_epi8(high,_mm_setzero_si128())) &
+	     0xffff);
+	if (mask) return i+__builtin_ctz(mask);
+    }
+    return i+find_class16_scalar(buf+2*i,n-i,c,big_endian);
+}
+
+static const ClassKernel ssse3_class_kernel={
+    "ssse3", find_class_ssse3, find_class16_ssse3 };
+
+__attribute__((target("avx2")))
+static Offset find_class_avx2(const unsigned char *buf, Offset len,
+			      const ByteClass *c) {
+    __m256i lo=_mm256_broadcastsi128_si256(
+	_mm_loadu_si128((const __m128i *)c->nibble));
+    __m256i hi=_mm256_setr_epi8(1,2,4,8,16,32,64,-128,0,0,0,0,0,0,0,0,
+				1,2,4,8,16,32,64,-128,0,0,0,0,0,0,0,0);
+    __m256i low4=_mm256_set1_epi8(0x0f);
+    __m256i zero=_mm256_setzero_si256();
+    Offset i;
+    unsigned int mask;
+
+    for(i=0;i+32<=len;i+=32) {
+	__m256i v=_mm256_loadu_si256((const __m256i *)(buf+i));
+	__m256i l=_mm256_shuffle_epi8(lo,_mm256_and_si256(v,low4));
+	__m256i h=_mm256_shuffle_epi8(hi,
+	    _mm256_and_si256(_mm256_srli_epi16(v,4),low4));
+	__m256i out=_mm256_cmpeq_epi8(_mm256_and_si256(l,h),zero);
+	mask=~(unsigned int)_mm256_movemask_epi8(out) |
+	    (unsigned int)_mm256_movemask_epi8(v);
+	if (mask) return i+__builtin_ctz(mask);
+    }
+    return i+find_class_ssse3(buf+i,len-i,c);
+}
+
+static const ClassKernel avx2_class_kernel={
+    "avx2", find_class_avx2, find_class16_ssse3 };
+#endif
+
+/*
+ * Selects the best merge kernel the processor can run
+ */
+const MergeKernel *select_merge_kernel(void) {
+#ifdef USE_AVX2_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return &avx2_kernel;
+#endif
+    return &scalar_kernel;
+}
+
+/*
+ * Selects the best byte kernel the processor can run
+ */
+const ByteKernel *select_byte_kernel(void) {
+#ifdef USE_AVX2_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return &avx2_byte_kernel;
+#endif
+#ifdef __SSE2__
+    return &sse2_byte_kernel;
+#else
+    return &scalar_byte_kernel;
+#endif
+}
+
+/*
+ * Selects the best class kernel the processor can run
+ */
+const ClassKernel *select_class_kernel(void) {
+#ifdef USE_AVX2_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return &avx2_class_kernel;
+    if (__builtin_cpu_supports("ssse3")) return &ssse3_class_kernel;
+#endif
+    return &scalar_class_kernel;
+}
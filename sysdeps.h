@@ -74,6 +74,47 @@
  */
 #define OPTIMIZE_SORTS
 
+/*
+ * Use POSIX threads for parallel work, if they are available
+ */
+#if HAVE_PTHREAD_H && HAVE_LIBPTHREAD
+# define USE_THREADS
+#endif
+#define MAX_THREADS 64
+
+/*
+ * Region lists are sorted with radix sort. Define this to use the old
+ * quicksort instead (for comparing the two)
+ */
+/* #define SORT_WITH_QSORT */
+
+/*
+ * How many bytes the entries of the subexpression cache (-k) may take
+ */
+#ifndef SUBEXPR_CACHE_SIZE
+# define SUBEXPR_CACHE_SIZE (256*1024*1024)
+#endif
+
+/*
+ * Lists having more regions than this are radix sorted in parallel
+ */
+#define PARALLEL_SORT_LIMIT (1<<18)
+
+/*
+ * Inputs of several files larger than this are scanned in parallel
+ */
+#define PARALLEL_SCAN_LIMIT (1<<20)
+
+/*
+ * Build AVX2 versions of the merge kernels, when the compiler can
+ * target AVX2 for single functions. Whether they are used is decided at
+ * run time, see select_merge_kernel()
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__>4 || (__GNUC__==4 && __GNUC_MINOR__>=9))
+# define USE_AVX2_KERNELS
+#endif
+
 /* 
  * Sgrep has some very heavy assertion which slow sgrep down considerably.
  * However, since this is a development version of sgrep, i suggest that